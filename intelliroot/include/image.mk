@@ -94,26 +94,39 @@ define Image/BuildKernel/MkFIT
 	PATH=$(LINUX_DIR)/scripts/dtc:$(PATH) mkimage -f $(KDIR)/fit-$(1).its $(KDIR)/fit-$(1)$(7).itb
 endef
 
+# $(1): erase block size, $(2): image name, $(3): mkfs.jffs2 options
+define Image/mkfs/jffs2/raw
+$(STAGING_DIR_HOST)/bin/mkfs.jffs2 $(3) -e $(patsubst %k,%KiB,$(1)) -o $(KDIR)/root.jffs2-$(2)-raw -d $(TARGET_DIR) -v 2>&1 1>/dev/null | awk '/^.+$$$$/' & pids="$$$$pids $$$$!";
+endef
+
+# run the mkfs.jffs2 invocations given in $(1) in parallel
+define Image/mkfs/jffs2/gen
+		pids=; $(1) for pid in $$$$pids; do wait $$$$pid || exit 1; done
+endef
+
+# the padded image is the raw one padded to the erase block size with the
+# jffs2 end-of-filesystem mark appended, no need to build the tree again
 define Image/mkfs/jffs2/sub
-		# FIXME: removing this line will cause strange behaviour in the foreach loop below
-		$(STAGING_DIR_HOST)/bin/mkfs.jffs2 $(3) --pad -e $(patsubst %k,%KiB,$(1)) -o $(KDIR)/root.jffs2-$(2) -d $(TARGET_DIR) -v 2>&1 1>/dev/null | awk '/^.+$$$$/'
-		$(STAGING_DIR_HOST)/bin/mkfs.jffs2 $(3) -e $(patsubst %k,%KiB,$(1)) -o $(KDIR)/root.jffs2-$(2)-raw -d $(TARGET_DIR) -v 2>&1 1>/dev/null | awk '/^.+$$$$/'
-		$(call add_jffs2_mark,$(KDIR)/root.jffs2-$(2))
+
+		cp $(KDIR)/root.jffs2-$(2)-raw $(KDIR)/root.jffs2-$(2)
+		$(STAGING_DIR_HOST)/bin/padjffs2 $(KDIR)/root.jffs2-$(2) $(patsubst %k,%,$(1)) >/dev/null
 		$(call Image/Build,jffs2-$(2))
 endef
 
 ifneq ($(CONFIG_TARGET_ROOTFS_JFFS2),)
     define Image/mkfs/jffs2
-		$(foreach SZ,$(JFFS2_BLOCKSIZE),$(call Image/mkfs/jffs2/sub,$(SZ),$(SZ),$(JFFS2OPTS)))
+		$(call Image/mkfs/jffs2/gen,$(foreach SZ,$(JFFS2_BLOCKSIZE),$(call Image/mkfs/jffs2/raw,$(SZ),$(SZ),$(JFFS2OPTS))))
+		$(foreach SZ,$(JFFS2_BLOCKSIZE),$(call Image/mkfs/jffs2/sub,$(SZ),$(SZ)))
     endef
 endif
 
 ifneq ($(CONFIG_TARGET_ROOTFS_JFFS2_NAND),)
     define Image/mkfs/jffs2_nand
-		$(foreach SZ,$(NAND_BLOCKSIZE), $(call Image/mkfs/jffs2/sub, \
+		$(call Image/mkfs/jffs2/gen,$(foreach SZ,$(NAND_BLOCKSIZE),$(call Image/mkfs/jffs2/raw, \
 			$(word 2,$(subst :, ,$(SZ))),nand-$(subst :,-,$(SZ)), \
-			$(JFFS2OPTS) --no-cleanmarkers --pagesize=$(word 1,$(subst :, ,$(SZ)))) \
-		)
+			$(JFFS2OPTS) --no-cleanmarkers --pagesize=$(word 1,$(subst :, ,$(SZ))))))
+		$(foreach SZ,$(NAND_BLOCKSIZE),$(call Image/mkfs/jffs2/sub, \
+			$(word 2,$(subst :, ,$(SZ))),nand-$(subst :,-,$(SZ))))
     endef
 endif
 
@@ -37,7 +37,22 @@
  *      polynomial $edb88320
  */
 
+/*
+ * mtd, firmware-utils and rbcfg each carry an identical copy of this
+ * file. The cyg_crc32.c wrappers in the latter two build on it. Keep
+ * the copies in sync.
+ */
+
 #include <stdint.h>
+#include <string.h>
+#include <pthread.h>
+#include "crc32.h"
+
+#if defined(__ARM_FEATURE_CRC32) && \
+    defined(__BYTE_ORDER__) && __BYTE_ORDER__ == __ORDER_LITTLE_ENDIAN__
+#define CRC32_ARM64	1
+#include <arm_acle.h>
+#endif
 
 const uint32_t crc32_table[256] = {
 	0x00000000L, 0x77073096L, 0xee0e612cL, 0x990951baL, 0x076dc419L,
@@ -93,3 +108,139 @@ const uint32_t crc32_table[256] = {
 	0x5d681b02L, 0x2a6f2b94L, 0xb40bbe37L, 0xc30c8ea1L, 0x5a05df1bL,
 	0x2d02ef8dL
 };
+
+#ifdef CRC32_ARM64
+
+/*
+ * ARMv8 has the reflected CRC32 polynomial as an instruction. __crc32d
+ * consumes the first byte from the low bits, so this is little-endian only.
+ */
+uint32_t
+crc32_update(uint32_t val, const void *ss, int len)
+{
+	const unsigned char *s = ss;
+	uint64_t word;
+
+	for (; len > 0 && ((uintptr_t) s & 7); len--)
+		val = __crc32b(val, *s++);
+	for (; len >= 8; len -= 8, s += 8) {
+		memcpy(&word, s, sizeof(word));
+		val = __crc32d(val, word);
+	}
+	while (--len >= 0)
+		val = __crc32b(val, *s++);
+
+	return val;
+}
+
+#else
+
+/*
+ * Slice-by-8: crc32_slice[n][b] is the CRC contribution of byte b followed
+ * by n zero bytes, which lets the loop consume 8 bytes per iteration with
+ * independent table lookups. The byte loads keep it endian neutral.
+ */
+static uint32_t crc32_slice[8][256];
+static pthread_once_t crc32_slice_once = PTHREAD_ONCE_INIT;
+
+static void
+crc32_slice_init(void)
+{
+	int i, n;
+
+	for (i = 0; i < 256; i++) {
+		crc32_slice[0][i] = crc32_table[i];
+		for (n = 1; n < 8; n++)
+			crc32_slice[n][i] = crc32_table[crc32_slice[n - 1][i] & 0xff] ^
+				(crc32_slice[n - 1][i] >> 8);
+	}
+}
+
+uint32_t
+crc32_update(uint32_t val, const void *ss, int len)
+{
+	const unsigned char *s = ss;
+	uint32_t one;
+
+	pthread_once(&crc32_slice_once, crc32_slice_init);
+
+	for (; len >= 8; len -= 8, s += 8) {
+		one = val ^ (s[0] | (s[1] << 8) | (s[2] << 16) | ((uint32_t) s[3] << 24));
+		val = crc32_slice[7][one & 0xff] ^
+		      crc32_slice[6][(one >> 8) & 0xff] ^
+		      crc32_slice[5][(one >> 16) & 0xff] ^
+		      crc32_slice[4][one >> 24] ^
+		      crc32_slice[3][s[4]] ^
+		      crc32_slice[2][s[5]] ^
+		      crc32_slice[1][s[6]] ^
+		      crc32_slice[0][s[7]];
+	}
+	while (--len >= 0)
+		val = crc32_table[(val ^ *s++) & 0xff] ^ (val >> 8);
+
+	return val;
+}
+
+#endif
+
+/*
+ * Appending zero bytes to a message is a linear operation on the CRC
+ * register, so it can be applied in O(log n) by squaring the GF(2)
+ * matrix for a single zero bit (same approach as zlib's crc32_combine).
+ */
+static uint32_t
+gf2_matrix_times(const uint32_t *mat, uint32_t vec)
+{
+	uint32_t sum = 0;
+
+	for (; vec; vec >>= 1, mat++)
+		if (vec & 1)
+			sum ^= *mat;
+
+	return sum;
+}
+
+static void
+gf2_matrix_square(uint32_t *square, const uint32_t *mat)
+{
+	int n;
+
+	for (n = 0; n < 32; n++)
+		square[n] = gf2_matrix_times(mat, mat[n]);
+}
+
+uint32_t
+crc32_zeros(uint32_t val, size_t len)
+{
+	uint32_t even[32], odd[32];
+	uint32_t row = 1;
+	int n;
+
+	if (!len)
+		return val;
+
+	/* operator for one zero bit */
+	odd[0] = 0xedb88320;
+	for (n = 1; n < 32; n++, row <<= 1)
+		odd[n] = row;
+
+	/* two and four zero bits */
+	gf2_matrix_square(even, odd);
+	gf2_matrix_square(odd, even);
+
+	do {
+		gf2_matrix_square(even, odd);
+		if (len & 1)
+			val = gf2_matrix_times(even, val);
+		len >>= 1;
+		if (!len)
+			break;
+
+		gf2_matrix_square(odd, even);
+		if (len & 1)
+			val = gf2_matrix_times(odd, val);
+		len >>= 1;
+	} while (len);
+
+	return val;
+}
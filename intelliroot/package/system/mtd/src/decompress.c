@@ -0,0 +1,319 @@
+/*
+ * decompress.c - on-the-fly decompression of images for mtd write
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License v2
+ * as published by the Free Software Foundation.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * A compressed image is unpacked by a child process that feeds the
+ * plain data into a pipe, so the rest of mtd (header checks, the write
+ * loop) reads from an ordinary fd and decompression overlaps with the
+ * flash erase/write cycle without needing a temporary copy of the image.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <errno.h>
+#include <signal.h>
+#include <stdint.h>
+#include <sys/types.h>
+#include <sys/wait.h>
+#ifdef ZLIB_SUPPORT
+#define crc32 zlib_crc32
+#include <zlib.h>
+#undef crc32
+#endif
+#include "mtd.h"
+
+enum {
+	COMP_NONE,
+	COMP_GZIP,
+	COMP_XZ,
+	COMP_LZMA,
+};
+
+static const struct {
+	const char *name;
+	const char *cmd;
+} comp_types[] = {
+	[COMP_NONE] = { "none", NULL },
+	[COMP_GZIP] = { "gzip", "zcat" },
+	[COMP_XZ] = { "xz", "xzcat" },
+	[COMP_LZMA] = { "lzma", "lzcat" },
+};
+
+static pid_t decomp_pid = -1;
+
+static int
+comp_detect(const unsigned char *magic, int len)
+{
+	uint32_t dict;
+
+	if (len >= 2 && magic[0] == 0x1f && magic[1] == 0x8b)
+		return COMP_GZIP;
+
+	if (len >= 6 && !memcmp(magic, "\xfd" "7zXZ\x00", 6))
+		return COMP_XZ;
+
+	/*
+	 * lzma alone: properties byte and a dictionary size of 2^n or
+	 * 2^n + 2^(n-1), which is what the encoders write
+	 */
+	if (len >= 5 && magic[0] == 0x5d) {
+		dict = magic[1] | (magic[2] << 8) | (magic[3] << 16) |
+		       ((uint32_t) magic[4] << 24);
+		if (!(dict % 3))
+			dict /= 3;
+		if (dict && !(dict & (dict - 1)))
+			return COMP_LZMA;
+	}
+
+	return COMP_NONE;
+}
+
+static int
+write_full(int fd, const void *data, size_t len)
+{
+	const char *p = data;
+	ssize_t r;
+
+	while (len > 0) {
+		r = write(fd, p, len);
+		if (r < 0) {
+			if (errno == EINTR)
+				continue;
+			return -1;
+		}
+		p += r;
+		len -= r;
+	}
+
+	return 0;
+}
+
+static int
+copy_data(int in, int out, const unsigned char *prefix, int len)
+{
+	char buf[65536];
+	ssize_t r;
+
+	if (len && write_full(out, prefix, len))
+		return -1;
+
+	for (;;) {
+		r = read(in, buf, sizeof(buf));
+		if (r < 0) {
+			if ((errno == EINTR) || (errno == EAGAIN))
+				continue;
+			return -1;
+		}
+		if (!r)
+			return 0;
+		if (write_full(out, buf, r))
+			return -1;
+	}
+}
+
+#ifdef ZLIB_SUPPORT
+/* Top up the input so that at least want bytes are available, unless EOF */
+static int
+gunzip_fill(int in, unsigned char *buf, size_t size, z_stream *zs,
+	    unsigned int want)
+{
+	ssize_t r;
+
+	memmove(buf, zs->next_in, zs->avail_in);
+	zs->next_in = buf;
+	while (zs->avail_in < want) {
+		r = read(in, buf + zs->avail_in, size - zs->avail_in);
+		if (r < 0) {
+			if ((errno == EINTR) || (errno == EAGAIN))
+				continue;
+			return -1;
+		}
+		if (!r)
+			break;
+		zs->avail_in += r;
+	}
+
+	return zs->avail_in;
+}
+
+static int
+gunzip_data(int in, int out, const unsigned char *prefix, int len)
+{
+	unsigned char ibuf[16384], obuf[65536];
+	z_stream zs;
+	ssize_t r;
+	int ret;
+
+	memset(&zs, 0, sizeof(zs));
+	if (inflateInit2(&zs, 16 + MAX_WBITS) != Z_OK)
+		return -1;
+
+	memcpy(ibuf, prefix, len);
+	zs.next_in = ibuf;
+	zs.avail_in = len;
+
+	for (;;) {
+		if (!zs.avail_in && gunzip_fill(in, ibuf, sizeof(ibuf), &zs, 1) <= 0)
+			goto error;
+
+		zs.next_out = obuf;
+		zs.avail_out = sizeof(obuf);
+		ret = inflate(&zs, Z_NO_FLUSH);
+		if (ret != Z_OK && ret != Z_STREAM_END)
+			goto error;
+
+		if (write_full(out, obuf, sizeof(obuf) - zs.avail_out))
+			goto error;
+
+		if (ret != Z_STREAM_END)
+			continue;
+
+		/*
+		 * Concatenated gzip members continue the stream. Anything
+		 * else is trailing padding or metadata and ends the image.
+		 */
+		r = gunzip_fill(in, ibuf, sizeof(ibuf), &zs, 2);
+		if (r < 0)
+			goto error;
+		if (r < 2 || zs.next_in[0] != 0x1f || zs.next_in[1] != 0x8b)
+			break;
+		inflateReset(&zs);
+	}
+
+	/* drain the rest so that a feeding pipe is not cut off */
+	while ((r = read(in, ibuf, sizeof(ibuf))) != 0)
+		if (r < 0 && errno != EINTR && errno != EAGAIN)
+			break;
+
+	inflateEnd(&zs);
+	return 0;
+
+error:
+	inflateEnd(&zs);
+	return -1;
+}
+#endif
+
+/* runs in the child: write the uncompressed image to out */
+static int
+decompress_child(int in, int out, int type, const unsigned char *prefix, int len)
+{
+	int fpipe[2];
+
+#ifdef ZLIB_SUPPORT
+	if (type == COMP_GZIP)
+		return gunzip_data(in, out, prefix, len);
+#endif
+
+	if (type == COMP_NONE)
+		return copy_data(in, out, prefix, len);
+
+	/* the external tool also needs the bytes consumed by the detection */
+	if (len) {
+		if (pipe(fpipe))
+			return -1;
+
+		switch (fork()) {
+		case -1:
+			return -1;
+		case 0:
+			close(fpipe[0]);
+			close(out);
+			_exit(copy_data(in, fpipe[1], prefix, len) ? 1 : 0);
+		default:
+			close(fpipe[1]);
+			close(in);
+			in = fpipe[0];
+		}
+	}
+
+	dup2(in, 0);
+	dup2(out, 1);
+	signal(SIGPIPE, SIG_DFL);
+	execlp(comp_types[type].cmd, comp_types[type].cmd, NULL);
+	fprintf(stderr, "Failed to run %s\n", comp_types[type].cmd);
+	return -1;
+}
+
+/*
+ * Check the image for a known compression format. Returns the fd to read
+ * the uncompressed image from, which is the original fd for plain images.
+ */
+int
+image_decompress(int fd)
+{
+	unsigned char magic[6];
+	int pfd[2];
+	int len = 0, type;
+	ssize_t r;
+
+	while (len < sizeof(magic)) {
+		r = read(fd, magic + len, sizeof(magic) - len);
+		if (r < 0) {
+			if ((errno == EINTR) || (errno == EAGAIN))
+				continue;
+			return -1;
+		}
+		if (!r)
+			break;
+		len += r;
+	}
+
+	type = comp_detect(magic, len);
+
+	/* rewind where possible, so that nothing has to be replayed */
+	if (lseek(fd, 0, SEEK_SET) == 0)
+		len = 0;
+
+	if (type == COMP_NONE && !len)
+		return fd;
+
+	if (type != COMP_NONE && quiet < 2)
+		fprintf(stderr, "Decompressing %s image on the fly\n", comp_types[type].name);
+
+	if (pipe(pfd))
+		return -1;
+
+	decomp_pid = fork();
+	if (decomp_pid < 0) {
+		close(pfd[0]);
+		close(pfd[1]);
+		return -1;
+	}
+
+	if (!decomp_pid) {
+		close(pfd[0]);
+		_exit(decompress_child(fd, pfd[1], type, magic, len) ? 1 : 0);
+	}
+
+	close(pfd[1]);
+	close(fd);
+	return pfd[0];
+}
+
+/* Wait for the decompressor to finish, returns nonzero if it failed. */
+int
+image_decompress_finish(void)
+{
+	int status;
+
+	if (decomp_pid <= 0)
+		return 0;
+
+	while (waitpid(decomp_pid, &status, 0) < 0)
+		if (errno != EINTR)
+			return -1;
+
+	decomp_pid = -1;
+	return !WIFEXITED(status) || WEXITSTATUS(status);
+}
@@ -12,7 +12,6 @@
  * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
  * GNU General Public License for more details.
  */
-#include <sys/mman.h>
 #include <stdint.h>
 #include <stdlib.h>
 #include <string.h>
@@ -44,28 +43,61 @@ struct fis_image_desc {
 
 static int fis_fd = -1;
 static struct fis_image_desc *fis_desc;
+static char *fis_orig;
 static int fis_erasesize = 0;
 
+/* entries of the directory, sorted by name for lookups */
+static struct fis_image_desc **fis_index;
+static int fis_count;
+
 static void
 fis_close(void)
 {
-	if (fis_desc)
-		munmap(fis_desc, fis_erasesize);
+	free(fis_desc);
+	free(fis_orig);
+	free(fis_index);
 
 	if (fis_fd >= 0)
 		close(fis_fd);
 
 	fis_fd = -1;
 	fis_desc = NULL;
+	fis_orig = NULL;
+	fis_index = NULL;
+	fis_count = 0;
+}
+
+static int
+fis_name_cmp(const void *a, const void *b)
+{
+	const struct fis_image_desc *da = *(const struct fis_image_desc **) a;
+	const struct fis_image_desc *db = *(const struct fis_image_desc **) b;
+
+	return strncmp((char *) da->hdr.name, (char *) db->hdr.name, sizeof(da->hdr.name));
+}
+
+static struct fis_image_desc *
+fis_find(const unsigned char *name)
+{
+	struct fis_image_desc key, *keyp = &key, **res;
+
+	memcpy(key.hdr.name, name, sizeof(key.hdr.name));
+	res = bsearch(&keyp, fis_index, fis_count, sizeof(*fis_index), fis_name_cmp);
+
+	return res ? *res : NULL;
 }
 
+/*
+ * Read the directory once into memory and index it. Changes are applied
+ * to this copy and only written back by fis_commit() if anything differs.
+ */
 static struct fis_image_desc *
 fis_open(void)
 {
-	struct fis_image_desc *desc;
+	struct fis_image_desc *desc, *end;
 
-	if (fis_fd >= 0)
-		fis_close();
+	if (fis_desc)
+		return fis_desc;
 
 	fis_fd = mtd_check_open("FIS directory");
 	if (fis_fd < 0)
@@ -77,23 +109,55 @@ fis_open(void)
 		goto error;
 
 	fis_erasesize = erasesize;
-	desc = mmap(NULL, erasesize, PROT_READ|PROT_WRITE, MAP_SHARED|MAP_LOCKED, fis_fd, 0);
-	if (desc == MAP_FAILED)
+	fis_desc = malloc(fis_erasesize);
+	fis_orig = malloc(fis_erasesize);
+	fis_index = malloc(fis_erasesize / sizeof(struct fis_image_desc) * sizeof(*fis_index));
+	if (!fis_desc || !fis_orig || !fis_index)
 		goto error;
 
-	fis_desc = desc;
-	return desc;
+	if (pread(fis_fd, fis_desc, fis_erasesize, 0) != fis_erasesize)
+		goto error;
+
+	memcpy(fis_orig, fis_desc, fis_erasesize);
+
+	end = (struct fis_image_desc *) ((char *) fis_desc + fis_erasesize);
+	for (desc = fis_desc; desc < end; desc++) {
+		if (!desc->hdr.name[0] || (desc->hdr.name[0] == 0xff))
+			break;
+
+		fis_index[fis_count++] = desc;
+	}
+	qsort(fis_index, fis_count, sizeof(*fis_index), fis_name_cmp);
+
+	return fis_desc;
 
 error:
 	fis_close();
 	return NULL;
 }
 
+static int
+fis_commit(void)
+{
+	if (!memcmp(fis_desc, fis_orig, fis_erasesize)) {
+		if (!quiet)
+			fprintf(stderr, "FIS table unchanged\n");
+		return 0;
+	}
+
+	/* the block device takes care of erasing and rewriting the block */
+	if (pwrite(fis_fd, fis_desc, fis_erasesize, 0) != fis_erasesize)
+		return -1;
+
+	fsync(fis_fd);
+	memcpy(fis_orig, fis_desc, fis_erasesize);
+	return 0;
+}
+
 int
 fis_validate(struct fis_part *old, int n_old, struct fis_part *new, int n_new)
 {
 	struct fis_image_desc *desc;
-	void *end;
 	int found = 0;
 	int i;
 
@@ -104,36 +168,18 @@ fis_validate(struct fis_part *old, int n_old, struct fis_part *new, int n_new)
 	for (i = 0; i < n_new - 1; i++) {
 		if (!new[i].size) {
 			fprintf(stderr, "FIS error: only the last partition can detect the size automatically\n");
-			i = -1;
-			goto done;
+			fis_close();
+			return -1;
 		}
 	}
 
-	end = desc;
-	end = (char *) end + fis_erasesize;
-	while ((void *) desc < end) {
-		if (!desc->hdr.name[0] || (desc->hdr.name[0] == 0xff))
-			break;
-
-		for (i = 0; i < n_old; i++) {
-			if (!strncmp((char *) desc->hdr.name, (char *) old[i].name, sizeof(desc->hdr.name))) {
-				found++;
-				goto next;
-			}
-		}
-next:
-		desc++;
-		continue;
+	for (i = 0; i < n_old; i++) {
+		if (fis_find(old[i].name))
+			found++;
 	}
 
-	if (found == n_old)
-		i = 1;
-	else
-		i = -1;
-
-done:
-	fis_close();
-	return i;
+	/* the directory stays loaded for fis_remap() */
+	return (found == n_old) ? 1 : -1;
 }
 
 int
@@ -148,8 +194,8 @@ fis_remap(struct fis_part *old, int n_old, struct fis_part *new, int n_new)
 	struct fis_image_desc *desc;
 	struct fis_part *part;
 	uint32_t offset = 0, size = 0;
-	char *start, *end, *tmp;
-	int i;
+	char *end, *tmp;
+	int i, ret;
 
 	desc = fis_open();
 	if (!desc)
@@ -158,33 +204,34 @@ fis_remap(struct fis_part *old, int n_old, struct fis_part *new, int n_new)
 	if (!quiet)
 		fprintf(stderr, "Updating FIS table... \n");
 
-	start = (char *) desc;
 	end = (char *) desc + fis_erasesize;
-	while ((char *) desc < end) {
-		if (!desc->hdr.name[0] || (desc->hdr.name[0] == 0xff))
-			break;
 
-		if (!strcmp((char *) desc->hdr.name, "FIS directory"))
-			fisdir = desc;
+	fisdir = fis_find((const unsigned char *) "FIS directory");
+	redboot = fis_find((const unsigned char *) "RedBoot");
 
-		if (!strcmp((char *) desc->hdr.name, "RedBoot"))
-			redboot = desc;
+	/* max offset of all entries */
+	for (i = 0; i < fis_count; i++) {
+		if (offset < fis_index[i]->hdr.flash_base)
+			offset = fis_index[i]->hdr.flash_base;
+	}
 
-		/* update max offset */
-		if (offset < desc->hdr.flash_base)
-			offset = desc->hdr.flash_base;
+	/* the partitions being replaced, in directory order */
+	for (i = 0; i < n_old; i++) {
+		desc = fis_find(old[i].name);
+		if (!desc)
+			continue;
 
-		for (i = 0; i < n_old; i++) {
-			if (!strncmp((char *) desc->hdr.name, (char *) old[i].name, sizeof(desc->hdr.name))) {
-				last = desc;
-				if (!first)
-					first = desc;
-				break;
-			}
-		}
-		desc++;
+		if (!first || desc < first)
+			first = desc;
+		if (!last || desc > last)
+			last = desc;
+	}
+
+	if (!first) {
+		fprintf(stderr, "FIS error: partitions to replace not found\n");
+		fis_close();
+		return -1;
 	}
-	desc--;
 
 	first_fb = first;
 	last_fb = last;
@@ -195,18 +242,12 @@ fis_remap(struct fis_part *old, int n_old, struct fis_part *new, int n_new)
 	}
 
 	/* determine size of available space */
-	desc = (struct fis_image_desc *) start;
-	while ((char *) desc < end) {
-		if (!desc->hdr.name[0] || (desc->hdr.name[0] == 0xff))
-			break;
-
+	for (i = 0; i < fis_count; i++) {
+		desc = fis_index[i];
 		if (desc->hdr.flash_base > last_fb->hdr.flash_base &&
 		    desc->hdr.flash_base < offset)
 			offset = desc->hdr.flash_base;
-
-		desc++;
 	}
-	desc--;
 
 	size = offset - first_fb->hdr.flash_base;
 
@@ -235,7 +276,7 @@ fis_remap(struct fis_part *old, int n_old, struct fis_part *new, int n_new)
 		memmove(desc, last, end - tmp);
 		if (desc < last) {
 			tmp = end - (last - desc) * sizeof(struct fis_image_desc);
-			memset(tmp, 0xff, tmp - end);
+			memset(tmp, 0xff, end - tmp);
 		}
 	}
 
@@ -255,8 +296,8 @@ fis_remap(struct fis_part *old, int n_old, struct fis_part *new, int n_new)
 		size -= desc->hdr.size;
 	}
 
-	msync(fis_desc, fis_erasesize, MS_SYNC|MS_INVALIDATE);
+	ret = fis_commit();
 	fis_close();
 
-	return 0;
+	return ret;
 }
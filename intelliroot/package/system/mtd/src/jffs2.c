@@ -25,7 +25,14 @@
 #include <string.h>
 #include <dirent.h>
 #include <unistd.h>
+#include <limits.h>
 #include <endian.h>
+#ifdef ZLIB_SUPPORT
+/* keep zlib's crc32() prototype out of the way of the one in crc32.h */
+#define crc32 zlib_crc32
+#include <zlib.h>
+#undef crc32
+#endif
 #include "jffs2.h"
 #include "crc32.h"
 #include "mtd.h"
@@ -41,37 +48,125 @@
 static int last_ino = 0;
 static int last_version = 0;
 static char *buf = NULL;
+static char *stream = NULL;
+static int stream_blocks = 0;
+static int stream_size = 0;
 static int ofs = 0;
 static int outfd = -1;
 static int mtdofs = 0;
 static int target_ino = 0;
+static int save_old = 0;
+int jffs2_zlib = 0;
 
 static void prep_eraseblock(void);
 
-static void pad(int size)
+/* hand the data about to be overwritten to the incremental trx fixup */
+static void save_old_block(void)
 {
-	if ((ofs % size == 0) && (ofs < erasesize))
+	char *old = malloc(erasesize);
+
+	/* without the old data the fixup falls back to a full recompute */
+	if (old && pread(outfd, old, erasesize, mtdofs) != erasesize) {
+		free(old);
+		old = NULL;
+	}
+	trx_fixup_update(mtdofs, old, erasesize);
+	free(old);
+}
+
+/*
+ * The node stream for all files is assembled in memory, one eraseblock
+ * after the other, and only written out by flush_blocks() at the end.
+ */
+static int stream_init(void)
+{
+	stream_size = 4;
+	stream_blocks = 0;
+	stream = malloc(stream_size * erasesize);
+	buf = stream;
+	ofs = 0;
+
+	return stream ? 0 : -1;
+}
+
+static void stream_free(void)
+{
+	free(stream);
+	stream = buf = NULL;
+	stream_blocks = stream_size = 0;
+}
+
+static void queue_block(void)
+{
+	stream_blocks++;
+	if (stream_blocks == stream_size) {
+		char *tmp = realloc(stream, 2 * stream_size * erasesize);
+
+		if (!tmp) {
+			fprintf(stderr, "Out of memory!\n");
+			exit(1);
+		}
+		stream = tmp;
+		stream_size *= 2;
+	}
+	buf = stream + stream_blocks * erasesize;
+}
+
+/* erase all destination blocks first, then write the stream in as few calls as possible */
+static void flush_blocks(void)
+{
+	int *target;
+	int i, n;
+
+	if (!stream_blocks)
 		return;
 
-	if (ofs < erasesize) {
-		memset(buf + ofs, 0xff, (size - (ofs % size)));
-		ofs += (size - (ofs % size));
+	target = malloc(stream_blocks * sizeof(*target));
+	if (!target) {
+		fprintf(stderr, "Out of memory!\n");
+		exit(1);
 	}
-	ofs = ofs % erasesize;
-	if (ofs == 0) {
+
+	for (i = 0; i < stream_blocks; i++) {
 		while (mtd_block_is_bad(outfd, mtdofs) && (mtdofs < mtdsize)) {
 			if (!quiet)
 				fprintf(stderr, "\nSkipping bad block at 0x%08x   ", mtdofs);
 
 			mtdofs += erasesize;
-
-			/* Move the file pointer along over the bad block. */
-			lseek(outfd, erasesize, SEEK_CUR);
 		}
+		if (save_old)
+			save_old_block();
 		mtd_erase_block(outfd, mtdofs);
-		write(outfd, buf, erasesize);
+		target[i] = mtdofs;
 		mtdofs += erasesize;
 	}
+
+	for (i = 0; i < stream_blocks; i = n) {
+		for (n = i + 1; n < stream_blocks; n++)
+			if (target[n] != target[n - 1] + erasesize)
+				break;
+
+		lseek(outfd, target[i], SEEK_SET);
+		write(outfd, stream + i * erasesize, (n - i) * erasesize);
+	}
+
+	free(target);
+	stream_blocks = 0;
+	buf = stream;
+}
+
+static void pad(int size)
+{
+	if ((ofs % size == 0) && (ofs < erasesize))
+		return;
+
+	if (ofs < erasesize) {
+		memset(buf + ofs, 0xff, (size - (ofs % size)));
+		ofs += (size - (ofs % size));
+	}
+	ofs = ofs % erasesize;
+	if (ofs == 0)
+		queue_block();
 }
 
 static inline int rbytes(void)
@@ -100,8 +195,9 @@ static void prep_eraseblock(void)
 static int add_dirent(const char *name, const char type, int parent)
 {
 	struct jffs2_raw_dirent *de;
+	int ino;
 
-	if (ofs - erasesize < sizeof(struct jffs2_raw_dirent) + strlen(name))
+	if (rbytes() < sizeof(struct jffs2_raw_dirent) + strlen(name))
 		pad(erasesize);
 
 	prep_eraseblock();
@@ -124,9 +220,10 @@ static int add_dirent(const char *name, const char type, int parent)
 	memcpy(de->name, name, strlen(name));
 
 	ofs += sizeof(struct jffs2_raw_dirent) + de->nsize;
+	ino = de->ino;
 	pad(4);
 
-	return de->ino;
+	return ino;
 }
 
 static int add_dir(const char *name, int parent)
@@ -160,12 +257,35 @@ static int add_dir(const char *name, int parent)
 	return inode;
 }
 
+#ifdef ZLIB_SUPPORT
+/* returns the compressed length, or 0 if compressing does not pay off */
+static int compress_data(const char *in, int len, char *out, int outlen)
+{
+	uLongf clen = outlen;
+
+	if (compress2((Bytef *) out, &clen, (const Bytef *) in, len, Z_BEST_COMPRESSION) != Z_OK)
+		return 0;
+
+	return (clen < len) ? clen : 0;
+}
+#endif
+
+static const char *base_name(const char *name)
+{
+	const char *fname = strrchr(name, '/');
+
+	return fname ? fname + 1 : name;
+}
+
 static void add_file(const char *name, int parent)
 {
 	int inode, f_offset = 0, fd;
 	struct jffs2_raw_inode ri;
 	struct stat st;
 	char wbuf[4096];
+#ifdef ZLIB_SUPPORT
+	char cbuf[sizeof(wbuf) + 64];
+#endif
 	const char *fname;
 
 	if (stat(name, &st)) {
@@ -173,11 +293,7 @@ static void add_file(const char *name, int parent)
 		return;
 	}
 
-	fname = strrchr(name, '/');
-	if (fname)
-		fname++;
-	else
-		fname = name;
+	fname = base_name(name);
 
 	inode = add_dirent(fname, IFTODT(S_IFREG), parent);
 	memset(&ri, 0, sizeof(ri));
@@ -201,6 +317,7 @@ static void add_file(const char *name, int parent)
 	}
 
 	for (;;) {
+		char *data = wbuf;
 		int len = 0;
 
 		for (;;) {
@@ -215,20 +332,43 @@ static void add_file(const char *name, int parent)
 		if (len > sizeof(wbuf))
 			len = sizeof(wbuf);
 
+#ifdef ZLIB_SUPPORT
+		/* compressed nodes always cover a full page and are never split */
+		if (jffs2_zlib)
+			len = sizeof(wbuf);
+#endif
+
 		len = read(fd, wbuf, len);
 		if (len <= 0)
 			break;
 
-		ri.totlen = sizeof(ri) + len;
+		ri.compr = JFFS2_COMPR_NONE;
+		ri.csize = ri.dsize = len;
+#ifdef ZLIB_SUPPORT
+		if (jffs2_zlib) {
+			int clen = compress_data(wbuf, len, cbuf, sizeof(cbuf));
+
+			if (clen > 0) {
+				ri.compr = JFFS2_COMPR_ZLIB;
+				ri.csize = clen;
+				data = cbuf;
+			}
+		}
+#endif
+		if (rbytes() < sizeof(ri) + ri.csize) {
+			pad(erasesize);
+			prep_eraseblock();
+		}
+
+		ri.totlen = sizeof(ri) + ri.csize;
 		ri.hdr_crc = crc32(0, &ri, sizeof(struct jffs2_unknown_node) - 4);
 		ri.version = ++last_version;
 		ri.offset = f_offset;
-		ri.csize = ri.dsize = len;
 		ri.node_crc = crc32(0, &ri, sizeof(ri) - 8);
-		ri.data_crc = crc32(0, wbuf, len);
+		ri.data_crc = crc32(0, data, ri.csize);
 		f_offset += len;
 		add_data((char *) &ri, sizeof(ri));
-		add_data(wbuf, len);
+		add_data(data, ri.csize);
 		pad(4);
 		prep_eraseblock();
 	}
@@ -236,22 +376,122 @@ static void add_file(const char *name, int parent)
 	close(fd);
 }
 
+static void add_symlink(const char *name, int parent)
+{
+	struct jffs2_raw_inode ri;
+	char target[PATH_MAX];
+	int inode, len;
+
+	len = readlink(name, target, sizeof(target));
+	if (len < 0) {
+		fprintf(stderr, "Cannot read link %s\n", name);
+		return;
+	}
+
+	inode = add_dirent(base_name(name), IFTODT(S_IFLNK), parent);
+
+	if (rbytes() < sizeof(ri) + len)
+		pad(erasesize);
+	prep_eraseblock();
+
+	memset(&ri, 0, sizeof(ri));
+	ri.magic = JFFS2_MAGIC_BITMASK;
+	ri.nodetype = JFFS2_NODETYPE_INODE;
+	ri.totlen = sizeof(ri) + len;
+	ri.hdr_crc = crc32(0, &ri, sizeof(struct jffs2_unknown_node) - 4);
+
+	ri.ino = inode;
+	ri.mode = S_IFLNK | 0777;
+	ri.isize = ri.csize = ri.dsize = len;
+	ri.version = ++last_version;
+	ri.node_crc = crc32(0, &ri, sizeof(ri) - 8);
+	ri.data_crc = crc32(0, target, len);
+
+	add_data((char *) &ri, sizeof(ri));
+	add_data(target, len);
+	pad(4);
+}
+
+static void add_path(const char *name, int parent);
+
+static void add_tree(const char *name, int parent)
+{
+	char path[PATH_MAX];
+	struct dirent *de;
+	DIR *dir;
+	int inode;
+
+	dir = opendir(name);
+	if (!dir) {
+		fprintf(stderr, "Cannot open directory %s\n", name);
+		return;
+	}
+
+	inode = add_dir(base_name(name), parent);
+	while ((de = readdir(dir)) != NULL) {
+		if (!strcmp(de->d_name, ".") || !strcmp(de->d_name, ".."))
+			continue;
+
+		if (snprintf(path, sizeof(path), "%s/%s", name,
+			     de->d_name) >= (int) sizeof(path)) {
+			fprintf(stderr, "Path too long: %s/%s\n", name, de->d_name);
+			continue;
+		}
+		add_path(path, inode);
+	}
+	closedir(dir);
+}
+
+static void add_path(const char *name, int parent)
+{
+	char path[PATH_MAX];
+	struct stat st;
+	int len;
+
+	/* drop trailing slashes so that the last component names the entry */
+	len = snprintf(path, sizeof(path), "%s", name);
+	if (len >= (int) sizeof(path)) {
+		fprintf(stderr, "Path too long: %s\n", name);
+		return;
+	}
+	while (len > 1 && path[len - 1] == '/')
+		path[--len] = 0;
+
+	if (lstat(path, &st)) {
+		fprintf(stderr, "File %s does not exist\n", path);
+		return;
+	}
+
+	if (S_ISDIR(st.st_mode))
+		add_tree(path, parent);
+	else if (S_ISLNK(st.st_mode))
+		add_symlink(path, parent);
+	else if (S_ISREG(st.st_mode))
+		add_file(path, parent);
+	else
+		fprintf(stderr, "Skipping special file %s\n", path);
+}
+
 int mtd_replace_jffs2(const char *mtd, int fd, int ofs, const char *filename)
 {
 	outfd = fd;
 	mtdofs = ofs;
 
-	buf = malloc(erasesize);
+	if (stream_init() < 0) {
+		fprintf(stderr, "Out of memory!\n");
+		exit(1);
+	}
 	target_ino = 1;
 	if (!last_ino)
 		last_ino = 1;
-	add_file(filename, target_ino);
+	add_path(filename, target_ino);
 	pad(erasesize);
 
 	/* add eof marker, pad to eraseblock size and write the data */
 	add_data(JFFS2_EOF, sizeof(JFFS2_EOF) - 1);
 	pad(erasesize);
-	free(buf);
+	flush_blocks();
+	stream_free();
 
 	return (mtdofs - ofs);
 }
@@ -294,8 +534,7 @@ int mtd_write_jffs2(const char *mtd, const char *filename, const char *dir)
 	if (quiet < 2)
 		fprintf(stderr, "Appending %s to jffs2 partition %s\n", filename, mtd);
 	
-	buf = malloc(erasesize);
-	if (!buf) {
+	if (stream_init() < 0) {
 		fprintf(stderr, "Out of memory!\n");
 		goto done;
 	}
@@ -336,6 +575,9 @@ int mtd_write_jffs2(const char *mtd, const char *filename, const char *dir)
 	mtdofs -= erasesize;
 	lseek(outfd, mtdofs, SEEK_SET);
 
+	if (trx_fixup_begin && !trx_fixup_begin(outfd))
+		save_old = 1;
+
 	ofs = 0;
 
 	if (!last_ino)
@@ -344,23 +586,25 @@ int mtd_write_jffs2(const char *mtd, const char *filename, const char *dir)
 	if (!target_ino)
 		target_ino = add_dir(dir, 1);
 
-	add_file(filename, target_ino);
+	add_path(filename, target_ino);
 	pad(erasesize);
 
 	/* add eof marker, pad to eraseblock size and write the data */
 	add_data(JFFS2_EOF, sizeof(JFFS2_EOF) - 1);
 	pad(erasesize);
+	flush_blocks();
 
 	err = 0;
 
-	if (trx_fixup) {
+	if (trx_fixup_end) {
+	  trx_fixup_end(outfd, mtd);
+	} else if (trx_fixup) {
 	  trx_fixup(outfd, mtd);
 	}
 
 done:
 	close(outfd);
-	if (buf)
-		free(buf);
+	stream_free();
 
 	return err;
 }
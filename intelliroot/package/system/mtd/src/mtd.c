@@ -28,6 +28,7 @@
 #include <stdio.h>
 #include <stdint.h>
 #include <signal.h>
+#include <pthread.h>
 #include <sys/ioctl.h>
 #include <sys/syscall.h>
 #include <fcntl.h>
@@ -44,6 +45,9 @@
 #include <mtd/mtd-user.h>
 #include "fis.h"
 #include "mtd.h"
+#include "crc32.h"
+#include "sha256.h"
+#include "stats.h"
 
 #include <libubox/md5.h>
 
@@ -56,6 +60,9 @@ static char *jffs2file = NULL, *jffs2dir = JFFS2_DEFAULT_DIR;
 static int buflen = 0;
 int quiet;
 int no_erase;
+int delta;
+int prefetch_blocks;
+int decompress;
 int mtdsize = 0;
 int erasesize = 0;
 int jffs2_skip_bytes=0;
@@ -261,10 +268,15 @@ mtd_erase(const char *mtd)
 		if (mtd_block_is_bad(fd, mtdEraseInfo.start)) {
 			if (!quiet)
 				fprintf(stderr, "\nSkipping bad block at 0x%x   ", mtdEraseInfo.start);
+			stats_bad_block();
 		} else {
+			double t = stats_begin();
+
 			ioctl(fd, MEMUNLOCK, &mtdEraseInfo);
 			if(ioctl(fd, MEMERASE, &mtdEraseInfo))
 				fprintf(stderr, "Failed to erase block on %s at 0x%x\n", mtd, mtdEraseInfo.start);
+			stats_end(STATS_ERASE, t, erasesize);
+			stats_progress(STATS_ERASE, mtdEraseInfo.start + erasesize, mtdsize);
 		}
 	}
 
@@ -273,63 +285,384 @@ mtd_erase(const char *mtd)
 
 }
 
+/* digests available for verifying the written image */
+union verify_ctx {
+	md5_ctx_t md5;
+	sha256_ctx_t sha256;
+	uint32_t crc32;
+};
+
+static void verify_md5_begin(union verify_ctx *ctx)
+{
+	md5_begin(&ctx->md5);
+}
+
+static void verify_md5_hash(union verify_ctx *ctx, const void *data, size_t len)
+{
+	md5_hash(data, len, &ctx->md5);
+}
+
+static void verify_md5_end(union verify_ctx *ctx, uint8_t *digest)
+{
+	md5_end(digest, &ctx->md5);
+}
+
+static void verify_sha256_begin(union verify_ctx *ctx)
+{
+	sha256_begin(&ctx->sha256);
+}
+
+static void verify_sha256_hash(union verify_ctx *ctx, const void *data, size_t len)
+{
+	sha256_hash(data, len, &ctx->sha256);
+}
+
+static void verify_sha256_end(union verify_ctx *ctx, uint8_t *digest)
+{
+	sha256_end(digest, &ctx->sha256);
+}
+
+static void verify_crc32_begin(union verify_ctx *ctx)
+{
+	ctx->crc32 = 0xffffffff;
+}
+
+static void verify_crc32_hash(union verify_ctx *ctx, const void *data, size_t len)
+{
+	ctx->crc32 = crc32(ctx->crc32, data, len);
+}
+
+static void verify_crc32_end(union verify_ctx *ctx, uint8_t *digest)
+{
+	uint32_t crc = ~ctx->crc32;
+
+	digest[0] = crc >> 24;
+	digest[1] = crc >> 16;
+	digest[2] = crc >> 8;
+	digest[3] = crc;
+}
+
+static const struct verify_digest {
+	const char *name;
+	int len;
+	void (*begin)(union verify_ctx *ctx);
+	void (*hash)(union verify_ctx *ctx, const void *data, size_t len);
+	void (*end)(union verify_ctx *ctx, uint8_t *digest);
+} verify_digests[] = {
+	{ "md5", 16, verify_md5_begin, verify_md5_hash, verify_md5_end },
+	{ "sha256", SHA256_DIGEST_LEN, verify_sha256_begin, verify_sha256_hash, verify_sha256_end },
+	{ "crc32", 4, verify_crc32_begin, verify_crc32_hash, verify_crc32_end },
+	{ NULL }
+};
+
+static const struct verify_digest *verify_hash = &verify_digests[0];
+
+static int
+read_full(int fd, char *data, int length)
+{
+	int len = 0;
+	int r;
+
+	while (len < length) {
+		r = read(fd, data + len, length - len);
+		if (r < 0) {
+			if ((errno == EINTR) || (errno == EAGAIN))
+				continue;
+			return -1;
+		}
+		if (r == 0)
+			break;
+		len += r;
+	}
+
+	return len;
+}
+
+/*
+ * Stream the image and the device side by side in eraseblock sized chunks,
+ * comparing them directly and hashing the data only once
+ */
 static int
 mtd_verify(const char *mtd, char *file)
 {
-	uint32_t f_md5[4], m_md5[4];
-	struct stat s;
-	md5_ctx_t ctx;
-	int ret = 0;
-	int fd;
+	union verify_ctx ctx;
+	uint8_t hash[SHA256_DIGEST_LEN];
+	char *fbuf = NULL, *mbuf = NULL;
+	size_t total = 0;
+	int ffd, fd;
+	int flen, mlen;
+	int ret = -1;
+	int i;
 
 	if (quiet < 2)
 		fprintf(stderr, "Verifying %s against %s ...\n", mtd, file);
 
-	if (stat(file, &s) || md5sum(file, f_md5)) {
-		fprintf(stderr, "Failed to hash %s\n", file);
+	if (strcmp(file, "-") == 0) {
+		ffd = 0;
+	} else if ((ffd = open(file, O_RDONLY)) < 0) {
+		fprintf(stderr, "Failed to open %s\n", file);
 		return -1;
 	}
 
 	fd = mtd_check_open(mtd);
 	if(fd < 0) {
 		fprintf(stderr, "Could not open mtd device: %s\n", mtd);
-		return -1;
+		goto out_file;
 	}
 
-	md5_begin(&ctx);
-	do {
-		char buf[256];
-		int len = (s.st_size > sizeof(buf)) ? (sizeof(buf)) : (s.st_size);
-		int rlen = read(fd, buf, len);
+	fbuf = malloc(erasesize);
+	mbuf = malloc(erasesize);
+	if (!fbuf || !mbuf) {
+		fprintf(stderr, "Out of memory\n");
+		goto out;
+	}
 
-		if (rlen < 0) {
-			if (errno == EINTR)
-				continue;
-			ret = -1;
+	verify_hash->begin(&ctx);
+	for (;;) {
+		double t = stats_begin();
+
+		flen = read_full(ffd, fbuf, erasesize);
+		if (flen < 0) {
+			fprintf(stderr, "Failed to read %s\n", file);
 			goto out;
 		}
-		if (!rlen)
+		if (!flen)
 			break;
-		md5_hash(buf, rlen, &ctx);
-		s.st_size -= rlen;
-	} while (s.st_size > 0);
 
-	md5_end(m_md5, &ctx);
+		mlen = read_full(fd, mbuf, flen);
+		if (mlen < 0) {
+			fprintf(stderr, "Failed to read %s\n", mtd);
+			goto out;
+		}
+		stats_end(STATS_VERIFY, t, mlen);
+
+		if ((mlen < flen) || memcmp(fbuf, mbuf, flen)) {
+			for (i = 0; i < mlen && fbuf[i] == mbuf[i]; i++)
+				;
+			fprintf(stderr, "Mismatch at offset 0x%08zx\n", total + i);
+			fprintf(stderr, "Failed\n");
+			ret = 1;
+			goto out;
+		}
 
-	fprintf(stderr, "%08x%08x%08x%08x - %s\n", m_md5[0], m_md5[1], m_md5[2], m_md5[3], mtd);
-	fprintf(stderr, "%08x%08x%08x%08x - %s\n", f_md5[0], f_md5[1], f_md5[2], f_md5[3], file);
+		verify_hash->hash(&ctx, fbuf, flen);
+		total += flen;
+		stats_progress(STATS_VERIFY, total, 0);
+	}
+	verify_hash->end(&ctx, hash);
 
-	ret = memcmp(f_md5, m_md5, sizeof(m_md5));
-	if (!ret)
-		fprintf(stderr, "Success\n");
-	else
-		fprintf(stderr, "Failed\n");
+	for (i = 0; i < verify_hash->len; i++)
+		fprintf(stderr, "%02x", hash[i]);
+	fprintf(stderr, " - %s (%s, %zu bytes)\n", verify_hash->name, mtd, total);
+	fprintf(stderr, "Success\n");
+	ret = 0;
 
 out:
+	free(fbuf);
+	free(mbuf);
 	close(fd);
+out_file:
+	if (ffd > 0)
+		close(ffd);
 	return ret;
 }
 
+/*
+ * Image read-ahead: a reader thread fills a ring of eraseblock sized
+ * buffers from the image fd while the main thread erases and writes,
+ * so that streaming from a pipe overlaps with the flash operations.
+ */
+struct prefetch {
+	pthread_t thread;
+	pthread_mutex_t lock;
+	pthread_cond_t cond;
+	int fd;
+	int nbufs;
+	int size;
+	char **data;
+	int *len;
+	int head, tail, count;
+	int pos;
+	int eof;
+	int err;
+};
+
+static struct prefetch *prefetch = NULL;
+
+static void *
+prefetch_thread(void *arg)
+{
+	struct prefetch *p = arg;
+	char *data;
+	int len, r;
+
+	for (;;) {
+		pthread_mutex_lock(&p->lock);
+		while (p->count == p->nbufs)
+			pthread_cond_wait(&p->cond, &p->lock);
+		data = p->data[p->head];
+		pthread_mutex_unlock(&p->lock);
+
+		len = 0;
+		r = 0;
+		while (len < p->size) {
+			r = read(p->fd, data + len, p->size - len);
+			if (r < 0) {
+				if ((errno == EINTR) || (errno == EAGAIN))
+					continue;
+				break;
+			}
+			if (r == 0)
+				break;
+			len += r;
+		}
+
+		pthread_mutex_lock(&p->lock);
+		if (len > 0) {
+			p->len[p->head] = len;
+			p->head = (p->head + 1) % p->nbufs;
+			p->count++;
+		}
+		if (r <= 0) {
+			p->err = (r < 0) ? errno : 0;
+			p->eof = 1;
+		}
+		pthread_cond_broadcast(&p->cond);
+		pthread_mutex_unlock(&p->lock);
+
+		if (r <= 0)
+			break;
+	}
+
+	return NULL;
+}
+
+static int
+prefetch_start(int fd, int nbufs, int size)
+{
+	struct prefetch *p;
+	int i;
+
+	p = calloc(1, sizeof(*p));
+	if (!p)
+		return -1;
+
+	p->fd = fd;
+	p->nbufs = nbufs;
+	p->size = size;
+	p->data = calloc(nbufs, sizeof(*p->data));
+	p->len = calloc(nbufs, sizeof(*p->len));
+	if (!p->data || !p->len)
+		goto error;
+
+	for (i = 0; i < nbufs; i++) {
+		p->data[i] = malloc(size);
+		if (!p->data[i])
+			goto error;
+	}
+
+	pthread_mutex_init(&p->lock, NULL);
+	pthread_cond_init(&p->cond, NULL);
+	if (pthread_create(&p->thread, NULL, prefetch_thread, p))
+		goto error;
+
+	prefetch = p;
+	return 0;
+
+error:
+	if (p->data) {
+		for (i = 0; i < nbufs; i++)
+			free(p->data[i]);
+	}
+	free(p->data);
+	free(p->len);
+	free(p);
+	return -1;
+}
+
+static void
+prefetch_stop(void)
+{
+	struct prefetch *p = prefetch;
+	int i;
+
+	if (!p)
+		return;
+
+	/* the reader only terminates at the end of the image */
+	pthread_join(p->thread, NULL);
+	for (i = 0; i < p->nbufs; i++)
+		free(p->data[i]);
+	free(p->data);
+	free(p->len);
+	free(p);
+	prefetch = NULL;
+}
+
+static ssize_t
+image_read(int fd, char *data, size_t length)
+{
+	struct prefetch *p = prefetch;
+	ssize_t len;
+
+	if (!p)
+		return read(fd, data, length);
+
+	pthread_mutex_lock(&p->lock);
+	while (!p->count && !p->eof)
+		pthread_cond_wait(&p->cond, &p->lock);
+
+	if (!p->count) {
+		pthread_mutex_unlock(&p->lock);
+		if (p->err) {
+			errno = p->err;
+			return -1;
+		}
+		return 0;
+	}
+
+	len = p->len[p->tail] - p->pos;
+	if (len > length)
+		len = length;
+	memcpy(data, p->data[p->tail] + p->pos, len);
+	p->pos += len;
+	if (p->pos == p->len[p->tail]) {
+		p->pos = 0;
+		p->tail = (p->tail + 1) % p->nbufs;
+		p->count--;
+		pthread_cond_broadcast(&p->cond);
+	}
+	pthread_mutex_unlock(&p->lock);
+
+	return len;
+}
+
+/*
+ * Read back the eraseblock at the current device position and compare it
+ * with the data about to be written, so that unchanged blocks can be skipped
+ */
+static int
+mtd_block_unchanged(int fd, const char *data, int length)
+{
+	static char *cmpbuf = NULL;
+	static int cmplen = 0;
+	off_t pos;
+
+	if (cmplen < length) {
+		free(cmpbuf);
+		cmpbuf = malloc(length);
+		cmplen = cmpbuf ? length : 0;
+		if (!cmpbuf)
+			return 0;
+	}
+
+	pos = lseek(fd, 0, SEEK_CUR);
+	if (pos < 0 || pread(fd, cmpbuf, length, pos) != length)
+		return 0;
+
+	return !memcmp(cmpbuf, data, length);
+}
+
 static void
 indicate_writing(const char *mtd)
 {
@@ -349,8 +682,13 @@ mtd_write(int imagefd, const char *mtd, char *fis_layout, size_t part_offset)
 	ssize_t r, w, e;
 	ssize_t skip = 0;
 	uint32_t offset = 0;
+	size_t replaced_ofs = 0;
 	int jffs2_replaced = 0;
 	int skip_bad_blocks = 0;
+	int blocks_unchanged = 0, blocks_written = 0;
+	size_t total = 0;
+	struct stat st;
+	double t;
 
 #ifdef FIS_SUPPORT
 	static struct fis_part new_parts[MAX_ARGS];
@@ -414,6 +752,12 @@ next:
 
 	r = 0;
 
+	if (!fstat(imagefd, &st) && S_ISREG(st.st_mode))
+		total = st.st_size;
+
+	if (prefetch_blocks > 0 && prefetch_start(imagefd, prefetch_blocks, erasesize) < 0)
+		fprintf(stderr, "Failed to start image read-ahead, reading synchronously\n");
+
 resume:
 	next = strchr(mtd, ':');
 	if (next) {
@@ -437,7 +781,9 @@ resume:
 	for (;;) {
 		/* buffer may contain data already (from trx check or last mtd partition write attempt) */
 		while (buflen < erasesize) {
-			r = read(imagefd, buf + buflen, erasesize - buflen);
+			t = stats_begin();
+			r = image_read(imagefd, buf + buflen, erasesize - buflen);
+			stats_end(STATS_READ, t, r > 0 ? r : 0);
 			if (r < 0) {
 				if ((errno == EINTR) || (errno == EAGAIN))
 					continue;
@@ -463,6 +809,11 @@ resume:
 		}
 
 		if (skip > 0) {
+			/* the image data being dropped is the old content for the trx fixup */
+			if (trx_fixup_update)
+				trx_fixup_update(replaced_ofs, buf, buflen);
+			replaced_ofs += buflen;
+
 			skip -= buflen;
 			buflen = 0;
 			if (skip <= 0)
@@ -478,6 +829,10 @@ resume:
 				if (quiet < 2)
 					fprintf(stderr, "\nAppending jffs2 data from %s to %s...", jffs2file, mtd);
 				/* got an EOF marker - this is the place to add some jffs2 data */
+				if (trx_fixup_begin && !trx_fixup_begin(fd)) {
+					trx_fixup_update(w, buf, buflen);
+					replaced_ofs = w + buflen;
+				}
 				skip = mtd_replace_jffs2(mtd, fd, e, jffs2file);
 				jffs2_replaced = 1;
 
@@ -496,6 +851,22 @@ resume:
 			mtd_parse_jffs2data(buf, jffs2dir);
 		}
 
+		/* in delta mode, leave eraseblocks alone that already hold this data */
+		if (delta && !no_erase && !offset && (w == e - skip_bad_blocks) &&
+		    !mtd_block_is_bad(fd, e) && mtd_block_unchanged(fd, buf, buflen)) {
+			if (!quiet)
+				fprintf(stderr, "\b\b\b[s]");
+
+			lseek(fd, buflen, SEEK_CUR);
+			blocks_unchanged++;
+			stats_unchanged_block();
+			w += buflen;
+			e += erasesize;
+			buflen = 0;
+			stats_progress(STATS_WRITE, w, total);
+			continue;
+		}
+
 		/* need to erase the next block before writing data to it */
 		if(!no_erase)
 		{
@@ -509,13 +880,17 @@ resume:
 
 					skip_bad_blocks += erasesize;
 					e += erasesize;
+					stats_bad_block();
 
 					// Move the file pointer along over the bad block.
 					lseek(fd, erasesize, SEEK_CUR);
 					continue;
 				}
 
-				if (mtd_erase_block(fd, e) < 0) {
+				t = stats_begin();
+				result = mtd_erase_block(fd, e);
+				stats_end(STATS_ERASE, t, erasesize);
+				if (result < 0) {
 					if (next) {
 						if (w < e) {
 							write(fd, buf + offset, e - w);
@@ -541,7 +916,10 @@ resume:
 		if (!quiet)
 			fprintf(stderr, "\b\b\b[w]");
 
-		if ((result = write(fd, buf + offset, buflen)) < buflen) {
+		t = stats_begin();
+		result = write(fd, buf + offset, buflen);
+		stats_end(STATS_WRITE, t, result > 0 ? result : 0);
+		if (result < buflen) {
 			if (result < 0) {
 				fprintf(stderr, "Error writing image.\n");
 				exit(1);
@@ -551,18 +929,27 @@ resume:
 			}
 		}
 		w += buflen;
+		blocks_written++;
+		stats_progress(STATS_WRITE, w, total);
 
 		buflen = 0;
 		offset = 0;
 	}
 
-	if (jffs2_replaced && trx_fixup) {
+	prefetch_stop();
+
+	if (jffs2_replaced && trx_fixup_end)
+		trx_fixup_end(fd, mtd);
+	else if (jffs2_replaced && trx_fixup)
 		trx_fixup(fd, mtd);
-	}
 
 	if (!quiet)
 		fprintf(stderr, "\b\b\b\b    ");
 
+	if (delta && quiet < 2)
+		fprintf(stderr, "\n%d eraseblocks unchanged, %d rewritten",
+			blocks_unchanged, blocks_written);
+
 done:
 	if (quiet < 2)
 		fprintf(stderr, "\n");
@@ -578,6 +965,282 @@ done:
 	return 0;
 }
 
+/*
+ * Parallel writing of independent images or image slices to different
+ * mtd devices. Every job keeps its own device geometry and buffer, so
+ * it does not touch the globals used by the regular write path.
+ */
+struct write_job {
+	pthread_t thread;
+	char *spec;
+	const char *image;
+	const char *mtd;
+	off_t offset;
+	off_t length;
+	dev_t dev;
+	ino_t ino;
+	int erasesize;
+	int mtdsize;
+	int type;
+	int bad_blocks;
+	size_t bytes;
+	double secs;
+	int ret;
+};
+
+static int
+write_job_num(const char *s, off_t *val)
+{
+	char *end;
+
+	if (!*s)
+		return -1;
+
+	*val = strtoull(s, &end, 0);
+	return *end ? -1 : 0;
+}
+
+/*
+ * <image>[@<offset>[+<length>]]:<device>
+ * The spec is split in a private copy so that it can still be reported.
+ * An '@' followed by a '/' belongs to a directory name, not an offset.
+ */
+static int
+write_job_parse(struct write_job *job, const char *arg)
+{
+	char *spec, *sep, *len;
+
+	memset(job, 0, sizeof(*job));
+	job->spec = spec = strdup(arg);
+	if (!spec)
+		return -1;
+
+	sep = strrchr(spec, ':');
+	if (!sep || sep == spec || !sep[1])
+		return -1;
+
+	*sep = 0;
+	job->mtd = sep + 1;
+	job->image = spec;
+
+	sep = strrchr(spec, '@');
+	if (sep && strchr(sep, '/'))
+		sep = NULL;
+	if (sep) {
+		if (sep == spec)
+			return -1;
+
+		*sep++ = 0;
+		len = strchr(sep, '+');
+		if (len) {
+			*len++ = 0;
+			if (write_job_num(len, &job->length) < 0)
+				return -1;
+		}
+		if (write_job_num(sep, &job->offset) < 0)
+			return -1;
+	}
+
+	return 0;
+}
+
+static void *
+write_job_thread(void *arg)
+{
+	struct write_job *job = arg;
+	struct mtd_info_user mtdInfo;
+	struct erase_info_user mtdEraseInfo;
+	off_t remaining = job->length;
+	double start = time_now();
+	char *jbuf = NULL;
+	int imagefd, fd;
+	int len, r;
+	loff_t o;
+	int e = 0;
+
+	job->ret = -1;
+
+	imagefd = open(job->image, O_RDONLY);
+	if (imagefd < 0) {
+		fprintf(stderr, "Couldn't open image file: %s!\n", job->image);
+		return NULL;
+	}
+	if (job->offset && lseek(imagefd, job->offset, SEEK_SET) < 0) {
+		fprintf(stderr, "Couldn't seek to 0x%llx in %s\n", (unsigned long long) job->offset, job->image);
+		goto out_image;
+	}
+
+	fd = mtd_open(job->mtd, false);
+	if (fd < 0) {
+		fprintf(stderr, "Could not open mtd device: %s\n", job->mtd);
+		goto out_image;
+	}
+	if (ioctl(fd, MEMGETINFO, &mtdInfo)) {
+		fprintf(stderr, "Could not get MTD device info from %s\n", job->mtd);
+		goto out;
+	}
+	job->erasesize = mtdInfo.erasesize;
+	job->mtdsize = mtdInfo.size;
+	job->type = mtdInfo.type;
+
+	jbuf = malloc(job->erasesize);
+	if (!jbuf)
+		goto out;
+
+	for (;;) {
+		len = job->erasesize;
+		if (job->length && remaining < len)
+			len = remaining;
+		if (!len)
+			break;
+
+		len = read_full(imagefd, jbuf, len);
+		if (len < 0) {
+			fprintf(stderr, "Failed to read %s\n", job->image);
+			goto out;
+		}
+		if (!len)
+			break;
+		remaining -= len;
+
+		/* Pad block to eraseblock size */
+		if (len < job->erasesize)
+			memset(jbuf + len, 0xff, job->erasesize - len);
+
+		for (;;) {
+			if (e + job->erasesize > job->mtdsize) {
+				fprintf(stderr, "Insufficient space on %s\n", job->mtd);
+				goto out;
+			}
+
+			o = e;
+			if (job->type == MTD_NANDFLASH) {
+				r = ioctl(fd, MEMGETBADBLOCK, &o);
+				if (r < 0) {
+					fprintf(stderr, "Failed to get erase block status on %s\n", job->mtd);
+					goto out;
+				}
+				if (r) {
+					job->bad_blocks++;
+					e += job->erasesize;
+					continue;
+				}
+			}
+			break;
+		}
+
+		if (!no_erase) {
+			mtdEraseInfo.start = e;
+			mtdEraseInfo.length = job->erasesize;
+			ioctl(fd, MEMUNLOCK, &mtdEraseInfo);
+			if (ioctl(fd, MEMERASE, &mtdEraseInfo) < 0) {
+				fprintf(stderr, "Failed to erase block on %s at 0x%x\n", job->mtd, e);
+				goto out;
+			}
+		}
+
+		if (pwrite(fd, jbuf, job->erasesize, e) != job->erasesize) {
+			fprintf(stderr, "Error writing image to %s at 0x%x\n", job->mtd, e);
+			goto out;
+		}
+
+		e += job->erasesize;
+		job->bytes += len;
+	}
+
+	job->ret = 0;
+
+out:
+	free(jbuf);
+	close(fd);
+out_image:
+	close(imagefd);
+	job->secs = time_now() - start;
+	return NULL;
+}
+
+static int
+mtd_write_parallel(int njobs, char **specs)
+{
+	struct write_job *jobs;
+	struct stat st;
+	int i, j, fd, ret = -1;
+
+	jobs = calloc(njobs, sizeof(*jobs));
+	if (!jobs)
+		return -1;
+
+	for (i = 0; i < njobs; i++) {
+		if (write_job_parse(&jobs[i], specs[i]) < 0) {
+			fprintf(stderr, "Invalid job: %s\n", specs[i]);
+			goto out;
+		}
+
+		/* A device may be named by label or by number, so compare
+		 * the devices themselves. Two jobs must never share one.
+		 */
+		fd = mtd_open(jobs[i].mtd, false);
+		if (fd < 0) {
+			fprintf(stderr, "Could not open mtd device: %s\n", jobs[i].mtd);
+			goto out;
+		}
+		if (fstat(fd, &st) < 0) {
+			fprintf(stderr, "Could not stat mtd device: %s\n", jobs[i].mtd);
+			close(fd);
+			goto out;
+		}
+		close(fd);
+		if (S_ISCHR(st.st_mode)) {
+			jobs[i].dev = st.st_rdev;
+		} else {
+			jobs[i].dev = st.st_dev;
+			jobs[i].ino = st.st_ino;
+		}
+
+		for (j = 0; j < i; j++) {
+			if (jobs[j].dev == jobs[i].dev &&
+			    jobs[j].ino == jobs[i].ino) {
+				fprintf(stderr, "%s and %s are the same device\n",
+					jobs[j].mtd, jobs[i].mtd);
+				goto out;
+			}
+		}
+	}
+
+	ret = 0;
+
+	for (i = 0; i < njobs; i++) {
+		mtd_unlock(jobs[i].mtd);
+		if (quiet < 2)
+			fprintf(stderr, "Writing from %s to %s ...\n", jobs[i].image, jobs[i].mtd);
+		if (pthread_create(&jobs[i].thread, NULL, write_job_thread, &jobs[i])) {
+			fprintf(stderr, "Failed to start writing to %s\n", jobs[i].mtd);
+			jobs[i].thread = 0;
+			jobs[i].ret = -1;
+		}
+	}
+
+	for (i = 0; i < njobs; i++) {
+		if (jobs[i].thread)
+			pthread_join(jobs[i].thread, NULL);
+
+		if (jobs[i].ret)
+			ret = -1;
+
+		if (quiet < 2)
+			fprintf(stderr, "%s: %s, %zu bytes in %.2fs (%.0f KiB/s), %d bad blocks skipped\n",
+				jobs[i].mtd, jobs[i].ret ? "failed" : "done", jobs[i].bytes, jobs[i].secs,
+				jobs[i].secs > 0 ? jobs[i].bytes / 1024.0 / jobs[i].secs : 0.0,
+				jobs[i].bad_blocks);
+	}
+
+out:
+	for (i = 0; i < njobs; i++)
+		free(jobs[i].spec);
+	free(jobs);
+	return ret;
+}
+
 static void usage(void)
 {
 	fprintf(stderr, "Usage: mtd [<options> ...] <command> [<arguments> ...] <device>[:<device>...]\n\n"
@@ -588,7 +1251,10 @@ static void usage(void)
 	"        erase                   erase all data on device\n"
 	"        verify <imagefile>|-    verify <imagefile> (use - for stdin) to device\n"
 	"        write <imagefile>|-     write <imagefile> (use - for stdin) to device\n"
-	"        jffs2write <file>       append <file> to the jffs2 partition on the device\n");
+	"        parallel <image>[@<offset>[+<length>]]:<device> ...\n"
+	"                                write several images (or slices of one image)\n"
+	"                                to different devices concurrently\n"
+	"        jffs2write <file>       append <file> (or a directory tree) to the jffs2 partition on the device\n");
 	if (mtd_fixtrx) {
 	    fprintf(stderr,
 	"        fixtrx                  fix the checksum in a trx header on first boot\n");
@@ -602,11 +1268,23 @@ static void usage(void)
 	"        -q                      quiet mode (once: no [w] on writing,\n"
 	"                                           twice: no status messages)\n"
 	"        -n                      write without first erasing the blocks\n"
+	"        -H <digest>             digest to report for verify: md5 (default),\n"
+	"                                sha256 or crc32\n"
+	"        -Z                      decompress gzip, xz or lzma images while writing\n"
+	"        -S <file>               write timing statistics as JSON to <file> (- for stdout)\n"
+	"        -P <fd>                 report progress as JSON lines on file descriptor <fd>\n"
+	"        -b <number>             read ahead up to <number> eraseblocks of the\n"
+	"                                image in a separate thread\n"
+	"        -D                      delta mode: only erase and write blocks\n"
+	"                                whose contents differ from the image\n"
 	"        -r                      reboot after successful command\n"
 	"        -f                      force write without trx checks\n"
 	"        -e <device>             erase <device> before executing the command\n"
 	"        -d <name>               directory for jffs2write, defaults to \"tmp\"\n"
 	"        -j <name>               integrate <file> into jffs2 data when writing an image\n"
+#ifdef ZLIB_SUPPORT
+	"        -z                      compress jffs2 file data with zlib\n"
+#endif
 	"        -s <number>             skip the first n bytes when appending data to the jffs2 partiton, defaults to \"0\"\n"
 	"        -p                      write beginning at partition offset\n");
 	if (mtd_fixtrx) {
@@ -644,6 +1322,7 @@ int main (int argc, char **argv)
 	int ch, i, boot, imagefd = 0, force, unlocked;
 	char *erase[MAX_ARGS], *device = NULL;
 	char *fis_layout = NULL;
+	char *stats_file = NULL;
 	size_t offset = 0, part_offset = 0;
 	enum {
 		CMD_ERASE,
@@ -653,6 +1332,7 @@ int main (int argc, char **argv)
 		CMD_FIXTRX,
 		CMD_FIXSEAMA,
 		CMD_VERIFY,
+		CMD_PARALLEL,
 	} cmd = -1;
 
 	erase[0] = NULL;
@@ -661,12 +1341,18 @@ int main (int argc, char **argv)
 	buflen = 0;
 	quiet = 0;
 	no_erase = 0;
+	delta = 0;
+	prefetch_blocks = 0;
+	decompress = 0;
 
 	while ((ch = getopt(argc, argv,
 #ifdef FIS_SUPPORT
 			"F:"
 #endif
-			"frnqe:d:s:j:p:o:")) != -1)
+#ifdef ZLIB_SUPPORT
+			"z"
+#endif
+			"frnDZqb:H:S:P:e:d:s:j:p:o:")) != -1)
 		switch (ch) {
 			case 'f':
 				force = 1;
@@ -677,6 +1363,45 @@ int main (int argc, char **argv)
 			case 'n':
 				no_erase = 1;
 				break;
+			case 'D':
+				delta = 1;
+				break;
+			case 'Z':
+				decompress = 1;
+				break;
+			case 'S':
+				stats_file = optarg;
+				stats_enabled = 1;
+				break;
+			case 'P':
+				errno = 0;
+				progress_fd = strtoul(optarg, 0, 0);
+				if (errno) {
+					fprintf(stderr, "-P: illegal numeric string\n");
+					usage();
+				}
+				/* a reader going away must not kill mtd mid-flash */
+				signal(SIGPIPE, SIG_IGN);
+				stats_enabled = 1;
+				break;
+			case 'H':
+				for (i = 0; verify_digests[i].name; i++)
+					if (!strcmp(verify_digests[i].name, optarg))
+						break;
+				if (!verify_digests[i].name) {
+					fprintf(stderr, "-H: unknown digest %s\n", optarg);
+					usage();
+				}
+				verify_hash = &verify_digests[i];
+				break;
+			case 'b':
+				errno = 0;
+				prefetch_blocks = strtoul(optarg, 0, 0);
+				if (errno) {
+					fprintf(stderr, "-b: illegal numeric string\n");
+					usage();
+				}
+				break;
 			case 'j':
 				jffs2file = optarg;
 				break;
@@ -722,6 +1447,11 @@ int main (int argc, char **argv)
 					usage();
 				}
 				break;
+#ifdef ZLIB_SUPPORT
+			case 'z':
+				jffs2_zlib = 1;
+				break;
+#endif
 #ifdef FIS_SUPPORT
 			case 'F':
 				fis_layout = optarg;
@@ -768,6 +1498,11 @@ int main (int argc, char **argv)
 			}
 		}
 
+		if (decompress && (imagefd = image_decompress(imagefd)) < 0) {
+			fprintf(stderr, "Couldn't set up image decompression!\n");
+			exit(1);
+		}
+
 		if (!mtd_check(device)) {
 			fprintf(stderr, "Can't open device for writing!\n");
 			exit(1);
@@ -777,6 +1512,9 @@ int main (int argc, char **argv)
 			fprintf(stderr, "Image check failed.\n");
 			exit(1);
 		}
+	} else if (strcmp(argv[0], "parallel") == 0) {
+		cmd = CMD_PARALLEL;
+		device = "";
 	} else if ((strcmp(argv[0], "jffs2write") == 0) && (argc == 3)) {
 		cmd = CMD_JFFS2WRITE;
 		device = argv[2];
@@ -808,7 +1546,12 @@ int main (int argc, char **argv)
 				mtd_unlock(device);
 			break;
 		case CMD_VERIFY:
-			mtd_verify(device, imagefile);
+			if (mtd_verify(device, imagefile))
+				exit(1);
+			break;
+		case CMD_PARALLEL:
+			if (mtd_write_parallel(argc - 1, argv + 1) < 0)
+				exit(1);
 			break;
 		case CMD_ERASE:
 			if (!unlocked)
@@ -819,6 +1562,10 @@ int main (int argc, char **argv)
 			if (!unlocked)
 				mtd_unlock(device);
 			mtd_write(imagefd, device, fis_layout, part_offset);
+			if (image_decompress_finish()) {
+				fprintf(stderr, "Image decompression failed, the written image is incomplete!\n");
+				exit(1);
+			}
 			break;
 		case CMD_JFFS2WRITE:
 			if (!unlocked)
@@ -837,6 +1584,9 @@ int main (int argc, char **argv)
 
 	sync();
 
+	if (stats_write(stats_file, argv[0], device) < 0)
+		fprintf(stderr, "Failed to write statistics to %s\n", stats_file);
+
 	if (boot)
 		do_reboot();
 
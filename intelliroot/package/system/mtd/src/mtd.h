@@ -2,6 +2,7 @@
 #define __mtd_h
 
 #include <stdbool.h>
+#include <stddef.h>
 
 #ifdef target_brcm47xx
 #define target_brcm 1
@@ -12,6 +13,7 @@
 extern int quiet;
 extern int mtdsize;
 extern int erasesize;
+extern int jffs2_zlib;
 
 extern int mtd_open(const char *mtd, bool block);
 extern int mtd_check_open(const char *mtd);
@@ -21,9 +23,14 @@ extern int mtd_write_buffer(int fd, const char *buf, int offset, int length);
 extern int mtd_write_jffs2(const char *mtd, const char *filename, const char *dir);
 extern int mtd_replace_jffs2(const char *mtd, int fd, int ofs, const char *filename);
 extern void mtd_parse_jffs2data(const char *buf, const char *dir);
+extern int image_decompress(int fd);
+extern int image_decompress_finish(void);
 
 /* target specific functions */
 extern int trx_fixup(int fd, const char *name)  __attribute__ ((weak));
+extern int trx_fixup_begin(int fd) __attribute__ ((weak));
+extern void trx_fixup_update(size_t offset, const char *buf, size_t len) __attribute__ ((weak));
+extern int trx_fixup_end(int fd, const char *name) __attribute__ ((weak));
 extern int trx_check(int imagefd, const char *mtd, char *buf, int *len) __attribute__ ((weak));
 extern int mtd_fixtrx(const char *mtd, size_t offset) __attribute__ ((weak));
 extern int mtd_fixseama(const char *mtd, size_t offset) __attribute__ ((weak));
@@ -50,21 +50,31 @@
 ssize_t pread(int fd, void *buf, size_t count, off_t offset);
 ssize_t pwrite(int fd, const void *buf, size_t count, off_t offset);
 
+/*
+ * Check the SEAMA header at @offset in the erase block @buf read from
+ * @block_offset and fix its size and MD5 in place.  The digest is taken in a
+ * single pass: the part of the image sharing the header block is hashed from
+ * @buf, the rest is streamed from the device instead of being buffered.
+ */
 int
-seama_fix_md5(char *buf, size_t len)
+seama_fix_md5(int fd, char *buf, size_t offset, size_t block_offset)
 {
+	static char readbuf[64 * 1024];
 	struct seama_hdr *shdr;
-	char *data;
+	char *checksum;
 	size_t msize;
 	size_t isize;
+	size_t start, len, n;
+	off_t pos;
+	ssize_t res;
 	MD5_CTX ctx;
 	unsigned char digest[16];
 	int i;
 
-	if (len < sizeof(struct seama_hdr))
+	if (offset + sizeof(struct seama_hdr) + sizeof(digest) > erasesize)
 		return -1;
 
-	shdr = (struct seama_hdr *) buf;
+	shdr = (struct seama_hdr *) (buf + offset);
 	if (shdr->magic != htonl(SEAMA_MAGIC)) {
 		fprintf(stderr, "no SEAMA header found\n");
 		return -1;
@@ -77,17 +87,39 @@ seama_fix_md5(char *buf, size_t len)
 		return -1;
 	}
 
-	len -= sizeof(struct seama_hdr) + sizeof(digest) + msize;
+	checksum = buf + offset + sizeof(struct seama_hdr);
+	start = offset + sizeof(struct seama_hdr) + sizeof(digest) + msize;
+	len = mtdsize - block_offset;
+	if (start > len)
+		return -1;
+
+	len -= start;
 	if (isize > len)
 		isize = len;
 
-	data = buf + sizeof(struct seama_hdr) + sizeof(digest) + msize;
-
 	MD5_Init(&ctx);
-	MD5_Update(&ctx, data, isize);
+
+	n = 0;
+	if (start < erasesize) {
+		n = erasesize - start;
+		if (n > isize)
+			n = isize;
+		MD5_Update(&ctx, buf + start, n);
+	}
+
+	pos = block_offset + start + n;
+	for (len = isize - n; len > 0; len -= res, pos += res) {
+		res = pread(fd, readbuf, len < sizeof(readbuf) ? len : sizeof(readbuf), pos);
+		if (res <= 0) {
+			perror("pread");
+			return -1;
+		}
+		MD5_Update(&ctx, readbuf, res);
+	}
+
 	MD5_Final(digest, &ctx);
 
-	if (!memcmp(digest, &buf[sizeof(struct seama_hdr)], sizeof(digest))) {
+	if (!memcmp(digest, checksum, sizeof(digest))) {
 		if (quiet < 2)
 			fprintf(stderr, "the header is fixed already\n");
 		return -1;
@@ -106,7 +138,7 @@ seama_fix_md5(char *buf, size_t len)
 
 	/* update the checksum in the image */
 	for (i = 0; i < sizeof(digest); i++)
-		buf[sizeof(struct seama_hdr) + i] = digest[i];
+		checksum[i] = digest[i];
 
 	return 0;
 }
@@ -138,19 +170,19 @@ mtd_fixseama(const char *mtd, size_t offset)
 		exit(1);
 	}
 
-	buf = malloc(mtdsize);
+	buf = malloc(erasesize);
 	if (!buf) {
 		perror("malloc");
 		exit(1);
 	}
 
-	res = pread(fd, buf, mtdsize, block_offset);
-	if (res != mtdsize) {
+	res = pread(fd, buf, erasesize, block_offset);
+	if (res != erasesize) {
 		perror("pread");
 		exit(1);
 	}
 
-	if (seama_fix_md5(buf, mtdsize))
+	if (seama_fix_md5(fd, buf, offset, block_offset))
 		goto out;
 
 	if (mtd_erase_block(fd, block_offset)) {
@@ -171,6 +203,7 @@ mtd_fixseama(const char *mtd, size_t offset)
 		fprintf(stderr, "Done.\n");
 
 out:
+	free(buf);
 	close (fd);
 	sync();
 
@@ -0,0 +1,19 @@
+#ifndef __sha256_h
+#define __sha256_h
+
+#include <stdint.h>
+#include <stddef.h>
+
+#define SHA256_DIGEST_LEN	32
+
+typedef struct {
+	uint32_t state[8];
+	uint64_t count;
+	uint8_t buf[64];
+} sha256_ctx_t;
+
+extern void sha256_begin(sha256_ctx_t *ctx);
+extern void sha256_hash(const void *data, size_t len, sha256_ctx_t *ctx);
+extern void sha256_end(uint8_t *digest, sha256_ctx_t *ctx);
+
+#endif /* __sha256_h */
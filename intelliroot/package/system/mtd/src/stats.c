@@ -0,0 +1,150 @@
+/*
+ * stats.c - timing and progress reporting for mtd
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License v2
+ * as published by the Free Software Foundation.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ */
+
+#include <stdio.h>
+#include <stdint.h>
+#include <string.h>
+#include <unistd.h>
+#include <time.h>
+#include "stats.h"
+
+/* latency buckets: bucket n counts operations taking [2^n, 2^(n+1)) us */
+#define STATS_BUCKETS	26
+
+static const char * const phase_names[__STATS_MAX] = {
+	[STATS_READ] = "read",
+	[STATS_ERASE] = "erase",
+	[STATS_WRITE] = "write",
+	[STATS_VERIFY] = "verify",
+};
+
+static struct {
+	double start;
+	double time[__STATS_MAX];
+	uint64_t bytes[__STATS_MAX];
+	unsigned int ops[__STATS_MAX];
+	unsigned int hist[__STATS_MAX][STATS_BUCKETS];
+	unsigned int bad_blocks;
+	unsigned int unchanged_blocks;
+} stats;
+
+int stats_enabled = 0;
+int progress_fd = -1;
+
+/* monotonic, so that clock adjustments during a flash do not skew rates */
+double time_now(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec + ts.tv_nsec / 1000000000.0;
+}
+
+double stats_begin(void)
+{
+	if (!stats_enabled)
+		return 0;
+
+	if (!stats.start)
+		stats.start = time_now();
+
+	return time_now();
+}
+
+void stats_end(int phase, double start, size_t bytes)
+{
+	double t;
+	unsigned long us;
+	int n = 0;
+
+	if (!stats_enabled)
+		return;
+
+	t = time_now() - start;
+	stats.time[phase] += t;
+	stats.bytes[phase] += bytes;
+	stats.ops[phase]++;
+
+	for (us = t * 1000000.0; us > 1 && n < STATS_BUCKETS - 1; us >>= 1)
+		n++;
+	stats.hist[phase][n]++;
+}
+
+void stats_bad_block(void)
+{
+	stats.bad_blocks++;
+}
+
+void stats_unchanged_block(void)
+{
+	stats.unchanged_blocks++;
+}
+
+/* one JSON object per line, so that a supervisor can follow along */
+void stats_progress(int phase, size_t done, size_t total)
+{
+	char line[128];
+	int len;
+
+	if (progress_fd < 0)
+		return;
+
+	len = snprintf(line, sizeof(line),
+		"{ \"phase\": \"%s\", \"bytes\": %zu, \"total\": %zu }\n",
+		phase_names[phase], done, total);
+	if (write(progress_fd, line, len) < 0)
+		progress_fd = -1;
+}
+
+int stats_write(const char *file, const char *cmd, const char *device)
+{
+	FILE *f;
+	int i, n, first;
+
+	if (!stats_enabled || !file)
+		return 0;
+
+	if (!strcmp(file, "-"))
+		f = stdout;
+	else if (!(f = fopen(file, "w")))
+		return -1;
+
+	fprintf(f, "{\n\t\"command\": \"%s\",\n\t\"device\": \"%s\",\n", cmd, device);
+	fprintf(f, "\t\"elapsed\": %.6f,\n", stats.start ? time_now() - stats.start : 0.0);
+	fprintf(f, "\t\"bad_blocks\": %u,\n", stats.bad_blocks);
+	fprintf(f, "\t\"unchanged_blocks\": %u,\n", stats.unchanged_blocks);
+	fprintf(f, "\t\"phases\": {");
+
+	for (i = 0; i < __STATS_MAX; i++) {
+		fprintf(f, "%s\n\t\t\"%s\": {\n", i ? "," : "", phase_names[i]);
+		fprintf(f, "\t\t\t\"time\": %.6f,\n", stats.time[i]);
+		fprintf(f, "\t\t\t\"bytes\": %llu,\n", (unsigned long long) stats.bytes[i]);
+		fprintf(f, "\t\t\t\"ops\": %u,\n", stats.ops[i]);
+		fprintf(f, "\t\t\t\"bytes_per_sec\": %.0f,\n",
+			stats.time[i] > 0 ? stats.bytes[i] / stats.time[i] : 0.0);
+		fprintf(f, "\t\t\t\"latency_us\": {");
+		for (n = 0, first = 1; n < STATS_BUCKETS; n++) {
+			if (!stats.hist[i][n])
+				continue;
+			fprintf(f, "%s \"%lu\": %u", first ? "" : ",", 1UL << n, stats.hist[i][n]);
+			first = 0;
+		}
+		fprintf(f, " }\n\t\t}");
+	}
+	fprintf(f, "\n\t}\n}\n");
+
+	if (f != stdout)
+		fclose(f);
+
+	return 0;
+}
@@ -0,0 +1,25 @@
+#ifndef __stats_h
+#define __stats_h
+
+#include <stddef.h>
+
+enum {
+	STATS_READ,
+	STATS_ERASE,
+	STATS_WRITE,
+	STATS_VERIFY,
+	__STATS_MAX
+};
+
+extern int stats_enabled;
+extern int progress_fd;
+
+extern double time_now(void);
+extern double stats_begin(void);
+extern void stats_end(int phase, double start, size_t bytes);
+extern void stats_bad_block(void);
+extern void stats_unchanged_block(void);
+extern void stats_progress(int phase, size_t done, size_t total);
+extern int stats_write(const char *file, const char *cmd, const char *device);
+
+#endif /* __stats_h */
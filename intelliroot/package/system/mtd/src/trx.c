@@ -101,6 +101,119 @@ err:
 	return -1;
 }
 
+/*
+ * Incremental fixup: the TRX CRC is linear in the data, so after a region
+ * has been rewritten, the new CRC follows from the old one, the CRC of the
+ * old and new bytes of that region and the length of the data after it.
+ * The caller feeds the old contents of the region through
+ * trx_fixup_update() while it is being replaced, or NULL if they are
+ * not known.
+ */
+static struct {
+	int valid;
+	struct trx_header hdr;
+	uint32_t len;
+	uint32_t start, end;
+	uint32_t old;
+} delta;
+
+int
+trx_fixup_begin(int fd)
+{
+	memset(&delta, 0, sizeof(delta));
+	if (pread(fd, &delta.hdr, sizeof(delta.hdr), 0) != sizeof(delta.hdr))
+		return -1;
+
+	if (delta.hdr.magic != STORE32_LE(TRX_MAGIC))
+		return -1;
+
+	delta.len = STORE32_LE(delta.hdr.len);
+	delta.valid = 1;
+	return 0;
+}
+
+void
+trx_fixup_update(size_t offset, const char *buf, size_t len)
+{
+	size_t lo = offset, hi = offset + len;
+
+	if (!delta.valid)
+		return;
+
+	if (!buf) {
+		delta.valid = 0;
+		return;
+	}
+
+	/* only the range covered by the CRC matters */
+	if (lo < offsetof(struct trx_header, flag_version))
+		lo = offsetof(struct trx_header, flag_version);
+	if (hi > delta.len)
+		hi = delta.len;
+	if (lo >= hi)
+		return;
+
+	if (delta.start == delta.end)
+		delta.start = delta.end = lo;
+	else if (lo != delta.end) {
+		/* not contiguous, fall back to a full recompute */
+		delta.valid = 0;
+		return;
+	}
+
+	delta.old = crc32(delta.old, buf + (lo - offset), hi - lo);
+	delta.end = hi;
+}
+
+int
+trx_fixup_end(int fd, const char *name)
+{
+	uint32_t cur = 0, crc;
+	uint32_t ofs;
+	char *buf;
+	int len, bfd;
+
+	if (!delta.valid)
+		return trx_fixup(fd, name);
+
+	delta.valid = 0;
+	if (delta.start == delta.end)
+		return 0;
+
+	buf = malloc(erasesize);
+	if (!buf)
+		return trx_fixup(fd, name);
+
+	for (ofs = delta.start; ofs < delta.end; ofs += len) {
+		len = delta.end - ofs;
+		if (len > erasesize)
+			len = erasesize;
+		if (pread(fd, buf, len, ofs) != len) {
+			free(buf);
+			return trx_fixup(fd, name);
+		}
+		cur = crc32(cur, buf, len);
+	}
+	free(buf);
+
+	crc = STORE32_LE(delta.hdr.crc32) ^ crc32_zeros(delta.old ^ cur, delta.len - delta.end);
+	crc = STORE32_LE(crc);
+
+	/* the block device takes care of erasing and rewriting the header block */
+	bfd = mtd_open(name, true);
+	if (bfd < 0)
+		return trx_fixup(fd, name);
+
+	if (pwrite(bfd, &crc, sizeof(crc), offsetof(struct trx_header, crc32)) != sizeof(crc)) {
+		close(bfd);
+		return trx_fixup(fd, name);
+	}
+
+	fsync(bfd);
+	close(bfd);
+	return 0;
+}
+
 #ifndef target_ar71xx
 int
 trx_check(int imagefd, const char *mtd, char *buf, int *len)
@@ -15,15 +15,10 @@ ROOTFSSIZE="$5"
 head=4
 sect=63
 
-set `ptgen -o $OUTPUT -h $head -s $sect -l 4096 -t c -p ${BOOTFSSIZE}M -t 83 -p ${ROOTFSSIZE}M`
-
-BOOTOFFSET="$(($1 / 512))"
-BOOTSIZE="$(($2 / 512))"
-ROOTFSOFFSET="$(($3 / 512))"
-ROOTFSSIZE="$(($4 / 512))"
-
-dd bs=512 if="$BOOTFS" of="$OUTPUT" seek="$BOOTOFFSET" conv=notrunc
-dd bs=512 if="$ROOTFS" of="$OUTPUT" seek="$ROOTFSOFFSET" conv=notrunc
+# ptgen places both images at their partition offsets, leaves zero
+# regions as holes and lists the populated blocks in $OUTPUT.bmap
+ptgen -o $OUTPUT -h $head -s $sect -l 4096 -m $OUTPUT.bmap \
+	-t c -i $BOOTFS -p ${BOOTFSSIZE}M -t 83 -i $ROOTFS -p ${ROOTFSSIZE}M
 
 
 
@@ -13,6 +13,7 @@
 
 #include "yaffs_checkptrw.h"
 #include "yaffs_getblockinfo.h"
+#include "yaffs_nand.h"
 
 struct yaffs_checkpt_chunk_hdr {
 	int version;
@@ -159,23 +160,22 @@ static void yaffs2_checkpt_find_block(struct yaffs_dev *dev)
 			enum yaffs_block_state state;
 			u32 seq;
 
-			dev->tagger.read_chunk_tags_fn(dev,
-					apply_chunk_offset(dev, chunk),
-					NULL, &tags);
+			/* Query the block rather than just reading the tags
+			 * so that a scan after a failed checkpoint read can
+			 * reuse the answer.
+			 */
+			yaffs_query_init_block_state(dev, i, &state, &seq);
 			yaffs_trace(YAFFS_TRACE_CHECKPOINT,
-				"find next checkpt block: search: block %d state %d oid %d seq %d eccr %d",
-				i, (int) state,
-				tags.obj_id, tags.seq_number,
-				tags.ecc_result);
+				"find next checkpt block: search: block %d state %d seq %d",
+				i, (int) state, seq);
 
-			if (tags.seq_number != YAFFS_SEQUENCE_CHECKPOINT_DATA)
+			if (seq != YAFFS_SEQUENCE_CHECKPOINT_DATA ||
+			    state == YAFFS_BLOCK_STATE_DEAD)
 				continue;
 
-			dev->tagger.query_block_fn(dev,
-						apply_block_offset(dev, i),
-						&state, &seq);
-			if (state == YAFFS_BLOCK_STATE_DEAD)
-				continue;
+			dev->tagger.read_chunk_tags_fn(dev,
+					apply_chunk_offset(dev, chunk),
+					NULL, &tags);
 
 			/* Right kind of block */
 			dev->checkpt_next_block = tags.obj_id;
@@ -68,25 +68,53 @@ static const unsigned char column_parity_table[] = {
 };
 
 
-/* Calculate the ECC for a 256-byte block of data */
+static inline unsigned char yaffs_ecc_parity32(u32 x)
+{
+	x ^= x >> 16;
+	x ^= x >> 8;
+	return column_parity_table[x & 0xff] & 0x01;
+}
+
+/*
+ * Calculate the ECC for a 256-byte block of data.
+ *
+ * Line parity bit n is the parity of all the bytes whose offset has bit n
+ * set, and the column parity is that of all bytes xored together. So the
+ * block is folded a 32-bit word at a time: bits 2-7 of the offset select
+ * the word, bits 0-1 the byte within it.
+ */
 void yaffs_ecc_calc(const unsigned char *data, unsigned char *ecc)
 {
 	unsigned int i;
-	unsigned char col_parity = 0;
-	unsigned char line_parity = 0;
-	unsigned char line_parity_prime = 0;
+	unsigned char col_parity;
+	unsigned char line_parity;
+	unsigned char line_parity_prime;
 	unsigned char t;
-	unsigned char b;
+	unsigned char b[4];
+	u32 w, all = 0;
+	u32 lp[6] = { 0 };
+
+	for (i = 0; i < 64; i++) {
+		memcpy(&w, data + i * 4, sizeof(w));
+		all ^= w;
+		lp[0] ^= (i & 0x01) ? w : 0;
+		lp[1] ^= (i & 0x02) ? w : 0;
+		lp[2] ^= (i & 0x04) ? w : 0;
+		lp[3] ^= (i & 0x08) ? w : 0;
+		lp[4] ^= (i & 0x10) ? w : 0;
+		lp[5] ^= (i & 0x20) ? w : 0;
+	}
 
-	for (i = 0; i < 256; i++) {
-		b = column_parity_table[*data++];
-		col_parity ^= b;
+	memcpy(b, &all, sizeof(b));
+	col_parity = column_parity_table[b[0] ^ b[1] ^ b[2] ^ b[3]];
 
-		if (b & 0x01) {	/* odd number of bits in the byte */
-			line_parity ^= i;
-			line_parity_prime ^= ~i;
-		}
-	}
+	line_parity = column_parity_table[b[1] ^ b[3]] & 0x01;
+	line_parity |= (column_parity_table[b[2] ^ b[3]] & 0x01) << 1;
+	for (i = 0; i < 6; i++)
+		line_parity |= yaffs_ecc_parity32(lp[i]) << (i + 2);
+
+	/* the prime parity collects ~offset of every odd byte */
+	line_parity_prime = (col_parity & 0x01) ? ~line_parity : line_parity;
 
 	ecc[2] = (~col_parity) | 0x03;
 
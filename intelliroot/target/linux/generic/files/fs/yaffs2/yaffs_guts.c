@@ -44,6 +44,10 @@ static int yaffs_wr_data_obj(struct yaffs_obj *in, int inode_chunk,
 static void yaffs_fix_null_name(struct yaffs_obj *obj, YCHAR *name,
 				int buffer_size);
 
+static void yaffs_dir_index_free(struct yaffs_obj *dir, int unlink_children);
+
+static void yaffs_gc_candidate_update(struct yaffs_dev *dev, int block_no);
+
 /* Function to calculate chunk and offset */
 
 void yaffs_addr_to_chunk(struct yaffs_dev *dev, loff_t addr,
@@ -438,6 +442,7 @@ static int yaffs_alloc_chunk(struct yaffs_dev *dev, int use_reserver,
 		/* If the block is full set the state to full */
 		if (dev->alloc_page >= dev->param.chunks_per_block) {
 			bi->block_state = YAFFS_BLOCK_STATE_FULL;
+			yaffs_gc_candidate_update(dev, dev->alloc_block);
 			dev->alloc_block = -1;
 		}
 
@@ -478,6 +483,7 @@ void yaffs_skip_rest_of_block(struct yaffs_dev *dev)
 		bi = yaffs_get_block_info(dev, dev->alloc_block);
 		if (bi->block_state == YAFFS_BLOCK_STATE_ALLOCATING) {
 			bi->block_state = YAFFS_BLOCK_STATE_FULL;
+			yaffs_gc_candidate_update(dev, dev->alloc_block);
 			dev->alloc_block = -1;
 		}
 	}
@@ -625,6 +631,7 @@ static void yaffs_retire_block(struct yaffs_dev *dev, int flash_block)
 	bi->block_state = YAFFS_BLOCK_STATE_DEAD;
 	bi->gc_prioritise = 0;
 	bi->needs_retiring = 0;
+	yaffs_gc_candidate_update(dev, flash_block);
 
 	dev->n_retired_blocks++;
 }
@@ -720,6 +727,15 @@ static void yaffs_free_tnode(struct yaffs_dev *dev, struct yaffs_tnode *tn)
 
 static void yaffs_deinit_tnodes_and_objs(struct yaffs_dev *dev)
 {
+	struct yaffs_dir_index *index;
+
+	/* The objects are all going away, so just drop the indexes */
+	while (!list_empty(&dev->dir_indexes)) {
+		index = list_entry(dev->dir_indexes.next,
+				   struct yaffs_dir_index, link);
+		yaffs_dir_index_free(index->dir, 0);
+	}
+
 	yaffs_deinit_raw_tnodes_and_objs(dev);
 	dev->n_obj = 0;
 	dev->n_tnodes = 0;
@@ -1185,6 +1201,7 @@ static void yaffs_soft_del_chunk(struct yaffs_dev *dev, int chunk)
 		the_block->soft_del_pages++;
 		dev->n_free_chunks++;
 		yaffs2_update_oldest_dirty_seq(dev, block_no, the_block);
+		yaffs_gc_candidate_update(dev, block_no);
 	}
 }
 
@@ -1255,6 +1272,13 @@ static void yaffs_remove_obj_from_dir(struct yaffs_obj *obj)
 	if (dev && dev->param.remove_obj_fn)
 		dev->param.remove_obj_fn(obj);
 
+	if (!list_empty(&obj->name_link)) {
+		list_del_init(&obj->name_link);
+		if (obj->name_hashed)
+			parent->variant.dir_variant.index->n_hashed--;
+		obj->name_hashed = 0;
+	}
+
 	list_del_init(&obj->siblings);
 	obj->parent = NULL;
 
@@ -1290,6 +1314,11 @@ void yaffs_add_obj_to_dir(struct yaffs_obj *directory, struct yaffs_obj *obj)
 	list_add(&obj->siblings, &directory->variant.dir_variant.children);
 	obj->parent = directory;
 
+	/* The name may not be on NAND yet, so hash it at the next lookup */
+	if (directory->variant.dir_variant.index)
+		list_add(&obj->name_link,
+			 &directory->variant.dir_variant.index->pending);
+
 	if (directory == obj->my_dev->unlinked_dir
 	    || directory == obj->my_dev->del_dir) {
 		obj->unlinked = 1;
@@ -1357,68 +1386,122 @@ static int yaffs_change_obj_name(struct yaffs_obj *obj,
  *   In Linux, the page cache provides read buffering and the short op cache
  *   provides write buffering.
  *
- *   There are a small number (~10) of cache chunks per device so that we don't
- *   need a very intelligent search.
+ *   Cache entries are hashed on (object, chunk_id) so lookups stay cheap
+ *   with a few hundred entries, and kept on an LRU list so that the victim
+ *   is found without a scan. Evicting a dirty entry writes back just that
+ *   chunk rather than every dirty chunk of the owning object.
+ *   Each object lists its own entries with the dirty ones at the front, and
+ *   the device lists every dirty entry, so flushing and invalidating only
+ *   touch the entries concerned.
  */
 
-static int yaffs_obj_cache_dirty(struct yaffs_obj *obj)
+static inline struct list_head *yaffs_cache_bucket(struct yaffs_dev *dev,
+						   const struct yaffs_obj *obj,
+						   int chunk_id)
+{
+	u32 h = obj->obj_id * 0x9E3779B1 + (u32) chunk_id;
+
+	h ^= h >> 16;
+	return &dev->cache_buckets[h & (dev->n_cache_buckets - 1)];
+}
+
+static inline void yaffs_cache_set_dirty(struct yaffs_dev *dev,
+					 struct yaffs_cache *cache, int dirty)
+{
+	if (cache->dirty && !dirty) {
+		dev->n_dirty_caches--;
+		list_del_init(&cache->dirty_link);
+		list_move_tail(&cache->obj_link, &cache->object->cache_list);
+	} else if (!cache->dirty && dirty) {
+		dev->n_dirty_caches++;
+		list_add_tail(&cache->dirty_link, &dev->cache_dirty);
+		list_move(&cache->obj_link, &cache->object->cache_list);
+	}
+	cache->dirty = dirty;
+}
+
+/* Forget what an entry holds and make it the first candidate for reuse.
+ * Any dirty data is discarded.
+ */
+static void yaffs_cache_drop(struct yaffs_dev *dev, struct yaffs_cache *cache)
+{
+	yaffs_cache_set_dirty(dev, cache, 0);
+	list_del_init(&cache->hash_link);
+	list_del_init(&cache->obj_link);
+	cache->object = NULL;
+	list_move_tail(&cache->lru, &dev->cache_lru);
+}
+
+static struct yaffs_cache *yaffs_cache_lookup(const struct yaffs_obj *obj,
+					      int chunk_id)
 {
 	struct yaffs_dev *dev = obj->my_dev;
-	int i;
+	struct list_head *bucket = yaffs_cache_bucket(dev, obj, chunk_id);
+	struct list_head *i;
 	struct yaffs_cache *cache;
-	int n_caches = obj->my_dev->param.n_caches;
 
-	for (i = 0; i < n_caches; i++) {
-		cache = &dev->cache[i];
-		if (cache->object == obj && cache->dirty)
-			return 1;
+	list_for_each(i, bucket) {
+		cache = list_entry(i, struct yaffs_cache, hash_link);
+		if (cache->object == obj && cache->chunk_id == chunk_id)
+			return cache;
 	}
+	return NULL;
+}
+
+static int yaffs_obj_cache_dirty(struct yaffs_obj *obj)
+{
+	struct yaffs_cache *cache;
+
+	if (list_empty(&obj->cache_list))
+		return 0;
+
+	/* Dirty entries are kept at the front of the list */
+	cache = list_entry(obj->cache_list.next, struct yaffs_cache, obj_link);
+	return cache->dirty;
+}
+
+static int yaffs_cache_cmp(const void *a, const void *b)
+{
+	const struct yaffs_cache *ca = *(const struct yaffs_cache **)a;
+	const struct yaffs_cache *cb = *(const struct yaffs_cache **)b;
 
-	return 0;
+	return ca->chunk_id - cb->chunk_id;
 }
 
+/* Write back the dirty chunks of an object in chunk order.
+ * The entries stay valid (and clean) so later reads still hit.
+ */
 static void yaffs_flush_file_cache(struct yaffs_obj *obj)
 {
 	struct yaffs_dev *dev = obj->my_dev;
-	int lowest = -99;	/* Stop compiler whining. */
-	int i;
+	struct yaffs_cache **list = dev->cache_flush_list;
 	struct yaffs_cache *cache;
-	int chunk_written = 0;
-	int n_caches = obj->my_dev->param.n_caches;
+	struct list_head *l;
+	int n = 0;
+	int i;
 
-	if (n_caches < 1)
-		return;
-	do {
-		cache = NULL;
+	list_for_each(l, &obj->cache_list) {
+		cache = list_entry(l, struct yaffs_cache, obj_link);
+		if (!cache->dirty)
+			break;
+		if (!cache->locked)
+			list[n++] = cache;
+	}
 
-		/* Find the lowest dirty chunk for this object */
-		for (i = 0; i < n_caches; i++) {
-			if (dev->cache[i].object == obj &&
-			    dev->cache[i].dirty) {
-				if (!cache ||
-				    dev->cache[i].chunk_id < lowest) {
-					cache = &dev->cache[i];
-					lowest = cache->chunk_id;
-				}
-			}
-		}
+	if (n > 1)
+		sort(list, n, sizeof(list[0]), yaffs_cache_cmp, NULL);
 
-		if (cache && !cache->locked) {
-			/* Write it out and free it up */
-			chunk_written =
-			    yaffs_wr_data_obj(cache->object,
-					      cache->chunk_id,
-					      cache->data,
-					      cache->n_bytes, 1);
-			cache->dirty = 0;
-			cache->object = NULL;
+	for (i = 0; i < n; i++) {
+		cache = list[i];
+		if (yaffs_wr_data_obj(obj, cache->chunk_id, cache->data,
+				      cache->n_bytes, 1) <= 0) {
+			/* Hoosterman, disk full while writing cache out. */
+			yaffs_trace(YAFFS_TRACE_ERROR,
+				"yaffs tragedy: no space during cache write");
+			return;
 		}
-	} while (cache && chunk_written > 0);
-
-	if (cache)
-		/* Hoosterman, disk full while writing cache out. */
-		yaffs_trace(YAFFS_TRACE_ERROR,
-			"yaffs tragedy: no space during cache write");
+		yaffs_cache_set_dirty(dev, cache, 0);
+	}
 }
 
 /*yaffs_flush_whole_cache(dev)
@@ -1428,90 +1511,80 @@ static void yaffs_flush_file_cache(struct yaffs_obj *obj)
 
 void yaffs_flush_whole_cache(struct yaffs_dev *dev)
 {
-	struct yaffs_obj *obj;
-	int n_caches = dev->param.n_caches;
-	int i;
-
-	/* Find a dirty object in the cache and flush it...
-	 * until there are no further dirty objects.
-	 */
-	do {
-		obj = NULL;
-		for (i = 0; i < n_caches && !obj; i++) {
-			if (dev->cache[i].object && dev->cache[i].dirty)
-				obj = dev->cache[i].object;
-		}
-		if (obj)
-			yaffs_flush_file_cache(obj);
-	} while (obj);
-
-}
+	struct yaffs_cache *cache;
+	int n_dirty;
 
-/* Grab us a cache chunk for use.
- * First look for an empty one.
- * Then look for the least recently used non-dirty one.
- * Then look for the least recently used dirty one...., flush and look again.
- */
-static struct yaffs_cache *yaffs_grab_chunk_worker(struct yaffs_dev *dev)
-{
-	int i;
+	if (dev->param.n_caches < 1)
+		return;
 
-	if (dev->param.n_caches > 0) {
-		for (i = 0; i < dev->param.n_caches; i++) {
-			if (!dev->cache[i].object)
-				return &dev->cache[i];
-		}
+	/* Flush the owner of the oldest dirty entry until none are left.
+	 * If a flush makes no progress (no space, or only locked entries
+	 * remain) then give up rather than spin.
+	 */
+	while (!list_empty(&dev->cache_dirty)) {
+		cache = list_entry(dev->cache_dirty.next, struct yaffs_cache,
+				   dirty_link);
+		n_dirty = dev->n_dirty_caches;
+		yaffs_flush_file_cache(cache->object);
+		if (dev->n_dirty_caches >= n_dirty)
+			break;
 	}
-	return NULL;
 }
 
-static struct yaffs_cache *yaffs_grab_chunk_cache(struct yaffs_dev *dev)
+/* Grab us a cache chunk for use by (obj, chunk_id).
+ * The victim is the least recently used entry that is not locked. Unused
+ * entries live at the tail of the LRU list so they go first. A dirty victim
+ * has its chunk written back on its own; if that fails we return NULL and
+ * the caller bypasses the cache.
+ * The returned entry is hashed, clean and at the head of the LRU list, but
+ * its data is not loaded.
+ */
+static struct yaffs_cache *yaffs_grab_chunk_cache(struct yaffs_dev *dev,
+						  struct yaffs_obj *obj,
+						  int chunk_id)
 {
-	struct yaffs_cache *cache;
-	struct yaffs_obj *the_obj;
-	int usage;
-	int i;
-	int pushout;
+	struct yaffs_cache *cache = NULL;
+	struct list_head *i;
 
 	if (dev->param.n_caches < 1)
 		return NULL;
 
-	/* Try find a non-dirty one... */
-
-	cache = yaffs_grab_chunk_worker(dev);
+	list_for_each_prev(i, &dev->cache_lru) {
+		cache = list_entry(i, struct yaffs_cache, lru);
+		if (!cache->locked)
+			break;
+		cache = NULL;
+	}
 
-	if (!cache) {
-		/* They were all dirty, find the LRU object and flush
-		 * its cache, then  find again.
-		 * NB what's here is not very accurate,
-		 * we actually flush the object with the LRU chunk.
-		 */
+	if (!cache)
+		return NULL;
 
-		/* With locking we can't assume we can use entry zero,
-		 * Set the_obj to a valid pointer for Coverity. */
-		the_obj = dev->cache[0].object;
-		usage = -1;
-		cache = NULL;
-		pushout = -1;
-
-		for (i = 0; i < dev->param.n_caches; i++) {
-			if (dev->cache[i].object &&
-			    !dev->cache[i].locked &&
-			    (dev->cache[i].last_use < usage ||
-			    !cache)) {
-				usage = dev->cache[i].last_use;
-				the_obj = dev->cache[i].object;
-				cache = &dev->cache[i];
-				pushout = i;
+	if (cache->object) {
+		if (cache->dirty) {
+			cache->locked = 1;
+			if (yaffs_wr_data_obj(cache->object, cache->chunk_id,
+					      cache->data, cache->n_bytes,
+					      1) <= 0) {
+				cache->locked = 0;
+				yaffs_trace(YAFFS_TRACE_ERROR,
+					"yaffs tragedy: no space during cache write");
+				return NULL;
 			}
+			cache->locked = 0;
+			yaffs_cache_set_dirty(dev, cache, 0);
 		}
-
-		if (!cache || cache->dirty) {
-			/* Flush and try again */
-			yaffs_flush_file_cache(the_obj);
-			cache = yaffs_grab_chunk_worker(dev);
-		}
-	}
+		dev->cache_evictions++;
+	}
+
+	dev->cache_misses++;
+	list_del(&cache->hash_link);
+	list_del(&cache->obj_link);
+	cache->object = obj;
+	cache->chunk_id = chunk_id;
+	cache->n_bytes = 0;
+	list_add(&cache->hash_link, yaffs_cache_bucket(dev, obj, chunk_id));
+	list_add_tail(&cache->obj_link, &obj->cache_list);
+	list_move(&cache->lru, &dev->cache_lru);
 	return cache;
 }
 
@@ -1520,44 +1593,28 @@ static struct yaffs_cache *yaffs_find_chunk_cache(const struct yaffs_obj *obj,
 						  int chunk_id)
 {
 	struct yaffs_dev *dev = obj->my_dev;
-	int i;
+	struct yaffs_cache *cache;
 
 	if (dev->param.n_caches < 1)
 		return NULL;
 
-	for (i = 0; i < dev->param.n_caches; i++) {
-		if (dev->cache[i].object == obj &&
-		    dev->cache[i].chunk_id == chunk_id) {
-			dev->cache_hits++;
-
-			return &dev->cache[i];
-		}
-	}
-	return NULL;
+	cache = yaffs_cache_lookup(obj, chunk_id);
+	if (cache)
+		dev->cache_hits++;
+	return cache;
 }
 
 /* Mark the chunk for the least recently used algorithym */
 static void yaffs_use_cache(struct yaffs_dev *dev, struct yaffs_cache *cache,
 			    int is_write)
 {
-	int i;
-
 	if (dev->param.n_caches < 1)
 		return;
 
-	if (dev->cache_last_use < 0 ||
-		dev->cache_last_use > 100000000) {
-		/* Reset the cache usages */
-		for (i = 1; i < dev->param.n_caches; i++)
-			dev->cache[i].last_use = 0;
-
-		dev->cache_last_use = 0;
-	}
-	dev->cache_last_use++;
-	cache->last_use = dev->cache_last_use;
+	list_move(&cache->lru, &dev->cache_lru);
 
 	if (is_write)
-		cache->dirty = 1;
+		yaffs_cache_set_dirty(dev, cache, 1);
 }
 
 /* Invalidate a single cache page.
@@ -1566,13 +1623,14 @@ static void yaffs_use_cache(struct yaffs_dev *dev, struct yaffs_cache *cache,
  */
 static void yaffs_invalidate_chunk_cache(struct yaffs_obj *object, int chunk_id)
 {
+	struct yaffs_dev *dev = object->my_dev;
 	struct yaffs_cache *cache;
 
-	if (object->my_dev->param.n_caches > 0) {
-		cache = yaffs_find_chunk_cache(object, chunk_id);
+	if (dev->param.n_caches > 0) {
+		cache = yaffs_cache_lookup(object, chunk_id);
 
 		if (cache)
-			cache->object = NULL;
+			yaffs_cache_drop(dev, cache);
 	}
 }
 
@@ -1581,16 +1639,11 @@ static void yaffs_invalidate_chunk_cache(struct yaffs_obj *object, int chunk_id)
  */
 static void yaffs_invalidate_whole_cache(struct yaffs_obj *in)
 {
-	int i;
 	struct yaffs_dev *dev = in->my_dev;
 
-	if (dev->param.n_caches > 0) {
-		/* Invalidate it. */
-		for (i = 0; i < dev->param.n_caches; i++) {
-			if (dev->cache[i].object == in)
-				dev->cache[i].object = NULL;
-		}
-	}
+	while (!list_empty(&in->cache_list))
+		yaffs_cache_drop(dev, list_entry(in->cache_list.next,
+						 struct yaffs_cache, obj_link));
 }
 
 static void yaffs_unhash_obj(struct yaffs_obj *obj)
@@ -1623,6 +1676,11 @@ static void yaffs_free_obj(struct yaffs_obj *obj)
 	if (!list_empty(&obj->siblings))
 		BUG();
 
+	yaffs_invalidate_whole_cache(obj);
+
+	if (obj->variant_type == YAFFS_OBJECT_TYPE_DIRECTORY)
+		yaffs_dir_index_free(obj, 1);
+
 	if (obj->my_inode) {
 		/* We're still hooked up to a cached inode.
 		 * Don't delete now, but mark for later deletion
@@ -1812,6 +1870,8 @@ static struct yaffs_obj *yaffs_alloc_empty_obj(struct yaffs_dev *dev)
 	INIT_LIST_HEAD(&(obj->hard_links));
 	INIT_LIST_HEAD(&(obj->hash_link));
 	INIT_LIST_HEAD(&obj->siblings);
+	INIT_LIST_HEAD(&obj->name_link);
+	INIT_LIST_HEAD(&obj->cache_list);
 
 	/* Now make the directory sane */
 	if (dev->root_dir) {
@@ -1997,6 +2057,7 @@ static void yaffs_init_tnodes_and_objs(struct yaffs_dev *dev)
 	dev->n_obj = 0;
 	dev->n_tnodes = 0;
 	yaffs_init_raw_tnodes_and_objs(dev);
+	INIT_LIST_HEAD(&dev->dir_indexes);
 
 	for (i = 0; i < YAFFS_NOBJECT_BUCKETS; i++) {
 		INIT_LIST_HEAD(&dev->obj_bucket[i].list);
@@ -2302,6 +2363,169 @@ alloc_error:
 	return YAFFS_FAIL;
 }
 
+/* The block query results only save flash reads, so running without them
+ * when memory is short is fine.
+ */
+static void yaffs_init_block_query(struct yaffs_dev *dev)
+{
+	int n_blocks = dev->internal_end_block - dev->internal_start_block + 1;
+	int n_bytes = n_blocks * sizeof(struct yaffs_block_query);
+
+	dev->block_query = kmalloc(n_bytes, GFP_NOFS);
+	if (!dev->block_query) {
+		dev->block_query = vmalloc(n_bytes);
+		dev->block_query_alt = 1;
+	} else {
+		dev->block_query_alt = 0;
+	}
+
+	if (dev->block_query)
+		memset(dev->block_query, 0, n_bytes);
+}
+
+static void yaffs_deinit_block_query(struct yaffs_dev *dev)
+{
+	if (dev->block_query_alt && dev->block_query)
+		vfree(dev->block_query);
+	else
+		kfree(dev->block_query);
+	dev->block_query_alt = 0;
+	dev->block_query = NULL;
+}
+
+/*---------------------- GC candidate heap ---------------------------------
+ * FULL blocks that have something to reclaim are kept in a binary min-heap
+ * ordered by live chunks, oldest first on a tie, so the collector does not
+ * have to go looking for them. Every change to a block's state or pages in
+ * use is followed by yaffs_gc_candidate_update() to keep the heap in step.
+ * The heap is built once the mount is complete.
+ */
+
+static inline int yaffs_gc_live_pages(struct yaffs_block_info *bi)
+{
+	return bi->pages_in_use - bi->soft_del_pages;
+}
+
+static int yaffs_gc_heap_less(struct yaffs_dev *dev, int a, int b)
+{
+	struct yaffs_block_info *bia = yaffs_get_block_info(dev, a);
+	struct yaffs_block_info *bib = yaffs_get_block_info(dev, b);
+	int live_a = yaffs_gc_live_pages(bia);
+	int live_b = yaffs_gc_live_pages(bib);
+
+	if (live_a != live_b)
+		return live_a < live_b;
+	return bia->seq_number < bib->seq_number;
+}
+
+static inline void yaffs_gc_heap_set(struct yaffs_dev *dev, int pos,
+				     int block_no)
+{
+	dev->gc_heap[pos] = block_no;
+	dev->gc_heap_pos[block_no - dev->internal_start_block] = pos;
+}
+
+/* Move the entry at pos up or down until the heap is in order again. */
+static void yaffs_gc_heap_sift(struct yaffs_dev *dev, int pos)
+{
+	int block_no = dev->gc_heap[pos];
+	int parent;
+	int child;
+
+	while (pos > 0) {
+		parent = (pos - 1) / 2;
+		if (!yaffs_gc_heap_less(dev, block_no, dev->gc_heap[parent]))
+			break;
+		yaffs_gc_heap_set(dev, pos, dev->gc_heap[parent]);
+		pos = parent;
+	}
+
+	while ((child = pos * 2 + 1) < dev->gc_heap_size) {
+		if (child + 1 < dev->gc_heap_size &&
+		    yaffs_gc_heap_less(dev, dev->gc_heap[child + 1],
+				       dev->gc_heap[child]))
+			child++;
+		if (!yaffs_gc_heap_less(dev, dev->gc_heap[child], block_no))
+			break;
+		yaffs_gc_heap_set(dev, pos, dev->gc_heap[child]);
+		pos = child;
+	}
+
+	yaffs_gc_heap_set(dev, pos, block_no);
+}
+
+static void yaffs_gc_candidate_update(struct yaffs_dev *dev, int block_no)
+{
+	struct yaffs_block_info *bi;
+	int pos;
+	int candidate;
+
+	if (!dev->gc_heap)
+		return;
+
+	bi = yaffs_get_block_info(dev, block_no);
+	pos = dev->gc_heap_pos[block_no - dev->internal_start_block];
+	candidate = bi->block_state == YAFFS_BLOCK_STATE_FULL &&
+		    yaffs_gc_live_pages(bi) < dev->param.chunks_per_block;
+
+	if (candidate && pos < 0) {
+		yaffs_gc_heap_set(dev, dev->gc_heap_size, block_no);
+		dev->gc_heap_size++;
+		yaffs_gc_heap_sift(dev, dev->gc_heap_size - 1);
+	} else if (candidate) {
+		yaffs_gc_heap_sift(dev, pos);
+	} else if (pos >= 0) {
+		dev->gc_heap_pos[block_no - dev->internal_start_block] = -1;
+		dev->gc_heap_size--;
+		if (pos < dev->gc_heap_size) {
+			yaffs_gc_heap_set(dev, pos,
+					  dev->gc_heap[dev->gc_heap_size]);
+			yaffs_gc_heap_sift(dev, pos);
+		}
+	}
+}
+
+/* Like the block query results, the heap only saves work. Without it the
+ * collector falls back to searching for candidates.
+ */
+static void yaffs_gc_heap_init(struct yaffs_dev *dev)
+{
+	int n_blocks = dev->internal_end_block - dev->internal_start_block + 1;
+	int n_bytes = 2 * n_blocks * sizeof(int);
+	int i;
+
+	dev->gc_heap = kmalloc(n_bytes, GFP_NOFS);
+	if (!dev->gc_heap) {
+		dev->gc_heap = vmalloc(n_bytes);
+		dev->gc_heap_alt = 1;
+	} else {
+		dev->gc_heap_alt = 0;
+	}
+
+	if (!dev->gc_heap)
+		return;
+
+	dev->gc_heap_pos = dev->gc_heap + n_blocks;
+	dev->gc_heap_size = 0;
+	for (i = 0; i < n_blocks; i++)
+		dev->gc_heap_pos[i] = -1;
+
+	for (i = dev->internal_start_block; i <= dev->internal_end_block; i++)
+		yaffs_gc_candidate_update(dev, i);
+}
+
+static void yaffs_gc_heap_deinit(struct yaffs_dev *dev)
+{
+	if (dev->gc_heap_alt && dev->gc_heap)
+		vfree(dev->gc_heap);
+	else
+		kfree(dev->gc_heap);
+	dev->gc_heap_alt = 0;
+	dev->gc_heap = NULL;
+	dev->gc_heap_pos = NULL;
+	dev->gc_heap_size = 0;
+}
+
 
 void yaffs_block_became_dirty(struct yaffs_dev *dev, int block_no)
 {
@@ -2321,6 +2545,7 @@ void yaffs_block_became_dirty(struct yaffs_dev *dev, int block_no)
 	yaffs2_clear_oldest_dirty_seq(dev, bi);
 
 	bi->block_state = YAFFS_BLOCK_STATE_DIRTY;
+	yaffs_gc_candidate_update(dev, block_no);
 
 	/* If this is the block being garbage collected then stop gc'ing */
 	if (block_no == dev->gc_block)
@@ -2546,8 +2771,10 @@ static int yaffs_gc_block(struct yaffs_dev *dev, int block, int whole_block)
 
 	/*yaffs_verify_free_chunks(dev); */
 
-	if (bi->block_state == YAFFS_BLOCK_STATE_FULL)
+	if (bi->block_state == YAFFS_BLOCK_STATE_FULL) {
 		bi->block_state = YAFFS_BLOCK_STATE_COLLECTING;
+		yaffs_gc_candidate_update(dev, block);
+	}
 
 	bi->has_shrink_hdr = 0;	/* clear the flag so that the block can erase */
 
@@ -2593,6 +2820,7 @@ static int yaffs_gc_block(struct yaffs_dev *dev, int block, int whole_block)
 		 * because checkpointing does not restore gc.
 		 */
 		bi->block_state = YAFFS_BLOCK_STATE_FULL;
+		yaffs_gc_candidate_update(dev, block);
 	} else {
 		/* The gc completed. */
 		/* Do any required cleanups */
@@ -2627,6 +2855,67 @@ static int yaffs_gc_block(struct yaffs_dev *dev, int block, int whole_block)
 	return ret_val;
 }
 
+/* Number of heap entries (the top few levels) the collector considers.
+ * These are the blocks with the fewest live chunks, so any age weighting
+ * only reorders blocks that are already nearly the dirtiest.
+ */
+#define YAFFS_GC_HEAP_SCAN	63
+#define YAFFS_GC_MAX_AGE	0xffff
+
+static u32 yaffs_gc_score(struct yaffs_dev *dev, struct yaffs_block_info *bi)
+{
+	u32 live = yaffs_gc_live_pages(bi);
+	u32 gain = dev->param.chunks_per_block - live;
+	u32 age;
+
+	if (dev->param.gc_policy != YAFFS_GC_POLICY_COST_BENEFIT ||
+	    !dev->param.is_yaffs2)
+		return gain;
+
+	/* Age is how many blocks have been allocated since this one.
+	 * Reclaiming costs a block read plus writing out the live chunks.
+	 */
+	age = dev->seq_number - bi->seq_number + 1;
+	if (age > YAFFS_GC_MAX_AGE)
+		age = YAFFS_GC_MAX_AGE;
+
+	return (gain * age * 16) / (dev->param.chunks_per_block + live);
+}
+
+/* Pick the best scoring block near the top of the candidate heap that is
+ * within the threshold. With the greedy policy this is the top of the heap
+ * whenever that block may be collected. With cost-benefit it is the oldest
+ * for its cost among those few entries; blocks further down the heap are
+ * never scored however old they are.
+ */
+static unsigned yaffs_gc_heap_select(struct yaffs_dev *dev, int threshold)
+{
+	struct yaffs_block_info *bi;
+	unsigned selected = 0;
+	u32 best = 0;
+	u32 score;
+	int n = dev->gc_heap_size;
+	int i;
+
+	if (n > YAFFS_GC_HEAP_SCAN)
+		n = YAFFS_GC_HEAP_SCAN;
+
+	for (i = 0; i < n; i++) {
+		bi = yaffs_get_block_info(dev, dev->gc_heap[i]);
+		if (yaffs_gc_live_pages(bi) > threshold ||
+		    !yaffs_block_ok_for_gc(dev, bi))
+			continue;
+
+		score = yaffs_gc_score(dev, bi);
+		if (!selected || score > best) {
+			selected = dev->gc_heap[i];
+			best = score;
+			dev->gc_pages_in_use = yaffs_gc_live_pages(bi);
+		}
+	}
+	return selected;
+}
+
 /*
  * find_gc_block() selects the dirtiest block (or close enough)
  * for garbage collection.
@@ -2710,33 +2999,43 @@ static unsigned yaffs_find_gc_block(struct yaffs_dev *dev,
 				iterations = 100;
 		}
 
-		for (i = 0;
-		     i < iterations &&
-		     (dev->gc_dirtiest < 1 ||
-		      dev->gc_pages_in_use > YAFFS_GC_GOOD_ENOUGH);
-		     i++) {
-			dev->gc_block_finder++;
-			if (dev->gc_block_finder < dev->internal_start_block ||
-			    dev->gc_block_finder > dev->internal_end_block)
-				dev->gc_block_finder =
-				    dev->internal_start_block;
-
-			bi = yaffs_get_block_info(dev, dev->gc_block_finder);
-
-			pages_used = bi->pages_in_use - bi->soft_del_pages;
-
-			if (bi->block_state == YAFFS_BLOCK_STATE_FULL &&
-			    pages_used < dev->param.chunks_per_block &&
-			    (dev->gc_dirtiest < 1 ||
-			     pages_used < dev->gc_pages_in_use) &&
-			    yaffs_block_ok_for_gc(dev, bi)) {
-				dev->gc_dirtiest = dev->gc_block_finder;
-				dev->gc_pages_in_use = pages_used;
+		if (dev->gc_heap) {
+			selected = yaffs_gc_heap_select(dev, threshold);
+		} else {
+			for (i = 0;
+			     i < iterations &&
+			     (dev->gc_dirtiest < 1 ||
+			      dev->gc_pages_in_use > YAFFS_GC_GOOD_ENOUGH);
+			     i++) {
+				dev->gc_block_finder++;
+				if (dev->gc_block_finder <
+				    dev->internal_start_block ||
+				    dev->gc_block_finder >
+				    dev->internal_end_block)
+					dev->gc_block_finder =
+					    dev->internal_start_block;
+
+				bi = yaffs_get_block_info(dev,
+						dev->gc_block_finder);
+
+				pages_used = bi->pages_in_use -
+					     bi->soft_del_pages;
+
+				if (bi->block_state ==
+				    YAFFS_BLOCK_STATE_FULL &&
+				    pages_used < dev->param.chunks_per_block &&
+				    (dev->gc_dirtiest < 1 ||
+				     pages_used < dev->gc_pages_in_use) &&
+				    yaffs_block_ok_for_gc(dev, bi)) {
+					dev->gc_dirtiest = dev->gc_block_finder;
+					dev->gc_pages_in_use = pages_used;
+				}
 			}
-		}
 
-		if (dev->gc_dirtiest > 0 && dev->gc_pages_in_use <= threshold)
-			selected = dev->gc_dirtiest;
+			if (dev->gc_dirtiest > 0 &&
+			    dev->gc_pages_in_use <= threshold)
+				selected = dev->gc_dirtiest;
+		}
 	}
 
 	/*
@@ -2977,6 +3276,8 @@ void yaffs_chunk_del(struct yaffs_dev *dev, int chunk_id, int mark_flash,
 		    bi->block_state != YAFFS_BLOCK_STATE_ALLOCATING &&
 		    bi->block_state != YAFFS_BLOCK_STATE_NEEDS_SCAN) {
 			yaffs_block_became_dirty(dev, block);
+		} else {
+			yaffs_gc_candidate_update(dev, block);
 		}
 	}
 }
@@ -3451,23 +3752,18 @@ int yaffs_file_rd(struct yaffs_obj *in, u8 * buffer, loff_t offset, int n_bytes)
 		 */
 		if (cache || n_copy != dev->data_bytes_per_chunk ||
 		    dev->param.inband_tags) {
-			if (dev->param.n_caches > 0) {
 
-				/* If we can't find the data in the cache,
-				 * then load it up. */
+			/* If we can't find the data in the cache,
+			 * then load it up. */
 
-				if (!cache) {
-					cache =
-					    yaffs_grab_chunk_cache(in->my_dev);
-					cache->object = in;
-					cache->chunk_id = chunk;
-					cache->dirty = 0;
-					cache->locked = 0;
+			if (!cache) {
+				cache = yaffs_grab_chunk_cache(dev, in, chunk);
+				if (cache)
 					yaffs_rd_data_obj(in, chunk,
 							  cache->data);
-					cache->n_bytes = 0;
-				}
+			}
 
+			if (cache) {
 				yaffs_use_cache(dev, cache, 0);
 
 				cache->locked = 1;
@@ -3498,6 +3794,73 @@ int yaffs_file_rd(struct yaffs_obj *in, u8 * buffer, loff_t offset, int n_bytes)
 	return n_done;
 }
 
+/*
+ * Read file data with the device lock held shared.
+ *
+ * Nothing here may change device state, since other readers can be in here
+ * at the same time: the short-op cache is consulted but not updated, chunks
+ * that would need a cache entry or a temp buffer are not read, and a chunk
+ * that comes back with an ECC event is left for the exclusive path so that
+ * the block gets marked. Returns the number of bytes read, which may be
+ * short; the caller reads the rest with yaffs_file_rd() under the
+ * exclusive lock.
+ */
+int yaffs_file_rd_shared(struct yaffs_obj *in, u8 *buffer, loff_t offset,
+			 int n_bytes)
+{
+	int chunk;
+	int nand_chunk;
+	u32 start;
+	int n_copy;
+	int n = n_bytes;
+	int n_done = 0;
+	struct yaffs_cache *cache = NULL;
+	struct yaffs_ext_tags tags;
+	struct yaffs_dev *dev;
+
+	dev = in->my_dev;
+
+	/* yaffs1 and inband tags read through paths that touch shared
+	 * buffers or block state, as does tags matching in chunk groups.
+	 */
+	if (!dev->param.is_yaffs2 || dev->param.inband_tags ||
+	    dev->chunk_grp_size > 1)
+		return 0;
+
+	while (n > 0) {
+		yaffs_addr_to_chunk(dev, offset, &chunk, &start);
+		chunk++;
+
+		if ((start + n) < dev->data_bytes_per_chunk)
+			n_copy = n;
+		else
+			n_copy = dev->data_bytes_per_chunk - start;
+
+		if (dev->param.n_caches > 0)
+			cache = yaffs_cache_lookup(in, chunk);
+
+		if (cache) {
+			memcpy(buffer, &cache->data[start], n_copy);
+		} else if (n_copy != dev->data_bytes_per_chunk) {
+			break;
+		} else {
+			nand_chunk = yaffs_find_chunk_in_file(in, chunk, NULL);
+			if (nand_chunk < 0) {
+				memset(buffer, 0, n_copy);
+			} else if (yaffs_rd_chunk_tags_nand_shared(dev,
+					nand_chunk, buffer, &tags) != YAFFS_OK ||
+				   tags.ecc_result > YAFFS_ECC_RESULT_NO_ERROR) {
+				break;
+			}
+		}
+		n -= n_copy;
+		offset += n_copy;
+		buffer += n_copy;
+		n_done += n_copy;
+	}
+	return n_done;
+}
+
 int yaffs_do_file_wr(struct yaffs_obj *in, const u8 *buffer, loff_t offset,
 		     int n_bytes, int write_through)
 {
@@ -3584,13 +3947,11 @@ int yaffs_do_file_wr(struct yaffs_obj *in, const u8 *buffer, loff_t offset,
 
 				if (!cache &&
 				    yaffs_check_alloc_available(dev, 1)) {
-					cache = yaffs_grab_chunk_cache(dev);
-					cache->object = in;
-					cache->chunk_id = chunk;
-					cache->dirty = 0;
-					cache->locked = 0;
-					yaffs_rd_data_obj(in, chunk,
-							  cache->data);
+					cache = yaffs_grab_chunk_cache(dev, in,
+								       chunk);
+					if (cache)
+						yaffs_rd_data_obj(in, chunk,
+								  cache->data);
 				} else if (cache &&
 					   !cache->dirty &&
 					   !yaffs_check_alloc_available(dev,
@@ -3619,7 +3980,8 @@ int yaffs_do_file_wr(struct yaffs_obj *in, const u8 *buffer, loff_t offset,
 						     cache->chunk_id,
 						     cache->data,
 						     cache->n_bytes, 1);
-						cache->dirty = 0;
+						yaffs_cache_set_dirty(dev,
+								      cache, 0);
 					}
 				} else {
 					chunk_written = -1;	/* fail write */
@@ -4318,6 +4680,240 @@ static void yaffs_empty_l_n_f(struct yaffs_dev *dev)
 }
 
 
+/*------------------------ Directory name index ---------------------------
+ *
+ * A plain lookup walks every child whose 16-bit name sum collides, and
+ * fetching the name of a child with a long name means reading its object
+ * header from NAND. Large directories therefore get a hash index of their
+ * children keyed by the full name, so only children whose full hash matches
+ * need their name fetched.
+ *
+ * The index is built the first time a lookup has to walk more than
+ * dir_index_threshold children. Children added afterwards are parked on the
+ * pending list and hashed by the next lookup, by which time their object
+ * header has been written. Children that have no header at all stay on the
+ * pending list and are checked the slow way.
+ */
+
+static u32 yaffs_calc_name_hash(const YCHAR *name)
+{
+	u32 hash = 2166136261U;
+	int i;
+
+	for (i = 0; i < YAFFS_MAX_NAME_LENGTH && name[i]; i++)
+		hash = (hash ^ name[i]) * 16777619U;
+	return hash;
+}
+
+static struct list_head *yaffs_dir_index_alloc_buckets(struct yaffs_dev *dev,
+						       u32 n_buckets,
+						       int *alt)
+{
+	struct list_head *buckets;
+	u32 bytes = n_buckets * sizeof(struct list_head);
+	u32 i;
+
+	if (dev->dir_index_bytes + bytes > dev->param.dir_index_max_bytes)
+		return NULL;
+
+	buckets = kmalloc(bytes, GFP_NOFS);
+	*alt = 0;
+	if (!buckets) {
+		buckets = vmalloc(bytes);
+		*alt = 1;
+	}
+	if (!buckets)
+		return NULL;
+
+	for (i = 0; i < n_buckets; i++)
+		INIT_LIST_HEAD(&buckets[i]);
+	dev->dir_index_bytes += bytes;
+	return buckets;
+}
+
+static void yaffs_dir_index_free_buckets(struct yaffs_dev *dev,
+					 struct list_head *buckets,
+					 u32 n_buckets, int alt)
+{
+	if (alt)
+		vfree(buckets);
+	else
+		kfree(buckets);
+	dev->dir_index_bytes -= n_buckets * sizeof(struct list_head);
+}
+
+static void yaffs_dir_index_free(struct yaffs_obj *dir, int unlink_children)
+{
+	struct yaffs_dev *dev = dir->my_dev;
+	struct yaffs_dir_index *index = dir->variant.dir_variant.index;
+	struct yaffs_obj *l;
+	u32 b;
+
+	if (!index)
+		return;
+
+	if (unlink_children) {
+		for (b = 0; b <= index->n_buckets; b++) {
+			struct list_head *head = (b < index->n_buckets) ?
+				&index->buckets[b] : &index->pending;
+
+			while (!list_empty(head)) {
+				l = list_entry(head->next, struct yaffs_obj,
+					       name_link);
+				list_del_init(&l->name_link);
+				l->name_hashed = 0;
+			}
+		}
+	}
+
+	yaffs_dir_index_free_buckets(dev, index->buckets, index->n_buckets,
+				     index->buckets_alt);
+	list_del(&index->link);
+	kfree(index);
+	dev->dir_index_bytes -= sizeof(struct yaffs_dir_index);
+	dev->n_dir_indexes--;
+	dir->variant.dir_variant.index = NULL;
+}
+
+static void yaffs_dir_index_build(struct yaffs_obj *dir, u32 n_children)
+{
+	struct yaffs_dev *dev = dir->my_dev;
+	struct yaffs_dir_index *index;
+	struct list_head *i;
+	struct yaffs_obj *l;
+	u32 n_buckets = 16;
+	int alt;
+
+	/* Duplicate names are fine in the unlinked and deleted directories */
+	if (dir == dev->unlinked_dir || dir == dev->del_dir)
+		return;
+
+	if (dev->dir_index_bytes + sizeof(struct yaffs_dir_index) >
+	    dev->param.dir_index_max_bytes)
+		return;
+
+	while (n_buckets < n_children)
+		n_buckets <<= 1;
+
+	index = kmalloc(sizeof(struct yaffs_dir_index), GFP_NOFS);
+	if (!index)
+		return;
+	dev->dir_index_bytes += sizeof(struct yaffs_dir_index);
+
+	index->buckets = yaffs_dir_index_alloc_buckets(dev, n_buckets, &alt);
+	if (!index->buckets) {
+		kfree(index);
+		dev->dir_index_bytes -= sizeof(struct yaffs_dir_index);
+		return;
+	}
+
+	index->dir = dir;
+	index->n_buckets = n_buckets;
+	index->n_hashed = 0;
+	index->buckets_alt = alt;
+	INIT_LIST_HEAD(&index->pending);
+	list_add(&index->link, &dev->dir_indexes);
+	dir->variant.dir_variant.index = index;
+	dev->n_dir_indexes++;
+
+	list_for_each(i, &dir->variant.dir_variant.children) {
+		l = list_entry(i, struct yaffs_obj, siblings);
+		list_add_tail(&l->name_link, &index->pending);
+	}
+
+	yaffs_trace(YAFFS_TRACE_OS,
+		"Directory %d: name index of %d buckets for %d children",
+		dir->obj_id, n_buckets, n_children);
+}
+
+/* Double the bucket count if the memory budget allows it. */
+static void yaffs_dir_index_grow(struct yaffs_dev *dev,
+				 struct yaffs_dir_index *index)
+{
+	struct list_head *buckets;
+	struct yaffs_obj *l;
+	u32 n_buckets = index->n_buckets << 1;
+	u32 b;
+	int alt;
+
+	buckets = yaffs_dir_index_alloc_buckets(dev, n_buckets, &alt);
+	if (!buckets)
+		return;
+
+	for (b = 0; b < index->n_buckets; b++) {
+		while (!list_empty(&index->buckets[b])) {
+			l = list_entry(index->buckets[b].next,
+				       struct yaffs_obj, name_link);
+			list_del(&l->name_link);
+			list_add(&l->name_link,
+				 &buckets[l->name_hash & (n_buckets - 1)]);
+		}
+	}
+
+	yaffs_dir_index_free_buckets(dev, index->buckets, index->n_buckets,
+				     index->buckets_alt);
+	index->buckets = buckets;
+	index->n_buckets = n_buckets;
+	index->buckets_alt = alt;
+}
+
+/* Hash the pending children that have a name on NAND by now. */
+static void yaffs_dir_index_resolve(struct yaffs_dir_index *index,
+				    YCHAR *buffer)
+{
+	struct list_head *i, *n;
+	struct yaffs_obj *l;
+
+	list_for_each_safe(i, n, &index->pending) {
+		l = list_entry(i, struct yaffs_obj, name_link);
+
+		yaffs_check_obj_details_loaded(l);
+		if (l->hdr_chunk <= 0 && l->obj_id != YAFFS_OBJECTID_LOSTNFOUND)
+			continue;
+
+		yaffs_get_obj_name(l, buffer, YAFFS_MAX_NAME_LENGTH + 1);
+		l->name_hash = yaffs_calc_name_hash(buffer);
+		l->name_hashed = 1;
+		list_del(&l->name_link);
+		list_add(&l->name_link,
+			 &index->buckets[l->name_hash & (index->n_buckets - 1)]);
+		index->n_hashed++;
+	}
+
+	if (index->n_hashed > 2 * index->n_buckets)
+		yaffs_dir_index_grow(index->dir->my_dev, index);
+}
+
+static struct yaffs_obj *yaffs_dir_index_find(struct yaffs_dir_index *index,
+					      const YCHAR *name,
+					      YCHAR *buffer)
+{
+	struct list_head *i;
+	struct yaffs_obj *l;
+	u32 hash;
+
+	yaffs_dir_index_resolve(index, buffer);
+
+	hash = yaffs_calc_name_hash(name);
+	list_for_each(i, &index->buckets[hash & (index->n_buckets - 1)]) {
+		l = list_entry(i, struct yaffs_obj, name_link);
+		if (l->name_hash != hash)
+			continue;
+		yaffs_get_obj_name(l, buffer, YAFFS_MAX_NAME_LENGTH + 1);
+		if (!strncmp(name, buffer, YAFFS_MAX_NAME_LENGTH))
+			return l;
+	}
+
+	/* Children without an object header yet */
+	list_for_each(i, &index->pending) {
+		l = list_entry(i, struct yaffs_obj, name_link);
+		yaffs_get_obj_name(l, buffer, YAFFS_MAX_NAME_LENGTH + 1);
+		if (!strncmp(name, buffer, YAFFS_MAX_NAME_LENGTH))
+			return l;
+	}
+	return NULL;
+}
+
 struct yaffs_obj *yaffs_find_by_name(struct yaffs_obj *directory,
 				     const YCHAR *name)
 {
@@ -4325,6 +4921,9 @@ struct yaffs_obj *yaffs_find_by_name(struct yaffs_obj *directory,
 	struct list_head *i;
 	YCHAR buffer[YAFFS_MAX_NAME_LENGTH + 1];
 	struct yaffs_obj *l;
+	struct yaffs_obj *found = NULL;
+	struct yaffs_dev *dev;
+	u32 n_walked = 0;
 
 	if (!name)
 		return NULL;
@@ -4343,10 +4942,18 @@ struct yaffs_obj *yaffs_find_by_name(struct yaffs_obj *directory,
 		BUG();
 	}
 
+	dev = directory->my_dev;
+	if (directory->variant.dir_variant.index) {
+		dev->dir_index_hits++;
+		return yaffs_dir_index_find(directory->variant.dir_variant.index,
+					    name, buffer);
+	}
+
 	sum = yaffs_calc_name_sum(name);
 
 	list_for_each(i, &directory->variant.dir_variant.children) {
 		l = list_entry(i, struct yaffs_obj, siblings);
+		n_walked++;
 
 		if (l->parent != directory)
 			BUG();
@@ -4355,19 +4962,28 @@ struct yaffs_obj *yaffs_find_by_name(struct yaffs_obj *directory,
 
 		/* Special case for lost-n-found */
 		if (l->obj_id == YAFFS_OBJECTID_LOSTNFOUND) {
-			if (!strcmp(name, YAFFS_LOSTNFOUND_NAME))
-				return l;
+			if (!strcmp(name, YAFFS_LOSTNFOUND_NAME)) {
+				found = l;
+				break;
+			}
 		} else if (l->sum == sum || l->hdr_chunk <= 0) {
 			/* LostnFound chunk called Objxxx
 			 * Do a real check
 			 */
 			yaffs_get_obj_name(l, buffer,
 				YAFFS_MAX_NAME_LENGTH + 1);
-			if (!strncmp(name, buffer, YAFFS_MAX_NAME_LENGTH))
-				return l;
+			if (!strncmp(name, buffer, YAFFS_MAX_NAME_LENGTH)) {
+				found = l;
+				break;
+			}
 		}
 	}
-	return NULL;
+
+	if (dev->param.dir_index_threshold > 0 &&
+	    n_walked >= dev->param.dir_index_threshold)
+		yaffs_dir_index_build(directory, n_walked);
+
+	return found;
 }
 
 /* GetEquivalentObject dereferences any hard links to get to the
@@ -4705,6 +5321,8 @@ int yaffs_guts_initialise(struct yaffs_dev *dev)
 	int init_failed = 0;
 	unsigned x;
 	int bits;
+	u32 t_mount = Y_CURRENT_MSECS;
+	u32 t_phase;
 
 	if(yaffs_guts_ll_init(dev) != YAFFS_OK)
 		return YAFFS_FAIL;
@@ -4811,38 +5429,68 @@ int yaffs_guts_initialise(struct yaffs_dev *dev)
 		init_failed = 1;
 
 	dev->cache = NULL;
+	dev->cache_buckets = NULL;
+	dev->cache_flush_list = NULL;
+	dev->n_dirty_caches = 0;
 	dev->gc_cleanup_list = NULL;
+	dev->gc_heap = NULL;
+	dev->gc_heap_size = 0;
 
 	if (!init_failed && dev->param.n_caches > 0) {
 		int i;
 		void *buf;
-		int cache_bytes =
-		    dev->param.n_caches * sizeof(struct yaffs_cache);
+		int cache_bytes;
 
 		if (dev->param.n_caches > YAFFS_MAX_SHORT_OP_CACHES)
 			dev->param.n_caches = YAFFS_MAX_SHORT_OP_CACHES;
 
+		cache_bytes = dev->param.n_caches * sizeof(struct yaffs_cache);
 		dev->cache = kmalloc(cache_bytes, GFP_NOFS);
+		dev->cache_alt = 0;
+		if (!dev->cache) {
+			dev->cache = vmalloc(cache_bytes);
+			dev->cache_alt = 1;
+		}
+
+		dev->n_cache_buckets = 1;
+		while (dev->n_cache_buckets < dev->param.n_caches)
+			dev->n_cache_buckets <<= 1;
+		dev->cache_buckets =
+		    kmalloc(dev->n_cache_buckets * sizeof(struct list_head),
+			    GFP_NOFS);
+		dev->cache_flush_list =
+		    kmalloc(dev->param.n_caches * sizeof(struct yaffs_cache *),
+			    GFP_NOFS);
+		INIT_LIST_HEAD(&dev->cache_lru);
+		INIT_LIST_HEAD(&dev->cache_dirty);
 
 		buf = (u8 *) dev->cache;
+		if (!dev->cache_buckets || !dev->cache_flush_list)
+			buf = NULL;
 
-		if (dev->cache)
+		if (buf) {
 			memset(dev->cache, 0, cache_bytes);
+			for (i = 0; i < dev->n_cache_buckets; i++)
+				INIT_LIST_HEAD(&dev->cache_buckets[i]);
+		}
 
 		for (i = 0; i < dev->param.n_caches && buf; i++) {
+			INIT_LIST_HEAD(&dev->cache[i].hash_link);
+			INIT_LIST_HEAD(&dev->cache[i].obj_link);
+			INIT_LIST_HEAD(&dev->cache[i].dirty_link);
+			list_add_tail(&dev->cache[i].lru, &dev->cache_lru);
 			dev->cache[i].object = NULL;
-			dev->cache[i].last_use = 0;
 			dev->cache[i].dirty = 0;
 			dev->cache[i].data = buf =
 			    kmalloc(dev->param.total_bytes_per_chunk, GFP_NOFS);
 		}
 		if (!buf)
 			init_failed = 1;
-
-		dev->cache_last_use = 0;
 	}
 
 	dev->cache_hits = 0;
+	dev->cache_misses = 0;
+	dev->cache_evictions = 0;
 
 	if (!init_failed) {
 		dev->gc_cleanup_list =
@@ -4868,16 +5516,30 @@ int yaffs_guts_initialise(struct yaffs_dev *dev)
 		!yaffs_summary_init(dev))
 		init_failed = 1;
 
+	dev->mount_checkpt_ms = 0;
+	dev->mount_query_ms = 0;
+	dev->mount_scan_ms = 0;
+	dev->mount_fixup_ms = 0;
+	dev->mount_block_queries = 0;
+
 	if (!init_failed) {
 		/* Now scan the flash. */
 		if (dev->param.is_yaffs2) {
+			/* A failed checkpoint read has already queried the
+			 * blocks, keep the results for the scan.
+			 */
+			yaffs_init_block_query(dev);
+
+			t_phase = Y_CURRENT_MSECS;
 			if (yaffs2_checkpt_restore(dev)) {
+				dev->mount_checkpt_ms = Y_CURRENT_MSECS - t_phase;
 				yaffs_check_obj_details_loaded(dev->root_dir);
 				yaffs_trace(YAFFS_TRACE_CHECKPOINT |
 					YAFFS_TRACE_MOUNT,
 					"yaffs: restored from checkpoint"
 					);
 			} else {
+				dev->mount_checkpt_ms = Y_CURRENT_MSECS - t_phase;
 
 				/* Clean up the mess caused by an aborted
 				 * checkpoint load then scan backwards.
@@ -4906,14 +5568,20 @@ int yaffs_guts_initialise(struct yaffs_dev *dev)
 				if (!init_failed && !yaffs2_scan_backwards(dev))
 					init_failed = 1;
 			}
-		} else if (!yaffs1_scan(dev)) {
-			init_failed = 1;
+			yaffs_deinit_block_query(dev);
+		} else {
+			t_phase = Y_CURRENT_MSECS;
+			if (!yaffs1_scan(dev))
+				init_failed = 1;
+			dev->mount_scan_ms = Y_CURRENT_MSECS - t_phase;
 		}
 
+		t_phase = Y_CURRENT_MSECS;
 		yaffs_strip_deleted_objs(dev);
 		yaffs_fix_hanging_objs(dev);
 		if (dev->param.empty_lost_n_found)
 			yaffs_empty_l_n_f(dev);
+		dev->mount_fixup_ms = Y_CURRENT_MSECS - t_phase;
 	}
 
 	if (init_failed) {
@@ -4925,6 +5593,17 @@ int yaffs_guts_initialise(struct yaffs_dev *dev)
 		return YAFFS_FAIL;
 	}
 
+	yaffs_gc_heap_init(dev);
+
+	dev->mount_total_ms = Y_CURRENT_MSECS - t_mount;
+	dev->mount_page_reads = dev->n_page_reads;
+	yaffs_trace(YAFFS_TRACE_MOUNT,
+		"yaffs: mount took %u ms (checkpt %u query %u scan %u fixup %u), %u page reads, %u block queries",
+		dev->mount_total_ms, dev->mount_checkpt_ms,
+		dev->mount_query_ms, dev->mount_scan_ms,
+		dev->mount_fixup_ms, dev->mount_page_reads,
+		dev->mount_block_queries);
+
 	/* Zero out stats */
 	dev->n_page_reads = 0;
 	dev->n_page_writes = 0;
@@ -4962,11 +5641,19 @@ void yaffs_deinitialise(struct yaffs_dev *dev)
 				dev->cache[i].data = NULL;
 			}
 
-			kfree(dev->cache);
+			if (dev->cache_alt)
+				vfree(dev->cache);
+			else
+				kfree(dev->cache);
 			dev->cache = NULL;
 		}
+		kfree(dev->cache_buckets);
+		dev->cache_buckets = NULL;
+		kfree(dev->cache_flush_list);
+		dev->cache_flush_list = NULL;
 
 		kfree(dev->gc_cleanup_list);
+		yaffs_gc_heap_deinit(dev);
 
 		for (i = 0; i < YAFFS_N_TEMP_BUFFERS; i++)
 			kfree(dev->temp_buffer[i].buffer);
@@ -5006,21 +5693,13 @@ int yaffs_get_n_free_chunks(struct yaffs_dev *dev)
 {
 	/* This is what we report to the outside world */
 	int n_free;
-	int n_dirty_caches;
 	int blocks_for_checkpt;
-	int i;
 
 	n_free = dev->n_free_chunks;
 	n_free += dev->n_deleted_files;
 
-	/* Now count and subtract the number of dirty chunks in the cache. */
-
-	for (n_dirty_caches = 0, i = 0; i < dev->param.n_caches; i++) {
-		if (dev->cache[i].dirty)
-			n_dirty_caches++;
-	}
-
-	n_free -= n_dirty_caches;
+	/* Now subtract the number of dirty chunks in the cache. */
+	n_free -= dev->n_dirty_caches;
 
 	n_free -=
 	    ((dev->param.n_reserved_blocks + 1) * dev->param.chunks_per_block);
@@ -104,7 +104,7 @@
 #define YAFFS_OBJECTID_CHECKPOINT_DATA	0x20
 #define YAFFS_SEQUENCE_CHECKPOINT_DATA	0x21
 
-#define YAFFS_MAX_SHORT_OP_CACHES	20
+#define YAFFS_MAX_SHORT_OP_CACHES	1024
 
 #define YAFFS_N_TEMP_BUFFERS		6
 
@@ -127,11 +127,19 @@
 /* Special sequence number for bad block that failed to be marked bad */
 #define YAFFS_SEQUENCE_BAD_BLOCK	0xffff0000
 
-/* ChunkCache is used for short read/write operations.*/
+/* ChunkCache is used for short read/write operations.
+ * Valid entries are hashed on (object, chunk_id) and every entry sits on
+ * the device LRU list, most recently used first. Valid entries are also on
+ * their object's cache list, dirty ones first, and dirty entries are on the
+ * device dirty list, so flushing never has to walk the whole cache.
+ */
 struct yaffs_cache {
+	struct list_head hash_link;	/* Empty when the entry holds nothing */
+	struct list_head lru;
+	struct list_head obj_link;	/* entry in object->cache_list */
+	struct list_head dirty_link;	/* entry in dev->cache_dirty */
 	struct yaffs_obj *object;
 	int chunk_id;
-	int last_use;
 	int dirty;
 	int n_bytes;		/* Only valid if the cache is dirty */
 	int locked;		/* Can't push out or flush while locked. */
@@ -306,6 +314,16 @@ struct yaffs_block_info {
 
 };
 
+/* Result of querying a block's initial state during mount.
+ * The checkpoint search and the scan both query every block, so the
+ * answers are kept until the mount is over.
+ */
+struct yaffs_block_query {
+	u32 seq_number;
+	u8 state;		/* One of the block states. */
+	u8 valid;
+};
+
 /* -------------------------- Object structure -------------------------------*/
 /* This is the object structure as stored on NAND */
 
@@ -376,9 +394,12 @@ struct yaffs_file_var {
 	struct yaffs_tnode *top;
 };
 
+struct yaffs_dir_index;
+
 struct yaffs_dir_var {
 	struct list_head children;	/* list of child links */
 	struct list_head dirty;	/* Entry for list of dirty directories */
+	struct yaffs_dir_index *index;	/* name index, NULL if not built */
 };
 
 struct yaffs_symlink_var {
@@ -428,6 +449,8 @@ struct yaffs_obj {
 				 * or not. */
 	u8 has_xattr:1;		/* This object has xattribs.
 				 * Only valid if xattr_known. */
+	u8 name_hashed:1;	/* name_link is in a bucket of the parent's
+				 * name index, not on its pending list. */
 
 	u8 serial;		/* serial number of chunk in NAND.*/
 	u16 sum;		/* sum of the name to speed searching */
@@ -442,6 +465,10 @@ struct yaffs_obj {
 	/* also used for linking up the free list */
 	struct yaffs_obj *parent;
 	struct list_head siblings;
+	struct list_head name_link;	/* entry in parent's name index */
+	u32 name_hash;		/* hash of the full name, if name_hashed */
+
+	struct list_head cache_list;	/* short op cache entries, dirty first */
 
 	/* Where's my object header in NAND? */
 	int hdr_chunk;
@@ -476,6 +503,17 @@ struct yaffs_obj {
 
 };
 
+/* Hash index of a directory's children by full name, see yaffs_guts.c */
+struct yaffs_dir_index {
+	struct list_head link;		/* entry in dev->dir_indexes */
+	struct yaffs_obj *dir;
+	struct list_head pending;	/* children not hashed yet */
+	struct list_head *buckets;
+	u32 n_buckets;			/* always a power of 2 */
+	u32 n_hashed;
+	unsigned buckets_alt:1;		/* allocated using alternative alloc */
+};
+
 struct yaffs_obj_bucket {
 	struct list_head list;
 	int count;
@@ -514,6 +552,17 @@ struct yaffs_buffer {
 
 /*----------------- Device ---------------------------------*/
 
+/* How garbage collection picks a victim among the candidate blocks.
+ * GREEDY takes the block with the fewest live chunks.
+ * COST_BENEFIT only looks at the few dirtiest candidates and among those
+ * prefers blocks that are old relative to what they cost to copy. It is an
+ * age tie-break among the dirtiest blocks, not a search for old, mostly
+ * full blocks of static data; those are still only reached through the
+ * oldest dirty block handling.
+ */
+#define YAFFS_GC_POLICY_GREEDY		0
+#define YAFFS_GC_POLICY_COST_BENEFIT	1
+
 struct yaffs_param {
 	const YCHAR *name;
 
@@ -594,6 +643,15 @@ struct yaffs_param {
 	int disable_summary;
 	int disable_bad_block_marking;
 
+	/* Directory name index. A directory gets an index once a lookup
+	 * has to walk dir_index_threshold children (0 = never), as long as
+	 * the device total stays under dir_index_max_bytes.
+	 */
+	int dir_index_threshold;
+	u32 dir_index_max_bytes;
+
+	int gc_policy;		/* One of YAFFS_GC_POLICY_xxx */
+
 };
 
 struct yaffs_driver {
@@ -690,6 +748,10 @@ struct yaffs_dev {
 	u8 *chunk_bits;		/* bitmap of chunks in use */
 	unsigned block_info_alt:1;	/* allocated using alternative alloc */
 	unsigned chunk_bits_alt:1;	/* allocated using alternative alloc */
+
+	/* Block query results, only allocated while mounting */
+	struct yaffs_block_query *block_query;
+	unsigned block_query_alt:1;	/* allocated using alternative alloc */
 	int chunk_bit_stride;	/* Number of bytes of chunk_bits per block.
 				 * Must be consistent with chunks_per_block.
 				 */
@@ -727,6 +789,14 @@ struct yaffs_dev {
 	unsigned gc_skip;
 	struct yaffs_summary_tags *gc_sum_tags;
 
+	/* GC candidates: a min-heap of block numbers and, per block, its
+	 * position in the heap (-1 if not a candidate).
+	 */
+	int *gc_heap;
+	int *gc_heap_pos;
+	int gc_heap_size;
+	unsigned gc_heap_alt:1;	/* allocated using alternative alloc */
+
 	/* Special directories */
 	struct yaffs_obj *root_dir;
 	struct yaffs_obj *lost_n_found;
@@ -735,7 +805,13 @@ struct yaffs_dev {
 	int doing_buffered_block_rewrite;
 
 	struct yaffs_cache *cache;
-	int cache_last_use;
+	int cache_alt;		/* cache array was allocated with vmalloc */
+	struct list_head *cache_buckets;
+	u32 n_cache_buckets;	/* Power of 2 */
+	struct list_head cache_lru;
+	struct list_head cache_dirty;	/* dirty entries, oldest first */
+	struct yaffs_cache **cache_flush_list;
+	int n_dirty_caches;
 
 	/* Stuff for background deletion and unlinked files. */
 	struct yaffs_obj *unlinked_dir;	/* Directory where unlinked and deleted
@@ -768,6 +844,10 @@ struct yaffs_dev {
 	/* Dirty directory handling */
 	struct list_head dirty_dirs;	/* List of dirty directories */
 
+	/* Directory name indexes */
+	struct list_head dir_indexes;
+	u32 dir_index_bytes;
+
 	/* Summary */
 	int chunks_per_summary;
 	struct yaffs_summary_tags *sum_tags;
@@ -794,8 +874,21 @@ struct yaffs_dev {
 	u32 n_unmarked_deletions;
 	u32 refresh_count;
 	u32 cache_hits;
+	u32 cache_misses;
+	u32 cache_evictions;
 	u32 tags_used;
 	u32 summary_used;
+	u32 n_dir_indexes;
+	u32 dir_index_hits;
+
+	/* Time spent in each phase of the last mount, in ms */
+	u32 mount_checkpt_ms;
+	u32 mount_query_ms;	/* block state queries and sort */
+	u32 mount_scan_ms;	/* chunk scan and hard link fixup */
+	u32 mount_fixup_ms;	/* deleted/hanging objects, lost+found */
+	u32 mount_total_ms;
+	u32 mount_page_reads;
+	u32 mount_block_queries; /* block queries that went to flash */
 
 };
 
@@ -864,6 +957,8 @@ int yaffs_get_obj_link_count(struct yaffs_obj *obj);
 /* File operations */
 int yaffs_file_rd(struct yaffs_obj *obj, u8 * buffer, loff_t offset,
 		  int n_bytes);
+int yaffs_file_rd_shared(struct yaffs_obj *obj, u8 *buffer, loff_t offset,
+			 int n_bytes);
 int yaffs_wr_file(struct yaffs_obj *obj, const u8 * buffer, loff_t offset,
 		  int n_bytes, int write_trhrough);
 int yaffs_resize_file(struct yaffs_obj *obj, loff_t new_size);
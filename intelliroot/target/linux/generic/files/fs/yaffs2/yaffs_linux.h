@@ -24,7 +24,7 @@ struct yaffs_linux_context {
 	struct super_block *super;
 	struct task_struct *bg_thread;	/* Background thread for this device */
 	int bg_running;
-	struct mutex gross_lock;	/* Gross locking mutex*/
+	struct rw_semaphore gross_lock;	/* Gross lock, shared for page reads */
 	u8 *spare_buffer;	/* For mtdif2 use. Don't know the buffer size
 				 * at compile time so we have to allocate it.
 				 */
@@ -47,6 +47,22 @@ int yaffs_rd_chunk_tags_nand(struct yaffs_dev *dev, int nand_chunk,
 	return result;
 }
 
+/*
+ * As above, but leaves ECC events for the caller instead of marking the
+ * block. Used by readers that only hold the device lock shared and so may
+ * not change block state. The statistics update may race with other
+ * readers; they are only statistics.
+ */
+int yaffs_rd_chunk_tags_nand_shared(struct yaffs_dev *dev, int nand_chunk,
+				    u8 *buffer, struct yaffs_ext_tags *tags)
+{
+	int flash_chunk = apply_chunk_offset(dev, nand_chunk);
+
+	dev->n_page_reads++;
+
+	return dev->tagger.read_chunk_tags_fn(dev, flash_chunk, buffer, tags);
+}
+
 int yaffs_wr_chunk_tags_nand(struct yaffs_dev *dev,
 				int nand_chunk,
 				const u8 *buffer, struct yaffs_ext_tags *tags)
@@ -93,8 +109,28 @@ int yaffs_query_init_block_state(struct yaffs_dev *dev,
 				 enum yaffs_block_state *state,
 				 u32 *seq_number)
 {
-	block_no -= dev->block_offset;
-	return dev->tagger.query_block_fn(dev, block_no, state, seq_number);
+	struct yaffs_block_query *q = NULL;
+	int result;
+
+	/* While mounting, answer repeat queries from the saved results */
+	if (dev->block_query) {
+		q = &dev->block_query[block_no - dev->internal_start_block];
+		if (q->valid) {
+			*state = q->state;
+			*seq_number = q->seq_number;
+			return YAFFS_OK;
+		}
+	}
+
+	dev->mount_block_queries++;
+	result = dev->tagger.query_block_fn(dev, block_no - dev->block_offset,
+					    state, seq_number);
+	if (q) {
+		q->state = *state;
+		q->seq_number = *seq_number;
+		q->valid = 1;
+	}
+	return result;
 }
 
 int yaffs_erase_block(struct yaffs_dev *dev, int block_no)
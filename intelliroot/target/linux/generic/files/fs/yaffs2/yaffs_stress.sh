@@ -0,0 +1,151 @@
+#!/bin/sh
+#
+# Concurrent read/write stress test and benchmark for yaffs2 on nandsim
+#
+# Several readers repeatedly checksum files written before the test while
+# one writer keeps appending to a log. Every read is checked against the
+# checksum taken at creation, and page reads are forced to go to flash by
+# dropping the page cache before each pass. At the end the script prints
+# the number of file passes per reader and the bytes the writer appended.
+#
+# Run as root on a kernel with nandsim and yaffs2 (not on a board with a
+# real NAND that may also be driven by nandsim's IDs):
+#
+#   sh yaffs_stress.sh [-r <readers>] [-f <file KiB>] [-t <seconds>]
+#                      [-d] [-k]
+#
+#   -r  number of reader processes (default 4)
+#   -f  size of each reader's file in KiB (default 1024)
+#   -t  duration of the test in seconds (default 30)
+#   -d  emulate flash latency (nandsim access, program and erase delays)
+#   -k  keep nandsim loaded and the file system mounted afterwards
+#
+# To compare lock changes, run the same command on both kernels and
+# compare the "reads" totals. The exit status is non-zero if any read
+# returned wrong data or the writer failed.
+#
+# This is free software, licensed under the GNU General Public License v2.
+# See /LICENSE for more information.
+#
+
+usage() {
+	echo "Usage: $0 [-r <readers>] [-f <file KiB>] [-t <seconds>] [-d] [-k]" >&2
+	exit 1
+}
+
+READERS=4
+FILE_KB=1024
+DURATION=30
+DELAY=
+KEEP=
+
+while getopts "r:f:t:dk" opt; do
+	case "$opt" in
+		r) READERS="$OPTARG";;
+		f) FILE_KB="$OPTARG";;
+		t) DURATION="$OPTARG";;
+		d) DELAY=1;;
+		k) KEEP=1;;
+		*) usage;;
+	esac
+done
+
+MNT=/tmp/yaffs_stress
+RES=/tmp/yaffs_stress.res
+
+fail() {
+	echo "$*" >&2
+	exit 1
+}
+
+cleanup() {
+	[ -n "$KEEP" ] && return
+	umount "$MNT" 2>/dev/null
+	rmmod nandsim 2>/dev/null
+	rm -rf "$RES"
+}
+
+# 256 MiB, 2 KiB pages, 128 KiB eraseblocks
+NANDSIM_ARGS="first_id_byte=0x20 second_id_byte=0xaa third_id_byte=0x00 fourth_id_byte=0x15"
+[ -n "$DELAY" ] && NANDSIM_ARGS="$NANDSIM_ARGS access_delay=25 programm_delay=200 erase_delay=2"
+
+grep -q "^nandsim " /proc/modules && fail "nandsim is already loaded"
+BEFORE=$(grep -c "^mtd" /proc/mtd)
+modprobe nandsim $NANDSIM_ARGS || fail "cannot load nandsim"
+trap cleanup EXIT
+
+# nandsim registers one device, after all existing ones
+[ $(grep -c "^mtd" /proc/mtd) -gt $BEFORE ] ||
+	fail "nandsim did not register an mtd device"
+MTD=$(grep "^mtd" /proc/mtd | tail -n 1 | cut -d: -f1)
+
+mkdir -p "$MNT" "$RES"
+rm -f "$RES"/*
+mount -t yaffs2 "/dev/mtdblock${MTD#mtd}" "$MNT" || fail "cannot mount yaffs2 on $MTD"
+
+# Files for the readers, written and synced before the clock starts
+i=0
+while [ $i -lt $READERS ]; do
+	dd if=/dev/urandom of="$MNT/file$i" bs=1k count=$FILE_KB 2>/dev/null ||
+		fail "cannot create $MNT/file$i"
+	i=$((i + 1))
+done
+sync
+md5sum "$MNT"/file* > "$RES/sums"
+
+END=$(($(date +%s) + DURATION))
+
+reader() {
+	local n=0 bad=0 want got
+
+	want=$(grep "file$1\$" "$RES/sums" | cut -d' ' -f1)
+	while [ $(date +%s) -lt $END ]; do
+		echo 1 > /proc/sys/vm/drop_caches
+		got=$(md5sum "$MNT/file$1" | cut -d' ' -f1)
+		[ "$got" = "$want" ] || bad=$((bad + 1))
+		n=$((n + 1))
+	done
+	echo "$n $bad" > "$RES/reader$1"
+}
+
+writer() {
+	local n=0 ret=0
+
+	while [ $(date +%s) -lt $END ]; do
+		dd if=/dev/urandom bs=4k count=16 2>/dev/null >> "$MNT/log" || {
+			ret=1
+			break
+		}
+		n=$((n + 1))
+		[ $((n % 16)) -eq 0 ] && sync
+	done
+	echo "$((n * 64)) $ret" > "$RES/writer"
+}
+
+writer &
+i=0
+while [ $i -lt $READERS ]; do
+	reader $i &
+	i=$((i + 1))
+done
+wait
+
+status=0
+reads=0
+i=0
+while [ $i -lt $READERS ]; do
+	read n bad < "$RES/reader$i" || fail "reader $i did not finish"
+	echo "reader $i: $n passes over $FILE_KB KiB, $bad bad"
+	reads=$((reads + n))
+	[ $bad -eq 0 ] || status=1
+	i=$((i + 1))
+done
+
+read kb ret < "$RES/writer" || fail "writer did not finish"
+[ $ret -eq 0 ] || status=1
+
+echo "reads: $reads passes, $((reads * FILE_KB / DURATION)) KiB/s"
+echo "writer: $kb KiB appended, $((kb / DURATION)) KiB/s$([ $ret -eq 0 ] || echo ' (failed)')"
+[ $status -eq 0 ] && echo "ok" || echo "FAILED"
+
+exit $status
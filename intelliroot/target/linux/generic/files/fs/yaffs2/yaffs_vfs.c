@@ -189,6 +189,10 @@ unsigned int yaffs_auto_checkpoint = 1;
 unsigned int yaffs_gc_control = 1;
 unsigned int yaffs_bg_enable = 1;
 unsigned int yaffs_auto_select = 1;
+unsigned int yaffs_dir_index_threshold = 64;
+unsigned int yaffs_dir_index_max_kb = 256;
+unsigned int yaffs_n_caches = 10;
+unsigned int yaffs_gc_policy = YAFFS_GC_POLICY_GREEDY;
 /* Module Parameters */
 #if (LINUX_VERSION_CODE > KERNEL_VERSION(2, 5, 0))
 module_param(yaffs_trace_mask, uint, 0644);
@@ -196,11 +200,19 @@ module_param(yaffs_wr_attempts, uint, 0644);
 module_param(yaffs_auto_checkpoint, uint, 0644);
 module_param(yaffs_gc_control, uint, 0644);
 module_param(yaffs_bg_enable, uint, 0644);
+module_param(yaffs_dir_index_threshold, uint, 0644);
+module_param(yaffs_dir_index_max_kb, uint, 0644);
+module_param(yaffs_n_caches, uint, 0644);
+module_param(yaffs_gc_policy, uint, 0644);
 #else
 MODULE_PARM(yaffs_trace_mask, "i");
 MODULE_PARM(yaffs_wr_attempts, "i");
 MODULE_PARM(yaffs_auto_checkpoint, "i");
 MODULE_PARM(yaffs_gc_control, "i");
+MODULE_PARM(yaffs_dir_index_threshold, "i");
+MODULE_PARM(yaffs_dir_index_max_kb, "i");
+MODULE_PARM(yaffs_n_caches, "i");
+MODULE_PARM(yaffs_gc_policy, "i");
 #endif
 
 #if (LINUX_VERSION_CODE < KERNEL_VERSION(2, 6, 25))
@@ -248,14 +260,32 @@ static void yaffs_fill_inode_from_obj(struct inode *inode,
 static void yaffs_gross_lock(struct yaffs_dev *dev)
 {
 	yaffs_trace(YAFFS_TRACE_LOCK, "yaffs locking %p", current);
-	mutex_lock(&(yaffs_dev_to_lc(dev)->gross_lock));
+	down_write(&(yaffs_dev_to_lc(dev)->gross_lock));
 	yaffs_trace(YAFFS_TRACE_LOCK, "yaffs locked %p", current);
 }
 
 static void yaffs_gross_unlock(struct yaffs_dev *dev)
 {
 	yaffs_trace(YAFFS_TRACE_LOCK, "yaffs unlocking %p", current);
-	mutex_unlock(&(yaffs_dev_to_lc(dev)->gross_lock));
+	up_write(&(yaffs_dev_to_lc(dev)->gross_lock));
+}
+
+/*
+ * Shared holders may only call yaffs_file_rd_shared(); everything that
+ * allocates, collects garbage or changes metadata or the short-op cache
+ * takes the lock exclusively.
+ */
+static void yaffs_gross_lock_shared(struct yaffs_dev *dev)
+{
+	yaffs_trace(YAFFS_TRACE_LOCK, "yaffs locking shared %p", current);
+	down_read(&(yaffs_dev_to_lc(dev)->gross_lock));
+	yaffs_trace(YAFFS_TRACE_LOCK, "yaffs locked shared %p", current);
+}
+
+static void yaffs_gross_unlock_shared(struct yaffs_dev *dev)
+{
+	yaffs_trace(YAFFS_TRACE_LOCK, "yaffs unlocking shared %p", current);
+	up_read(&(yaffs_dev_to_lc(dev)->gross_lock));
 }
 
 
@@ -288,11 +318,26 @@ static int yaffs_readpage_nolock(struct file *f, struct page *pg)
 	pg_buf = kmap(pg);
 	/* FIXME: Can kmap fail? */
 
-	yaffs_gross_lock(dev);
+	/* Committed and cached data can be read alongside other readers;
+	 * whatever that path leaves (cache misses on partial chunks, ECC
+	 * events) is finished under the exclusive lock.
+	 */
+	yaffs_gross_lock_shared(dev);
 
-	ret = yaffs_file_rd(obj, pg_buf, pos, PAGE_CACHE_SIZE);
+	ret = yaffs_file_rd_shared(obj, pg_buf, pos, PAGE_CACHE_SIZE);
 
-	yaffs_gross_unlock(dev);
+	yaffs_gross_unlock_shared(dev);
+
+	if (ret < PAGE_CACHE_SIZE) {
+		int n_done = ret;
+
+		yaffs_gross_lock(dev);
+
+		ret = yaffs_file_rd(obj, pg_buf + n_done, pos + n_done,
+				    PAGE_CACHE_SIZE - n_done);
+
+		yaffs_gross_unlock(dev);
+	}
 
 	if (ret >= 0)
 		ret = 0;
@@ -2753,7 +2798,7 @@ static struct super_block *yaffs_internal_read_super(int yaffs_version,
 
 
 	param->n_reserved_blocks = 5;
-	param->n_caches = (options.no_cache) ? 0 : 10;
+	param->n_caches = (options.no_cache) ? 0 : yaffs_n_caches;
 	param->inband_tags = inband_tags;
 
 	param->enable_xattr = 1;
@@ -2769,6 +2814,10 @@ static struct super_block *yaffs_internal_read_super(int yaffs_version,
 	param->refresh_period = 500;
 	param->disable_summary = options.disable_summary;
 
+	param->dir_index_threshold = yaffs_dir_index_threshold;
+	param->dir_index_max_bytes = yaffs_dir_index_max_kb * 1024;
+	param->gc_policy = yaffs_gc_policy;
+
 
 #ifdef CONFIG_YAFFS_DISABLE_BAD_BLOCK_MARKING
 	param->disable_bad_block_marking  = 1;
@@ -2837,7 +2886,7 @@ static struct super_block *yaffs_internal_read_super(int yaffs_version,
 	INIT_LIST_HEAD(&(yaffs_dev_to_lc(dev)->search_contexts));
 	param->remove_obj_fn = yaffs_remove_obj_callback;
 
-	mutex_init(&(yaffs_dev_to_lc(dev)->gross_lock));
+	init_rwsem(&(yaffs_dev_to_lc(dev)->gross_lock));
 
 	yaffs_gross_lock(dev);
 
@@ -3026,6 +3075,11 @@ static char *yaffs_dump_dev_part0(char *buf, struct yaffs_dev *dev)
 	buf += sprintf(buf, "n_caches............. %d\n", param->n_caches);
 	buf += sprintf(buf, "n_reserved_blocks.... %d\n",
 				param->n_reserved_blocks);
+	buf += sprintf(buf, "dir_index_threshold.. %d\n",
+			param->dir_index_threshold);
+	buf += sprintf(buf, "dir_index_max_bytes.. %u\n",
+			param->dir_index_max_bytes);
+	buf += sprintf(buf, "gc_policy............ %d\n", param->gc_policy);
 	buf += sprintf(buf, "always_check_erased.. %d\n",
 				param->always_check_erased);
 	buf += sprintf(buf, "\n");
@@ -3076,6 +3130,8 @@ static char *yaffs_dump_dev_part1(char *buf, struct yaffs_dev *dev)
 	buf += sprintf(buf, "n_tags_ecc_unfixed... %u\n",
 				dev->n_tags_ecc_unfixed);
 	buf += sprintf(buf, "cache_hits........... %u\n", dev->cache_hits);
+	buf += sprintf(buf, "cache_misses......... %u\n", dev->cache_misses);
+	buf += sprintf(buf, "cache_evictions...... %u\n", dev->cache_evictions);
 	buf += sprintf(buf, "n_deleted_files...... %u\n", dev->n_deleted_files);
 	buf += sprintf(buf, "n_unlinked_files..... %u\n",
 				dev->n_unlinked_files);
@@ -3083,6 +3139,18 @@ static char *yaffs_dump_dev_part1(char *buf, struct yaffs_dev *dev)
 	buf += sprintf(buf, "n_bg_deletions....... %u\n", dev->n_bg_deletions);
 	buf += sprintf(buf, "tags_used............ %u\n", dev->tags_used);
 	buf += sprintf(buf, "summary_used......... %u\n", dev->summary_used);
+	buf += sprintf(buf, "n_dir_indexes........ %u\n", dev->n_dir_indexes);
+	buf += sprintf(buf, "dir_index_bytes...... %u\n", dev->dir_index_bytes);
+	buf += sprintf(buf, "dir_index_hits....... %u\n", dev->dir_index_hits);
+	buf += sprintf(buf, "gc_candidates........ %d\n", dev->gc_heap_size);
+	buf += sprintf(buf, "mount_total_ms....... %u\n", dev->mount_total_ms);
+	buf += sprintf(buf, "mount_checkpt_ms..... %u\n", dev->mount_checkpt_ms);
+	buf += sprintf(buf, "mount_query_ms....... %u\n", dev->mount_query_ms);
+	buf += sprintf(buf, "mount_scan_ms........ %u\n", dev->mount_scan_ms);
+	buf += sprintf(buf, "mount_fixup_ms....... %u\n", dev->mount_fixup_ms);
+	buf += sprintf(buf, "mount_page_reads..... %u\n", dev->mount_page_reads);
+	buf += sprintf(buf, "mount_block_queries.. %u\n",
+			dev->mount_block_queries);
 
 	return buf;
 }
@@ -1360,6 +1360,7 @@ int yaffs2_scan_backwards(struct yaffs_dev *dev)
 	struct yaffs_block_index *block_index = NULL;
 	int alt_block_index = 0;
 	int summary_available;
+	u32 t_start = Y_CURRENT_MSECS;
 
 	yaffs_trace(YAFFS_TRACE_SCAN,
 		"yaffs2_scan_backwards starts  intstartblk %d intendblk %d...",
@@ -1451,6 +1452,9 @@ int yaffs2_scan_backwards(struct yaffs_dev *dev)
 
 	yaffs_trace(YAFFS_TRACE_SCAN, "...done");
 
+	dev->mount_query_ms = Y_CURRENT_MSECS - t_start;
+	t_start = Y_CURRENT_MSECS;
+
 	/* Now scan the blocks looking at the data. */
 	start_iter = 0;
 	end_iter = n_to_scan - 1;
@@ -1523,6 +1527,8 @@ int yaffs2_scan_backwards(struct yaffs_dev *dev)
 
 	yaffs_release_temp_buffer(dev, chunk_data);
 
+	dev->mount_scan_ms = Y_CURRENT_MSECS - t_start;
+
 	if (alloc_failed)
 		return YAFFS_FAIL;
 
@@ -69,6 +69,12 @@
 #define Y_TIME_CONVERT(x) (x)
 #endif
 
+#if (LINUX_VERSION_CODE > KERNEL_VERSION(2, 6, 0))
+#define Y_CURRENT_MSECS jiffies_to_msecs(jiffies)
+#else
+#define Y_CURRENT_MSECS (jiffies * (1000 / HZ))
+#endif
+
 #define compile_time_assertion(assertion) \
 	({ int x = __builtin_choose_expr(assertion, 0, (void)0); (void) x; })
 
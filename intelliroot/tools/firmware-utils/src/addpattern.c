@@ -64,6 +64,9 @@
 
 /**********************************************************************/
 
+#define BUF_SIZE	(1024 * 1024)
+#define GARBAGE_ALIGN	1024	/* -g pads the image to a multiple of this */
+
 #define CODE_ID		"U2ND"		/* from code_pattern.h */
 #define CODE_PATTERN   "W54S"	/* from code_pattern.h */
 #define PBOT_PATTERN   "PBOT"
@@ -147,7 +150,7 @@ struct board_info *find_board(char *id)
 
 int main(int argc, char **argv)
 {
-	char buf[1024];	/* keep this at 1k or adjust garbage calc below */
+	char *buf;
 	struct code_header *hdr;
 	FILE *in = stdin;
 	FILE *out = stdout;
@@ -168,6 +171,12 @@ int main(int argc, char **argv)
 
 	fprintf(stderr, "mjn3's addpattern replacement - v0.81\n");
 
+	buf = malloc(BUF_SIZE);
+	if (!buf) {
+		fprintf(stderr, "out of memory\n");
+		return EXIT_FAILURE;
+	}
+
 	hdr = (struct code_header *) buf;
 	memset(hdr, 0, sizeof(struct code_header));
 
@@ -296,19 +305,19 @@ int main(int argc, char **argv)
 			hdr->fwdate[0], hdr->fwdate[1], hdr->fwdate[2]);
 
 
-	while ((n = fread(buf + off, 1, sizeof(buf)-off, in) + off) > 0) {
+	while ((n = fread(buf + off, 1, BUF_SIZE - off, in) + off) > 0) {
 		off = 0;
-		if (n < sizeof(buf)) {
+		if (n < BUF_SIZE) {
 			if (ferror(in)) {
 			FREAD_ERROR:
 				fprintf(stderr, "fread error\n");
 				return EXIT_FAILURE;
 			}
-			if (gflag) {
-				gflag = sizeof(buf) - n;
+			if (gflag && (n % GARBAGE_ALIGN)) {
+				gflag = GARBAGE_ALIGN - (n % GARBAGE_ALIGN);
 				memset(buf + n, 0xff, gflag);
 				fprintf(stderr, "adding %d bytes of garbage\n", gflag);
-				n = sizeof(buf);
+				n += gflag;
 			}
 		}
 		if (!fwrite(buf, n, 1, out)) {
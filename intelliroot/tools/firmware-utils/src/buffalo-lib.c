@@ -11,6 +11,7 @@
 #include <stdlib.h>
 #include <string.h>
 #include <errno.h>
+#include <limits.h>
 #include <unistd.h>
 #include <sys/stat.h>
 
@@ -104,13 +105,18 @@ int bcrypt_init(struct bcrypt_ctx *ctx, void *key, int keylen,
 	for (i = 0; i < state_len; i++)
 		state[i] = i;
 
-	for(i = 0, j = 0; i < state_len; i++, j = (j + 1) % keylen) {
+	for(i = 0, j = 0; i < state_len; i++) {
 		unsigned char t;
 
 		t = state[i];
-		k = (k + p[j] + t) % state_len;
+		k += p[j] + t;
+		while (k >= state_len)
+			k -= state_len;
 		state[i] = state[k];
 		state[k] = t;
+
+		if (++j == keylen)
+			j = 0;
 	}
 
 	return 0;
@@ -127,6 +133,28 @@ int bcrypt_process(struct bcrypt_ctx *ctx, unsigned char *src,
 	i = ctx->i;
 	j = ctx->j;
 
+	/*
+	 * i and j are bytes, so for power of two state lengths up to 256
+	 * (which includes the default) the modulo is a plain mask.
+	 */
+	if (state_len <= 256 && !(state_len & (state_len - 1))) {
+		unsigned char mask = state_len - 1;
+
+		for (k = 0; k < len; k++) {
+			unsigned char t;
+
+			i = (i + 1) & mask;
+			j = (j + state[i]) & mask;
+			t = state[j];
+			state[j] = state[i];
+			state[i] = t;
+
+			dst[k] = src[k] ^ state[(state[i] + state[j]) & mask];
+		}
+
+		goto out;
+	}
+
 	for (k = 0; k < len; k++) {
 		unsigned char t;
 
@@ -139,6 +167,7 @@ int bcrypt_process(struct bcrypt_ctx *ctx, unsigned char *src,
 		dst[k] = src[k] ^ state[(state[i] + state[j]) % state_len];
 	}
 
+out:
 	ctx->i = i;
 	ctx->j = j;
 
@@ -177,16 +206,70 @@ int bcrypt_buf(unsigned char seed, unsigned char *key, unsigned char *src,
 	return 0;
 }
 
+static uint32_t csum_table[4][256];
+static uint32_t csum_sign_fix[16];
+
+static uint32_t csum_byte(uint32_t csum)
+{
+	return (csum >> 8) ^ csum_table[0][csum & 0xff];
+}
+
+static void buffalo_csum_init(void)
+{
+	uint32_t c;
+	int i, j;
+
+	for (i = 0; i < 256; i++) {
+		c = i;
+		for (j = 0; j < 8; j++)
+			c = (c >> 1) ^ ((c & 1) ? 0xedb88320ul : 0);
+		csum_table[0][i] = c;
+	}
+
+	for (i = 0; i < 256; i++)
+		for (j = 1; j < 4; j++)
+			csum_table[j][i] = csum_byte(csum_table[j - 1][i]);
+
+	/*
+	 * The checksum xors in plain chars, on hosts where char is signed a
+	 * byte >= 0x80 also flips the upper 24 bits. Precompute what that
+	 * adds to the result for each combination of such bytes in a word.
+	 */
+	c = 0x00ffffff;
+	for (j = 3; j >= 0; j--) {
+		for (i = 0; i < 16; i++)
+			if (i & (1 << j))
+				csum_sign_fix[i] ^= c;
+		c = csum_byte(c);
+	}
+}
+
 uint32_t buffalo_csum(uint32_t csum, void *buf, unsigned long len)
 {
-	char *p = buf;
+	unsigned char *p = buf;
+	uint32_t w;
+
+	if (!csum_table[0][1])
+		buffalo_csum_init();
+
+	for (; len >= 4; len -= 4, p += 4) {
+		w = p[0] | (p[1] << 8) | (p[2] << 16) | ((uint32_t) p[3] << 24);
+		csum ^= w;
+		csum = csum_table[3][csum & 0xff] ^
+		       csum_table[2][(csum >> 8) & 0xff] ^
+		       csum_table[1][(csum >> 16) & 0xff] ^
+		       csum_table[0][csum >> 24];
+
+		if (CHAR_MIN < 0)
+			csum ^= csum_sign_fix[((w >> 7) & 1) | ((w >> 14) & 2) |
+					      ((w >> 21) & 4) | ((w >> 28) & 8)];
+	}
 
 	while (len--) {
-		int i;
-
-		csum ^= *p++;
-		for (i = 0; i < 8; i++)
-			csum = (csum >> 1) ^ ((csum & 1) ? 0xedb88320ul : 0);
+		csum = csum_byte(csum ^ *p);
+		if (CHAR_MIN < 0 && (*p & 0x80))
+			csum ^= 0x00ffffff;
+		p++;
 	}
 
 	return csum;
@@ -0,0 +1,29 @@
+#ifndef CRC32_H
+#define CRC32_H
+
+#include <stdint.h>
+#include <stddef.h>
+
+extern const uint32_t crc32_table[256];
+
+extern uint32_t crc32_update(uint32_t val, const void *ss, int len);
+
+/* Return a 32-bit CRC of the contents of the buffer. */
+
+static inline uint32_t
+crc32(uint32_t val, const void *ss, int len)
+{
+	return crc32_update(val, ss, len);
+}
+
+/* Advance a CRC over len zero bytes without touching the data. */
+extern uint32_t crc32_zeros(uint32_t val, size_t len);
+
+static inline unsigned int crc32buf(char *buf, size_t len)
+{
+	return crc32(0xFFFFFFFF, buf, len);
+}
+
+
+
+#endif
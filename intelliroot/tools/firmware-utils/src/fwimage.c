@@ -0,0 +1,234 @@
+/*
+ * Shared helpers for firmware image tools
+ *
+ * This program is free software; you can redistribute it and/or modify it
+ * under the terms of the GNU General Public License version 2 as published
+ * by the Free Software Foundation.
+ *
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+#include "fwimage.h"
+
+#define ALIGN(x,a) ({ typeof(a) __a = (a); (((x) + __a - 1) & ~(__a - 1)); })
+
+#define FILL_BUF_SIZE	(16 * 1024)
+#define WRITE_BUF_SIZE	(256 * 1024)
+
+const uint8_t tplink_md5salt_normal[MD5SUM_LEN] = {
+	0xdc, 0xd7, 0x3a, 0xa5, 0xc3, 0x95, 0x98, 0xfb,
+	0xdd, 0xf9, 0xe7, 0xf4, 0x0e, 0xae, 0x47, 0x38,
+};
+
+const uint8_t tplink_md5salt_boot[MD5SUM_LEN] = {
+	0x8c, 0xef, 0x33, 0x5b, 0xd5, 0xc5, 0xce, 0xfa,
+	0xa7, 0x9c, 0x28, 0xda, 0xb2, 0xe9, 0x0f, 0x42,
+};
+
+static const uint8_t jffs2_eof_mark[4] = {0xde, 0xad, 0xc0, 0xde};
+
+static struct fw_blob *blobs;
+static pthread_mutex_t blob_lock = PTHREAD_MUTEX_INITIALIZER;
+
+static struct fw_blob *blob_map(const char *name)
+{
+	struct fw_blob *b;
+	struct stat st;
+	int fd;
+
+	fd = open(name, O_RDONLY);
+	if (fd < 0) {
+		fprintf(stderr, "could not open \"%s\" for reading: %s\n",
+			name, strerror(errno));
+		return NULL;
+	}
+
+	if (fstat(fd, &st)) {
+		fprintf(stderr, "stat failed on %s: %s\n", name, strerror(errno));
+		goto err_close;
+	}
+
+	b = calloc(1, sizeof(*b));
+	if (!b)
+		goto err_close;
+
+	b->name = strdup(name);
+	b->len = st.st_size;
+	if (b->len) {
+		b->data = mmap(NULL, b->len, PROT_READ, MAP_PRIVATE, fd, 0);
+		if (b->data == MAP_FAILED) {
+			fprintf(stderr, "unable to map \"%s\": %s\n",
+				name, strerror(errno));
+			free(b->name);
+			free(b);
+			goto err_close;
+		}
+	}
+
+	close(fd);
+	return b;
+
+err_close:
+	close(fd);
+	return NULL;
+}
+
+struct fw_blob *fw_blob_get(const char *name)
+{
+	struct fw_blob *b;
+
+	pthread_mutex_lock(&blob_lock);
+
+	for (b = blobs; b; b = b->next)
+		if (!strcmp(b->name, name))
+			goto out;
+
+	b = blob_map(name);
+	if (b) {
+		b->next = blobs;
+		blobs = b;
+	}
+
+out:
+	pthread_mutex_unlock(&blob_lock);
+	return b;
+}
+
+void fw_blob_release_all(void)
+{
+	struct fw_blob *b;
+
+	pthread_mutex_lock(&blob_lock);
+
+	while ((b = blobs) != NULL) {
+		blobs = b->next;
+		if (b->len)
+			munmap((void *) b->data, b->len);
+		free(b->name);
+		free(b);
+	}
+
+	pthread_mutex_unlock(&blob_lock);
+}
+
+int fw_writer_open(struct fw_writer *w, const char *name)
+{
+	w->f = fopen(name, "w");
+	if (!w->f) {
+		fprintf(stderr, "could not open \"%s\" for writing: %s\n",
+			name, strerror(errno));
+		return -1;
+	}
+
+	setvbuf(w->f, NULL, _IOFBF, WRITE_BUF_SIZE);
+	w->name = name;
+	w->ofs = 0;
+	MD5_Init(&w->md5);
+	return 0;
+}
+
+int fw_write(struct fw_writer *w, const void *data, uint32_t len)
+{
+	if (!len)
+		return 0;
+
+	MD5_Update(&w->md5, data, len);
+
+	if (fwrite(data, len, 1, w->f) != 1) {
+		fprintf(stderr, "unable to write \"%s\": %s\n",
+			w->name, strerror(errno));
+		return -1;
+	}
+
+	w->ofs += len;
+	return 0;
+}
+
+/* fill the image with val up to offset to */
+int fw_fill(struct fw_writer *w, uint32_t to, uint8_t val)
+{
+	uint8_t buf[FILL_BUF_SIZE];
+	uint32_t len;
+
+	memset(buf, val, sizeof(buf));
+	while (w->ofs < to) {
+		len = to - w->ofs;
+		if (len > sizeof(buf))
+			len = sizeof(buf);
+
+		if (fw_write(w, buf, len))
+			return -1;
+	}
+
+	return 0;
+}
+
+/* overwrite already written data, e.g. a checksum in the header */
+int fw_patch(struct fw_writer *w, uint32_t ofs, const void *data, uint32_t len)
+{
+	if (fseek(w->f, ofs, SEEK_SET) || fwrite(data, len, 1, w->f) != 1 ||
+	    fseek(w->f, 0, SEEK_END)) {
+		fprintf(stderr, "unable to write \"%s\": %s\n",
+			w->name, strerror(errno));
+		return -1;
+	}
+
+	return 0;
+}
+
+/* pad to the next 64 KiB boundary and add a jffs2 end-of-filesystem mark */
+int fw_pad_jffs2(struct fw_writer *w, uint32_t max_len)
+{
+	uint32_t len = w->ofs;
+	uint32_t pad_mask = 64 * 1024;
+
+	while ((len < max_len) && (pad_mask != 0)) {
+		uint32_t mask;
+		int i;
+
+		for (i = 10; i < 32; i++) {
+			mask = 1 << i;
+			if (pad_mask & mask)
+				break;
+		}
+
+		len = ALIGN(len, mask);
+		/* never let the mark run past the end of the image */
+		if (len + sizeof(jffs2_eof_mark) > max_len)
+			break;
+
+		for (i = 10; i < 32; i++) {
+			mask = 1 << i;
+			if ((len & (mask - 1)) == 0)
+				pad_mask &= ~mask;
+		}
+
+		if (fw_fill(w, len, 0xff) ||
+		    fw_write(w, jffs2_eof_mark, sizeof(jffs2_eof_mark)))
+			return -1;
+
+		len += sizeof(jffs2_eof_mark);
+	}
+
+	return 0;
+}
+
+int fw_writer_close(struct fw_writer *w, int failed)
+{
+	if (fclose(w->f))
+		failed = 1;
+
+	if (failed)
+		unlink(w->name);
+
+	return failed ? -1 : 0;
+}
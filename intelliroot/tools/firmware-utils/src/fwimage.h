@@ -0,0 +1,84 @@
+/*
+ * Shared helpers for firmware image tools
+ *
+ * This program is free software; you can redistribute it and/or modify it
+ * under the terms of the GNU General Public License version 2 as published
+ * by the Free Software Foundation.
+ *
+ */
+
+#ifndef _FWIMAGE_H
+#define _FWIMAGE_H
+
+#include <stdio.h>
+#include <stdint.h>
+#include <stddef.h>
+
+#include "md5.h"
+
+#define MD5SUM_LEN		16
+
+#define TPLINK_HEADER_V1	0x01000000
+
+/* TP-LINK v1 firmware header, as written by mktplinkfw and mkfwfactory */
+struct tplink_header {
+	uint32_t	version;	/* header version */
+	char		vendor_name[24];
+	char		fw_version[36];
+	uint32_t	hw_id;		/* hardware id */
+	uint32_t	hw_rev;		/* hardware revision */
+	uint32_t	unk1;
+	uint8_t		md5sum1[MD5SUM_LEN];
+	uint32_t	unk2;
+	uint8_t		md5sum2[MD5SUM_LEN];
+	uint32_t	unk3;
+	uint32_t	kernel_la;	/* kernel load address */
+	uint32_t	kernel_ep;	/* kernel entry point */
+	uint32_t	fw_length;	/* total length of the firmware */
+	uint32_t	kernel_ofs;	/* kernel data offset */
+	uint32_t	kernel_len;	/* kernel data length */
+	uint32_t	rootfs_ofs;	/* rootfs data offset */
+	uint32_t	rootfs_len;	/* rootfs data length */
+	uint32_t	boot_ofs;	/* bootloader data offset */
+	uint32_t	boot_len;	/* bootloader data length */
+	uint16_t	ver_hi;
+	uint16_t	ver_mid;
+	uint16_t	ver_lo;
+	uint8_t		pad[354];
+} __attribute__ ((packed));
+
+/* md5sum1 holds one of these while the image checksum is computed */
+extern const uint8_t tplink_md5salt_normal[MD5SUM_LEN];
+extern const uint8_t tplink_md5salt_boot[MD5SUM_LEN];
+
+/*
+ * An input file mapped into memory. Blobs are looked up by file name and
+ * mapped only once, so every image built from the same kernel or rootfs
+ * shares a single read of it. Lookups are safe from several threads.
+ */
+struct fw_blob {
+	char		*name;
+	const uint8_t	*data;
+	size_t		len;
+	struct fw_blob	*next;
+};
+
+struct fw_blob *fw_blob_get(const char *name);
+void fw_blob_release_all(void);
+
+/* Sequential image writer, everything written is fed to an MD5 context */
+struct fw_writer {
+	FILE		*f;
+	const char	*name;
+	uint32_t	ofs;
+	MD5_CTX		md5;
+};
+
+int fw_writer_open(struct fw_writer *w, const char *name);
+int fw_write(struct fw_writer *w, const void *data, uint32_t len);
+int fw_fill(struct fw_writer *w, uint32_t to, uint8_t val);
+int fw_patch(struct fw_writer *w, uint32_t ofs, const void *data, uint32_t len);
+int fw_pad_jffs2(struct fw_writer *w, uint32_t max_len);
+int fw_writer_close(struct fw_writer *w, int failed);
+
+#endif /* _FWIMAGE_H */
@@ -0,0 +1,384 @@
+/*
+ * mkfwfactory - build many firmware images from one manifest
+ *
+ * Every line of the manifest describes one image. Input files are mapped
+ * once and shared by all images using them, and the images are written
+ * concurrently by a pool of worker threads.
+ *
+ * Manifest format, one image per line ('#' starts a comment):
+ *
+ *   tplink <output> kernel=<file> [rootfs=<file>] hw_id=<id> fw_max_len=<len>
+ *          kernel_la=<addr> kernel_ep=<addr> [rootfs_ofs=<ofs>]
+ *          [hw_rev=<rev>] [rootfs_align=<align>] [vendor=<str>]
+ *          [version=<str>] [fw_ver=<a.b.c>] [combined] [jffs2_eof] [strip]
+ *
+ * Unless the image is combined, rootfs_ofs or rootfs_align must be given.
+ * The tplink format produces the same images as mktplinkfw with a v1 header.
+ *
+ * This program is free software; you can redistribute it and/or modify it
+ * under the terms of the GNU General Public License version 2 as published
+ * by the Free Software Foundation.
+ *
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <unistd.h>
+#include <libgen.h>
+#include <errno.h>
+#include <pthread.h>
+#include <arpa/inet.h>
+
+#include "fwimage.h"
+
+#define ALIGN(x,a) ({ typeof(a) __a = (a); (((x) + __a - 1) & ~(__a - 1)); })
+
+#define MAX_ARGS		32
+#define LINE_LEN		4096
+
+#define ERR(fmt, ...) do { \
+	fflush(0); \
+	fprintf(stderr, "[%s] *** error: " fmt "\n", \
+			progname, ## __VA_ARGS__ ); \
+} while (0)
+
+struct fw_job {
+	int		line;
+	char		*output;
+	int		(*build)(struct fw_job *job);
+	int		argc;
+	char		*argv[MAX_ARGS];
+};
+
+static char *progname;
+static struct fw_job *jobs;
+static int n_jobs;
+static int next_job;
+static int failed;
+static pthread_mutex_t job_lock = PTHREAD_MUTEX_INITIALIZER;
+
+static char *job_arg(struct fw_job *job, const char *key)
+{
+	size_t len = strlen(key);
+	int i;
+
+	for (i = 0; i < job->argc; i++) {
+		if (strncmp(job->argv[i], key, len))
+			continue;
+		if (job->argv[i][len] == '=')
+			return &job->argv[i][len + 1];
+		if (job->argv[i][len] == '\0')
+			return job->argv[i];
+	}
+
+	return NULL;
+}
+
+static uint32_t job_num(struct fw_job *job, const char *key, uint32_t def)
+{
+	char *val = job_arg(job, key);
+
+	return val ? strtoul(val, NULL, 0) : def;
+}
+
+static int build_tplink(struct fw_job *job)
+{
+	struct tplink_header hdr;
+	struct fw_blob *kernel, *rootfs = NULL;
+	struct fw_writer w;
+	uint8_t md5sum[MD5SUM_LEN];
+	uint32_t fw_max_len, kernel_len, rootfs_ofs, rootfs_align;
+	int combined = !!job_arg(job, "combined");
+	int ver_hi = 0, ver_mid = 0, ver_lo = 0;
+	char *val;
+	int err;
+
+	fw_max_len = job_num(job, "fw_max_len", 0);
+	rootfs_ofs = job_num(job, "rootfs_ofs", 0);
+	rootfs_align = job_num(job, "rootfs_align", 0);
+
+	if (!fw_max_len || !job_arg(job, "hw_id")) {
+		ERR("line %d: hw_id and fw_max_len are required", job->line);
+		return -1;
+	}
+
+	val = job_arg(job, "fw_ver");
+	if (val && sscanf(val, "%d.%d.%d", &ver_hi, &ver_mid, &ver_lo) != 3) {
+		ERR("line %d: invalid firmware version '%s'", job->line, val);
+		return -1;
+	}
+
+	val = job_arg(job, "kernel");
+	if (!val) {
+		ERR("line %d: no kernel image specified", job->line);
+		return -1;
+	}
+	kernel = fw_blob_get(val);
+	if (!kernel)
+		return -1;
+
+	kernel_len = kernel->len;
+	if (combined) {
+		if (kernel->len > fw_max_len - sizeof(hdr)) {
+			ERR("line %d: kernel image is too big", job->line);
+			return -1;
+		}
+	} else {
+		val = job_arg(job, "rootfs");
+		if (!val) {
+			ERR("line %d: no rootfs image specified", job->line);
+			return -1;
+		}
+		rootfs = fw_blob_get(val);
+		if (!rootfs)
+			return -1;
+
+		if (rootfs_align) {
+			kernel_len = ALIGN(kernel_len + sizeof(hdr), rootfs_align) -
+				     sizeof(hdr);
+			if (kernel_len + rootfs->len > fw_max_len - sizeof(hdr)) {
+				ERR("line %d: images are too big", job->line);
+				return -1;
+			}
+		} else if (!job_arg(job, "rootfs_ofs")) {
+			ERR("line %d: rootfs_ofs or rootfs_align is required",
+			    job->line);
+			return -1;
+		} else if (rootfs_ofs <= sizeof(hdr) || rootfs_ofs > fw_max_len) {
+			ERR("line %d: invalid rootfs_ofs 0x%x", job->line,
+			    rootfs_ofs);
+			return -1;
+		} else if (kernel->len > rootfs_ofs - sizeof(hdr) ||
+			   rootfs->len > fw_max_len - rootfs_ofs) {
+			ERR("line %d: images are too big", job->line);
+			return -1;
+		}
+	}
+
+	memset(&hdr, 0, sizeof(hdr));
+	hdr.version = htonl(TPLINK_HEADER_V1);
+	strncpy(hdr.vendor_name, job_arg(job, "vendor") ? : "TP-LINK Technologies",
+		sizeof(hdr.vendor_name));
+	strncpy(hdr.fw_version, job_arg(job, "version") ? : "ver. 1.0",
+		sizeof(hdr.fw_version));
+	hdr.hw_id = htonl(job_num(job, "hw_id", 0));
+	hdr.hw_rev = htonl(job_num(job, "hw_rev", 1));
+	memcpy(hdr.md5sum1, tplink_md5salt_normal, sizeof(hdr.md5sum1));
+	hdr.kernel_la = htonl(job_num(job, "kernel_la", 0));
+	hdr.kernel_ep = htonl(job_num(job, "kernel_ep", 0));
+	hdr.fw_length = htonl(fw_max_len);
+	hdr.kernel_ofs = htonl(sizeof(hdr));
+	hdr.kernel_len = htonl(kernel_len);
+	if (!combined) {
+		hdr.rootfs_ofs = htonl(rootfs_ofs);
+		hdr.rootfs_len = htonl(rootfs->len);
+	}
+	hdr.ver_hi = htons(ver_hi);
+	hdr.ver_mid = htons(ver_mid);
+	hdr.ver_lo = htons(ver_lo);
+
+	if (fw_writer_open(&w, job->output))
+		return -1;
+
+	err = fw_write(&w, &hdr, sizeof(hdr)) ||
+	      fw_write(&w, kernel->data, kernel->len);
+
+	if (!err && !combined) {
+		err = fw_fill(&w, rootfs_align ? sizeof(hdr) + kernel_len : rootfs_ofs,
+			      0xff) ||
+		      fw_write(&w, rootfs->data, rootfs->len);
+
+		if (!err && job_arg(job, "jffs2_eof"))
+			err = fw_pad_jffs2(&w, fw_max_len);
+	}
+
+	/* the header claims fw_max_len, never write past it */
+	if (!err && w.ofs > fw_max_len) {
+		ERR("line %d: image exceeds fw_max_len", job->line);
+		err = -1;
+	}
+
+	if (!err && !job_arg(job, "strip"))
+		err = fw_fill(&w, fw_max_len, 0xff);
+
+	if (!err) {
+		MD5_Final(md5sum, &w.md5);
+		err = fw_patch(&w, offsetof(struct tplink_header, md5sum1),
+			       md5sum, sizeof(md5sum));
+	}
+
+	return fw_writer_close(&w, err);
+}
+
+static const struct {
+	const char	*name;
+	int		(*build)(struct fw_job *job);
+} formats[] = {
+	{ "tplink",	build_tplink },
+};
+
+static int parse_manifest(const char *name)
+{
+	char line[LINE_LEN];
+	struct fw_job *job;
+	char *tok, *save;
+	FILE *f;
+	int lineno = 0;
+	unsigned int i;
+
+	f = fopen(name, "r");
+	if (!f) {
+		ERR("could not open \"%s\" for reading: %s", name, strerror(errno));
+		return -1;
+	}
+
+	while (fgets(line, sizeof(line), f)) {
+		lineno++;
+
+		if ((tok = strchr(line, '#')))
+			*tok = '\0';
+
+		tok = strtok_r(line, " \t\r\n", &save);
+		if (!tok)
+			continue;
+
+		jobs = realloc(jobs, (n_jobs + 1) * sizeof(*jobs));
+		if (!jobs) {
+			ERR("out of memory");
+			goto err;
+		}
+
+		job = &jobs[n_jobs];
+		memset(job, 0, sizeof(*job));
+		job->line = lineno;
+
+		for (i = 0; i < sizeof(formats) / sizeof(formats[0]); i++)
+			if (!strcmp(tok, formats[i].name))
+				job->build = formats[i].build;
+
+		if (!job->build) {
+			ERR("line %d: unknown image format \"%s\"", lineno, tok);
+			goto err;
+		}
+
+		tok = strtok_r(NULL, " \t\r\n", &save);
+		if (!tok) {
+			ERR("line %d: no output file specified", lineno);
+			goto err;
+		}
+		job->output = strdup(tok);
+
+		while ((tok = strtok_r(NULL, " \t\r\n", &save))) {
+			if (job->argc == MAX_ARGS) {
+				ERR("line %d: too many arguments", lineno);
+				goto err;
+			}
+			job->argv[job->argc++] = strdup(tok);
+		}
+
+		n_jobs++;
+	}
+
+	fclose(f);
+	return 0;
+
+err:
+	fclose(f);
+	return -1;
+}
+
+static void *worker(void *arg)
+{
+	struct fw_job *job;
+
+	for (;;) {
+		pthread_mutex_lock(&job_lock);
+		job = (next_job < n_jobs) ? &jobs[next_job++] : NULL;
+		pthread_mutex_unlock(&job_lock);
+
+		if (!job)
+			break;
+
+		if (job->build(job)) {
+			ERR("building \"%s\" failed", job->output);
+			pthread_mutex_lock(&job_lock);
+			failed++;
+			pthread_mutex_unlock(&job_lock);
+		}
+	}
+
+	return NULL;
+}
+
+static void usage(int status)
+{
+	fprintf(stderr,
+		"Usage: %s [-j <jobs>] <manifest>\n"
+		"\n"
+		"Options:\n"
+		"  -j <jobs>       number of images to build in parallel\n"
+		"                  (default: number of online CPUs)\n"
+		"  -h              show this screen\n",
+		progname);
+
+	exit(status);
+}
+
+int main(int argc, char *argv[])
+{
+	pthread_t *threads;
+	long n_threads;
+	int i, c;
+
+	progname = basename(argv[0]);
+
+	n_threads = sysconf(_SC_NPROCESSORS_ONLN);
+
+	while ((c = getopt(argc, argv, "j:h")) != -1) {
+		switch (c) {
+		case 'j':
+			n_threads = strtol(optarg, NULL, 0);
+			break;
+		case 'h':
+			usage(EXIT_SUCCESS);
+			break;
+		default:
+			usage(EXIT_FAILURE);
+			break;
+		}
+	}
+
+	if (optind != argc - 1)
+		usage(EXIT_FAILURE);
+
+	if (parse_manifest(argv[optind]))
+		return EXIT_FAILURE;
+
+	if (n_threads < 1)
+		n_threads = 1;
+	if (n_threads > n_jobs)
+		n_threads = n_jobs;
+
+	threads = calloc(n_threads, sizeof(*threads));
+	if (!threads) {
+		ERR("out of memory");
+		return EXIT_FAILURE;
+	}
+
+	for (i = 0; i < n_threads; i++) {
+		if (pthread_create(&threads[i], NULL, worker, NULL)) {
+			ERR("unable to start worker thread");
+			return EXIT_FAILURE;
+		}
+	}
+
+	for (i = 0; i < n_threads; i++)
+		pthread_join(threads[i], NULL);
+
+	fw_blob_release_all();
+	free(threads);
+
+	return failed ? EXIT_FAILURE : EXIT_SUCCESS;
+}
@@ -20,16 +20,16 @@
 #include <getopt.h>     /* for getopt() */
 #include <stdarg.h>
 #include <errno.h>
+#include <stddef.h>
 #include <sys/stat.h>
 
 #include <arpa/inet.h>
 #include <netinet/in.h>
 
-#include "md5.h"
+#include "fwimage.h"
 
 #define ALIGN(x,a) ({ typeof(a) __a = (a); (((x) + __a - 1) & ~(__a - 1)); })
 
-#define HEADER_VERSION_V1	0x01000000
 #define HWID_GL_INET_V1		0x08000001
 #define HWID_GS_OOLITE_V1	0x3C000101
 #define HWID_TL_MR10U_V1	0x00100101
@@ -69,39 +69,11 @@
 #define HWID_TL_WR1041N_V2	0x10410002
 #define HWID_TL_WR2543N_V1	0x25430001
 
-#define MD5SUM_LEN	16
-
 struct file_info {
 	char		*file_name;	/* name of the file */
 	uint32_t	file_size;	/* length of the file */
 };
 
-struct fw_header {
-	uint32_t	version;	/* header version */
-	char		vendor_name[24];
-	char		fw_version[36];
-	uint32_t	hw_id;		/* hardware id */
-	uint32_t	hw_rev;		/* hardware revision */
-	uint32_t	unk1;
-	uint8_t		md5sum1[MD5SUM_LEN];
-	uint32_t	unk2;
-	uint8_t		md5sum2[MD5SUM_LEN];
-	uint32_t	unk3;
-	uint32_t	kernel_la;	/* kernel load address */
-	uint32_t	kernel_ep;	/* kernel entry point */
-	uint32_t	fw_length;	/* total length of the firmware */
-	uint32_t	kernel_ofs;	/* kernel data offset */
-	uint32_t	kernel_len;	/* kernel data length */
-	uint32_t	rootfs_ofs;	/* rootfs data offset */
-	uint32_t	rootfs_len;	/* rootfs data length */
-	uint32_t	boot_ofs;	/* bootloader data offset */
-	uint32_t	boot_len;	/* bootloader data length */
-	uint16_t	ver_hi;
-	uint16_t	ver_mid;
-	uint16_t	ver_lo;
-	uint8_t		pad[354];
-} __attribute__ ((packed));
-
 struct flash_layout {
 	char		*id;
 	uint32_t	fw_max_len;
@@ -148,23 +120,12 @@ static struct file_info boot_info;
 static int combined;
 static int strip_padding;
 static int add_jffs2_eof;
-static unsigned char jffs2_eof_mark[4] = {0xde, 0xad, 0xc0, 0xde};
 static uint32_t fw_max_len;
 static uint32_t reserved_space;
 
 static struct file_info inspect_info;
 static int extract = 0;
 
-char md5salt_normal[MD5SUM_LEN] = {
-	0xdc, 0xd7, 0x3a, 0xa5, 0xc3, 0x95, 0x98, 0xfb,
-	0xdd, 0xf9, 0xe7, 0xf4, 0x0e, 0xae, 0x47, 0x38,
-};
-
-char md5salt_boot[MD5SUM_LEN] = {
-	0x8c, 0xef, 0x33, 0x5b, 0xd5, 0xc5, 0xce, 0xfa,
-	0xa7, 0x9c, 0x28, 0xda, 0xb2, 0xe9, 0x0f, 0x42,
-};
-
 static struct flash_layout layouts[] = {
 	{
 		.id		= "4M",
@@ -508,13 +469,39 @@ static void usage(int status)
 	exit(status);
 }
 
-static int get_md5(char *data, int size, char *md5)
+#define STREAM_BUF_SIZE	(256 * 1024)
+
+/* copy len bytes at ofs of an opened firmware file to a new file */
+static int copy_range(FILE *in, uint32_t ofs, uint32_t len, char *name, char *buf)
 {
-	MD5_CTX ctx;
+	FILE *out;
+	size_t n;
+	int ret = EXIT_FAILURE;
 
-	MD5_Init(&ctx);
-	MD5_Update(&ctx, data, size);
-	MD5_Final(md5, &ctx);
+	out = fopen(name, "w");
+	if (out == NULL) {
+		ERR("error in fopen(): %s", strerror(errno));
+		return ret;
+	}
+
+	if (fseek(in, ofs, SEEK_SET))
+		goto err;
+
+	while (len) {
+		n = fread(buf, 1, len < STREAM_BUF_SIZE ? len : STREAM_BUF_SIZE, in);
+		if (!n || fwrite(buf, n, 1, out) != 1)
+			goto err;
+		len -= n;
+	}
+
+	ret = EXIT_SUCCESS;
+	goto out;
+
+ err:
+	ERR("error in fwrite(): %s", strerror(errno));
+ out:
+	fclose(out);
+	return ret;
 }
 
 static int get_file_stat(struct file_info *fdata)
@@ -535,32 +522,6 @@ static int get_file_stat(struct file_info *fdata)
 	return 0;
 }
 
-static int read_to_buf(struct file_info *fdata, char *buf)
-{
-	FILE *f;
-	int ret = EXIT_FAILURE;
-
-	f = fopen(fdata->file_name, "r");
-	if (f == NULL) {
-		ERRS("could not open \"%s\" for reading", fdata->file_name);
-		goto out;
-	}
-
-	errno = 0;
-	fread(buf, fdata->file_size, 1, f);
-	if (errno != 0) {
-		ERRS("unable to read from file \"%s\"", fdata->file_name);
-		goto out_close;
-	}
-
-	ret = EXIT_SUCCESS;
-
- out_close:
-	fclose(f);
- out:
-	return ret;
-}
-
 static int check_options(void)
 {
 	int ret;
@@ -638,7 +599,7 @@ static int check_options(void)
 
 	if (combined) {
 		if (kernel_info.file_size >
-		    fw_max_len - sizeof(struct fw_header)) {
+		    fw_max_len - sizeof(struct tplink_header)) {
 			ERR("kernel image is too big");
 			return -1;
 		}
@@ -653,20 +614,20 @@ static int check_options(void)
 			return ret;
 
 		if (rootfs_align) {
-			kernel_len += sizeof(struct fw_header);
+			kernel_len += sizeof(struct tplink_header);
 			kernel_len = ALIGN(kernel_len, rootfs_align);
-			kernel_len -= sizeof(struct fw_header);
+			kernel_len -= sizeof(struct tplink_header);
 
 			DBG("kernel length aligned to %u", kernel_len);
 
 			if (kernel_len + rootfs_info.file_size >
-			    fw_max_len - sizeof(struct fw_header)) {
+			    fw_max_len - sizeof(struct tplink_header)) {
 				ERR("images are too big");
 				return -1;
 			}
 		} else {
 			if (kernel_info.file_size >
-			    rootfs_ofs - sizeof(struct fw_header)) {
+			    rootfs_ofs - sizeof(struct tplink_header)) {
 				ERR("kernel image is too big");
 				return -1;
 			}
@@ -693,27 +654,27 @@ static int check_options(void)
 	return 0;
 }
 
-static void fill_header(char *buf, int len)
+static void fill_header(char *buf)
 {
-	struct fw_header *hdr = (struct fw_header *)buf;
+	struct tplink_header *hdr = (struct tplink_header *)buf;
 
-	memset(hdr, 0, sizeof(struct fw_header));
+	memset(hdr, 0, sizeof(struct tplink_header));
 
-	hdr->version = htonl(HEADER_VERSION_V1);
+	hdr->version = htonl(TPLINK_HEADER_V1);
 	strncpy(hdr->vendor_name, vendor, sizeof(hdr->vendor_name));
 	strncpy(hdr->fw_version, version, sizeof(hdr->fw_version));
 	hdr->hw_id = htonl(hw_id);
 	hdr->hw_rev = htonl(hw_rev);
 
 	if (boot_info.file_size == 0)
-		memcpy(hdr->md5sum1, md5salt_normal, sizeof(hdr->md5sum1));
+		memcpy(hdr->md5sum1, tplink_md5salt_normal, sizeof(hdr->md5sum1));
 	else
-		memcpy(hdr->md5sum1, md5salt_boot, sizeof(hdr->md5sum1));
+		memcpy(hdr->md5sum1, tplink_md5salt_boot, sizeof(hdr->md5sum1));
 
 	hdr->kernel_la = htonl(kernel_la);
 	hdr->kernel_ep = htonl(kernel_ep);
 	hdr->fw_length = htonl(layout->fw_max_len);
-	hdr->kernel_ofs = htonl(sizeof(struct fw_header));
+	hdr->kernel_ofs = htonl(sizeof(struct tplink_header));
 	hdr->kernel_len = htonl(kernel_len);
 	if (!combined) {
 		hdr->rootfs_ofs = htonl(rootfs_ofs);
@@ -723,133 +684,59 @@ static void fill_header(char *buf, int len)
 	hdr->ver_hi = htons(fw_ver_hi);
 	hdr->ver_mid = htons(fw_ver_mid);
 	hdr->ver_lo = htons(fw_ver_lo);
-
-	get_md5(buf, len, hdr->md5sum1);
-}
-
-static int pad_jffs2(char *buf, int currlen)
-{
-	int len;
-	uint32_t pad_mask;
-
-	len = currlen;
-	pad_mask = (64 * 1024);
-	while ((len < layout->fw_max_len) && (pad_mask != 0)) {
-		uint32_t mask;
-		int i;
-
-		for (i = 10; i < 32; i++) {
-			mask = 1 << i;
-			if (pad_mask & mask)
-				break;
-		}
-
-		len = ALIGN(len, mask);
-
-		for (i = 10; i < 32; i++) {
-			mask = 1 << i;
-			if ((len & (mask - 1)) == 0)
-				pad_mask &= ~mask;
-		}
-
-		for (i = 0; i < sizeof(jffs2_eof_mark); i++)
-			buf[len + i] = jffs2_eof_mark[i];
-
-		len += sizeof(jffs2_eof_mark);
-	}
-
-	return len;
-}
-
-static int write_fw(char *data, int len)
-{
-	FILE *f;
-	int ret = EXIT_FAILURE;
-
-	f = fopen(ofname, "w");
-	if (f == NULL) {
-		ERRS("could not open \"%s\" for writing", ofname);
-		goto out;
-	}
-
-	errno = 0;
-	fwrite(data, len, 1, f);
-	if (errno) {
-		ERRS("unable to write output file");
-		goto out_flush;
-	}
-
-	DBG("firmware file \"%s\" completed", ofname);
-
-	ret = EXIT_SUCCESS;
-
- out_flush:
-	fflush(f);
-	fclose(f);
-	if (ret != EXIT_SUCCESS) {
-		unlink(ofname);
-	}
- out:
-	return ret;
 }
 
 static int build_fw(void)
 {
-	int buflen;
-	char *buf;
-	char *p;
-	int ret = EXIT_FAILURE;
-	int writelen = 0;
+	struct tplink_header hdr;
+	struct fw_blob *kernel, *rootfs = NULL;
+	struct fw_writer w;
+	uint8_t md5sum[MD5SUM_LEN];
+	int err;
 
-	buflen = layout->fw_max_len;
+	kernel = fw_blob_get(kernel_info.file_name);
+	if (!kernel)
+		return EXIT_FAILURE;
 
-	buf = malloc(buflen);
-	if (!buf) {
-		ERR("no memory for buffer\n");
-		goto out;
+	if (!combined) {
+		rootfs = fw_blob_get(rootfs_info.file_name);
+		if (!rootfs)
+			return EXIT_FAILURE;
 	}
 
-	memset(buf, 0xff, buflen);
-	p = buf + sizeof(struct fw_header);
-	ret = read_to_buf(&kernel_info, p);
-	if (ret)
-		goto out_free_buf;
+	if (fw_writer_open(&w, ofname))
+		return EXIT_FAILURE;
 
-	writelen = sizeof(struct fw_header) + kernel_len;
+	/* the header carries the salt in place of the checksum for now */
+	fill_header((char *) &hdr);
+	err = fw_write(&w, &hdr, sizeof(hdr)) ||
+	      fw_write(&w, kernel->data, kernel->len);
 
-	if (!combined) {
-		if (rootfs_align)
-			p = buf + writelen;
-		else
-			p = buf + rootfs_ofs;
+	if (!err && !combined) {
+		err = fw_fill(&w, rootfs_align ? sizeof(hdr) + kernel_len : rootfs_ofs,
+			      0xff) ||
+		      fw_write(&w, rootfs->data, rootfs->len);
 
-		ret = read_to_buf(&rootfs_info, p);
-		if (ret)
-			goto out_free_buf;
+		if (!err && add_jffs2_eof)
+			err = fw_pad_jffs2(&w, layout->fw_max_len);
+	}
 
-		if (rootfs_align)
-			writelen += rootfs_info.file_size;
-		else
-			writelen = rootfs_ofs + rootfs_info.file_size;
+	if (!err && !strip_padding)
+		err = fw_fill(&w, layout->fw_max_len, 0xff);
 
-		if (add_jffs2_eof)
-			writelen = pad_jffs2(buf, writelen);
+	if (!err) {
+		MD5_Final(md5sum, &w.md5);
+		err = fw_patch(&w, offsetof(struct tplink_header, md5sum1),
+			       md5sum, sizeof(md5sum));
 	}
 
-	if (!strip_padding)
-		writelen = buflen;
+	fw_blob_release_all();
 
-	fill_header(buf, writelen);
-	ret = write_fw(buf, writelen);
-	if (ret)
-		goto out_free_buf;
+	if (fw_writer_close(&w, err))
+		return EXIT_FAILURE;
 
-	ret = EXIT_SUCCESS;
-
- out_free_buf:
-	free(buf);
- out:
-	return ret;
+	DBG("firmware file \"%s\" completed", ofname);
+	return EXIT_SUCCESS;
 }
 
 /* Helper functions to inspect_fw() representing different output formats */
@@ -920,41 +807,57 @@ static inline void inspect_fw_pmd5sum(char *label, uint8_t *val, char *text)
 static int inspect_fw(void)
 {
 	char *buf;
-	struct fw_header *hdr;
+	FILE *f;
+	struct tplink_header hdr_buf, *hdr = &hdr_buf;
 	uint8_t md5sum[MD5SUM_LEN];
 	struct board_info *board;
+	MD5_CTX ctx;
+	size_t len;
 	int ret = EXIT_FAILURE;
 
-	buf = malloc(inspect_info.file_size);
+	buf = malloc(STREAM_BUF_SIZE);
 	if (!buf) {
 		ERR("no memory for buffer!\n");
 		goto out;
 	}
 
-	ret = read_to_buf(&inspect_info, buf);
-	if (ret)
+	f = fopen(inspect_info.file_name, "r");
+	if (f == NULL) {
+		ERRS("could not open \"%s\" for reading", inspect_info.file_name);
 		goto out_free_buf;
-	hdr = (struct fw_header *)buf;
+	}
+
+	if (fread(hdr, sizeof(*hdr), 1, f) != 1) {
+		ERRS("unable to read from file \"%s\"", inspect_info.file_name);
+		goto out_close;
+	}
+	ret = EXIT_SUCCESS;
 
 	inspect_fw_pstr("File name", inspect_info.file_name);
 	inspect_fw_phexdec("File size", inspect_info.file_size);
 
-	if (ntohl(hdr->version) != HEADER_VERSION_V1) {
+	if (ntohl(hdr->version) != TPLINK_HEADER_V1) {
 		ERR("file does not seem to have V1 header!\n");
-		goto out_free_buf;
+		goto out_close;
 	}
 
-	inspect_fw_phexdec("Version 1 Header size", sizeof(struct fw_header));
+	inspect_fw_phexdec("Version 1 Header size", sizeof(struct tplink_header));
 
 	if (ntohl(hdr->unk1) != 0)
 		inspect_fw_phexdec("Unknown value 1", hdr->unk1);
 
 	memcpy(md5sum, hdr->md5sum1, sizeof(md5sum));
 	if (ntohl(hdr->boot_len) == 0)
-		memcpy(hdr->md5sum1, md5salt_normal, sizeof(md5sum));
+		memcpy(hdr->md5sum1, tplink_md5salt_normal, sizeof(md5sum));
 	else
-		memcpy(hdr->md5sum1, md5salt_boot, sizeof(md5sum));
-	get_md5(buf, inspect_info.file_size, hdr->md5sum1);
+		memcpy(hdr->md5sum1, tplink_md5salt_boot, sizeof(md5sum));
+
+	/* hash the salted header and then the rest of the file as it is read */
+	MD5_Init(&ctx);
+	MD5_Update(&ctx, hdr, sizeof(*hdr));
+	while ((len = fread(buf, 1, STREAM_BUF_SIZE, f)) > 0)
+		MD5_Update(&ctx, buf, len);
+	MD5_Final(hdr->md5sum1, &ctx);
 
 	if (memcmp(md5sum, hdr->md5sum1, sizeof(md5sum))) {
 		inspect_fw_pmd5sum("Header MD5Sum1", md5sum, "(*ERROR*)");
@@ -1021,7 +924,6 @@ static int inspect_fw(void)
 	                   ntohl(hdr->fw_length));
 
 	if (extract) {
-		FILE *fp;
 		char *filename;
 
 		printf("\n");
@@ -1029,34 +931,20 @@ static int inspect_fw(void)
 		filename = malloc(strlen(inspect_info.file_name) + 8);
 		sprintf(filename, "%s-kernel", inspect_info.file_name);
 		printf("Extracting kernel to \"%s\"...\n", filename);
-		fp = fopen(filename, "w");
-		if (fp)	{
-			if (!fwrite(buf + ntohl(hdr->kernel_ofs),
-			            ntohl(hdr->kernel_len), 1, fp)) {
-				ERR("error in fwrite(): %s", strerror(errno));
-			}
-			fclose(fp);
-		} else {
-			ERR("error in fopen(): %s", strerror(errno));
-		}
+		copy_range(f, ntohl(hdr->kernel_ofs), ntohl(hdr->kernel_len),
+		           filename, buf);
 		free(filename);
 
 		filename = malloc(strlen(inspect_info.file_name) + 8);
 		sprintf(filename, "%s-rootfs", inspect_info.file_name);
 		printf("Extracting rootfs to \"%s\"...\n", filename);
-		fp = fopen(filename, "w");
-		if (fp)	{
-			if (!fwrite(buf + ntohl(hdr->rootfs_ofs),
-			            ntohl(hdr->rootfs_len), 1, fp)) {
-				ERR("error in fwrite(): %s", strerror(errno));
-			}
-			fclose(fp);
-		} else {
-			ERR("error in fopen(): %s", strerror(errno));
-		}
+		copy_range(f, ntohl(hdr->rootfs_ofs), ntohl(hdr->rootfs_len),
+		           filename, buf);
 		free(filename);
 	}
 
+ out_close:
+	fclose(f);
  out_free_buf:
 	free(buf);
  out:
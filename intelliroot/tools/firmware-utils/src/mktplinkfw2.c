@@ -20,12 +20,13 @@
 #include <getopt.h>     /* for getopt() */
 #include <stdarg.h>
 #include <errno.h>
+#include <stddef.h>
 #include <sys/stat.h>
 
 #include <arpa/inet.h>
 #include <netinet/in.h>
 
-#include "md5.h"
+#include "fwimage.h"
 
 #define ALIGN(x,a) ({ typeof(a) __a = (a); (((x) + __a - 1) & ~(__a - 1)); })
 
@@ -33,8 +34,6 @@
 
 #define HWID_TD_W8970_V1		0x89700001
 
-#define MD5SUM_LEN	16
-
 struct file_info {
 	char		*file_name;	/* name of the file */
 	uint32_t	file_size;	/* length of the file */
@@ -119,7 +118,6 @@ static struct file_info boot_info;
 static int combined;
 static int strip_padding;
 static int add_jffs2_eof;
-static unsigned char jffs2_eof_mark[4] = {0xde, 0xad, 0xc0, 0xde};
 
 static struct file_info inspect_info;
 static int extract = 0;
@@ -255,13 +253,39 @@ static void usage(int status)
 	exit(status);
 }
 
-static int get_md5(char *data, int size, char *md5)
+#define STREAM_BUF_SIZE	(256 * 1024)
+
+/* copy len bytes at ofs of an opened firmware file to a new file */
+static int copy_range(FILE *in, uint32_t ofs, uint32_t len, char *name, char *buf)
 {
-	MD5_CTX ctx;
+	FILE *out;
+	size_t n;
+	int ret = EXIT_FAILURE;
 
-	MD5_Init(&ctx);
-	MD5_Update(&ctx, data, size);
-	MD5_Final(md5, &ctx);
+	out = fopen(name, "w");
+	if (out == NULL) {
+		ERR("error in fopen(): %s", strerror(errno));
+		return ret;
+	}
+
+	if (fseek(in, ofs, SEEK_SET))
+		goto err;
+
+	while (len) {
+		n = fread(buf, 1, len < STREAM_BUF_SIZE ? len : STREAM_BUF_SIZE, in);
+		if (!n || fwrite(buf, n, 1, out) != 1)
+			goto err;
+		len -= n;
+	}
+
+	ret = EXIT_SUCCESS;
+	goto out;
+
+ err:
+	ERR("error in fwrite(): %s", strerror(errno));
+ out:
+	fclose(out);
+	return ret;
 }
 
 static int get_file_stat(struct file_info *fdata)
@@ -282,32 +306,6 @@ static int get_file_stat(struct file_info *fdata)
 	return 0;
 }
 
-static int read_to_buf(struct file_info *fdata, char *buf)
-{
-	FILE *f;
-	int ret = EXIT_FAILURE;
-
-	f = fopen(fdata->file_name, "r");
-	if (f == NULL) {
-		ERRS("could not open \"%s\" for reading", fdata->file_name);
-		goto out;
-	}
-
-	errno = 0;
-	fread(buf, fdata->file_size, 1, f);
-	if (errno != 0) {
-		ERRS("unable to read from file \"%s\"", fdata->file_name);
-		goto out_close;
-	}
-
-	ret = EXIT_SUCCESS;
-
- out_close:
-	fclose(f);
- out:
-	return ret;
-}
-
 static int check_options(void)
 {
 	int ret;
@@ -439,7 +437,7 @@ static int check_options(void)
 	return 0;
 }
 
-static void fill_header(char *buf, int len)
+static void fill_header(char *buf)
 {
 	struct fw_header *hdr = (struct fw_header *)buf;
 	unsigned ver_len;
@@ -492,133 +490,59 @@ static void fill_header(char *buf, int len)
 	hdr->ver_hi = fw_ver_hi;
 	hdr->ver_mid = fw_ver_mid;
 	hdr->ver_lo = fw_ver_lo;
-
-	get_md5(buf, len, hdr->md5sum1);
-}
-
-static int pad_jffs2(char *buf, int currlen)
-{
-	int len;
-	uint32_t pad_mask;
-
-	len = currlen;
-	pad_mask = (64 * 1024);
-	while ((len < layout->fw_max_len) && (pad_mask != 0)) {
-		uint32_t mask;
-		int i;
-
-		for (i = 10; i < 32; i++) {
-			mask = 1 << i;
-			if (pad_mask & mask)
-				break;
-		}
-
-		len = ALIGN(len, mask);
-
-		for (i = 10; i < 32; i++) {
-			mask = 1 << i;
-			if ((len & (mask - 1)) == 0)
-				pad_mask &= ~mask;
-		}
-
-		for (i = 0; i < sizeof(jffs2_eof_mark); i++)
-			buf[len + i] = jffs2_eof_mark[i];
-
-		len += sizeof(jffs2_eof_mark);
-	}
-
-	return len;
-}
-
-static int write_fw(char *data, int len)
-{
-	FILE *f;
-	int ret = EXIT_FAILURE;
-
-	f = fopen(ofname, "w");
-	if (f == NULL) {
-		ERRS("could not open \"%s\" for writing", ofname);
-		goto out;
-	}
-
-	errno = 0;
-	fwrite(data, len, 1, f);
-	if (errno) {
-		ERRS("unable to write output file");
-		goto out_flush;
-	}
-
-	DBG("firmware file \"%s\" completed", ofname);
-
-	ret = EXIT_SUCCESS;
-
- out_flush:
-	fflush(f);
-	fclose(f);
-	if (ret != EXIT_SUCCESS) {
-		unlink(ofname);
-	}
- out:
-	return ret;
 }
 
 static int build_fw(void)
 {
-	int buflen;
-	char *buf;
-	char *p;
-	int ret = EXIT_FAILURE;
-	int writelen = 0;
+	struct fw_header hdr;
+	struct fw_blob *kernel, *rootfs = NULL;
+	struct fw_writer w;
+	uint8_t md5sum[MD5SUM_LEN];
+	int err;
 
-	buflen = layout->fw_max_len;
+	kernel = fw_blob_get(kernel_info.file_name);
+	if (!kernel)
+		return EXIT_FAILURE;
 
-	buf = malloc(buflen);
-	if (!buf) {
-		ERR("no memory for buffer\n");
-		goto out;
+	if (!combined) {
+		rootfs = fw_blob_get(rootfs_info.file_name);
+		if (!rootfs)
+			return EXIT_FAILURE;
 	}
 
-	memset(buf, 0xff, buflen);
-	p = buf + sizeof(struct fw_header);
-	ret = read_to_buf(&kernel_info, p);
-	if (ret)
-		goto out_free_buf;
+	if (fw_writer_open(&w, ofname))
+		return EXIT_FAILURE;
 
-	writelen = sizeof(struct fw_header) + kernel_len;
+	/* the header carries the salt in place of the checksum for now */
+	fill_header((char *) &hdr);
+	err = fw_write(&w, &hdr, sizeof(hdr)) ||
+	      fw_write(&w, kernel->data, kernel->len);
 
-	if (!combined) {
-		if (rootfs_align)
-			p = buf + writelen;
-		else
-			p = buf + rootfs_ofs;
+	if (!err && !combined) {
+		err = fw_fill(&w, rootfs_align ? sizeof(hdr) + kernel_len : rootfs_ofs,
+			      0xff) ||
+		      fw_write(&w, rootfs->data, rootfs->len);
 
-		ret = read_to_buf(&rootfs_info, p);
-		if (ret)
-			goto out_free_buf;
+		if (!err && add_jffs2_eof)
+			err = fw_pad_jffs2(&w, layout->fw_max_len);
+	}
 
-		if (rootfs_align)
-			writelen += rootfs_info.file_size;
-		else
-			writelen = rootfs_ofs + rootfs_info.file_size;
+	if (!err && !strip_padding)
+		err = fw_fill(&w, layout->fw_max_len, 0xff);
 
-		if (add_jffs2_eof)
-			writelen = pad_jffs2(buf, writelen);
+	if (!err) {
+		MD5_Final(md5sum, &w.md5);
+		err = fw_patch(&w, offsetof(struct fw_header, md5sum1),
+			       md5sum, sizeof(md5sum));
 	}
 
-	if (!strip_padding)
-		writelen = buflen;
+	fw_blob_release_all();
 
-	fill_header(buf, writelen);
-	ret = write_fw(buf, writelen);
-	if (ret)
-		goto out_free_buf;
+	if (fw_writer_close(&w, err))
+		return EXIT_FAILURE;
 
-	ret = EXIT_SUCCESS;
-
- out_free_buf:
-	free(buf);
- out:
-	return ret;
+	DBG("firmware file \"%s\" completed", ofname);
+	return EXIT_SUCCESS;
 }
 
 /* Helper functions to inspect_fw() representing different output formats */
@@ -689,28 +613,38 @@ static inline void inspect_fw_pmd5sum(char *label, uint8_t *val, char *text)
 static int inspect_fw(void)
 {
 	char *buf;
-	struct fw_header *hdr;
+	FILE *f;
+	struct fw_header hdr_buf, *hdr = &hdr_buf;
 	uint8_t md5sum[MD5SUM_LEN];
 	struct board_info *board;
+	MD5_CTX ctx;
+	size_t len;
 	int ret = EXIT_FAILURE;
 
-	buf = malloc(inspect_info.file_size);
+	buf = malloc(STREAM_BUF_SIZE);
 	if (!buf) {
 		ERR("no memory for buffer!\n");
 		goto out;
 	}
 
-	ret = read_to_buf(&inspect_info, buf);
-	if (ret)
+	f = fopen(inspect_info.file_name, "r");
+	if (f == NULL) {
+		ERRS("could not open \"%s\" for reading", inspect_info.file_name);
 		goto out_free_buf;
-	hdr = (struct fw_header *)buf;
+	}
+
+	if (fread(hdr, sizeof(*hdr), 1, f) != 1) {
+		ERRS("unable to read from file \"%s\"", inspect_info.file_name);
+		goto out_close;
+	}
+	ret = EXIT_SUCCESS;
 
 	inspect_fw_pstr("File name", inspect_info.file_name);
 	inspect_fw_phexdec("File size", inspect_info.file_size);
 
 	if (ntohl(hdr->version) != HEADER_VERSION_V2) {
 		ERR("file does not seem to have V2 header!\n");
-		goto out_free_buf;
+		goto out_close;
 	}
 
 	inspect_fw_phexdec("Version 2 Header size", sizeof(struct fw_header));
@@ -723,7 +657,13 @@ static int inspect_fw(void)
 		memcpy(hdr->md5sum1, md5salt_normal, sizeof(md5sum));
 	else
 		memcpy(hdr->md5sum1, md5salt_boot, sizeof(md5sum));
-	get_md5(buf, inspect_info.file_size, hdr->md5sum1);
+
+	/* hash the salted header and then the rest of the file as it is read */
+	MD5_Init(&ctx);
+	MD5_Update(&ctx, hdr, sizeof(*hdr));
+	while ((len = fread(buf, 1, STREAM_BUF_SIZE, f)) > 0)
+		MD5_Update(&ctx, buf, len);
+	MD5_Final(hdr->md5sum1, &ctx);
 
 	if (memcmp(md5sum, hdr->md5sum1, sizeof(md5sum))) {
 		inspect_fw_pmd5sum("Header MD5Sum1", md5sum, "(*ERROR*)");
@@ -801,7 +741,6 @@ static int inspect_fw(void)
 	                   ntohl(hdr->fw_length));
 
 	if (extract) {
-		FILE *fp;
 		char *filename;
 
 		printf("\n");
@@ -809,34 +748,20 @@ static int inspect_fw(void)
 		filename = malloc(strlen(inspect_info.file_name) + 8);
 		sprintf(filename, "%s-kernel", inspect_info.file_name);
 		printf("Extracting kernel to \"%s\"...\n", filename);
-		fp = fopen(filename, "w");
-		if (fp)	{
-			if (!fwrite(buf + ntohl(hdr->kernel_ofs),
-			            ntohl(hdr->kernel_len), 1, fp)) {
-				ERR("error in fwrite(): %s", strerror(errno));
-			}
-			fclose(fp);
-		} else {
-			ERR("error in fopen(): %s", strerror(errno));
-		}
+		copy_range(f, ntohl(hdr->kernel_ofs), ntohl(hdr->kernel_len),
+		           filename, buf);
 		free(filename);
 
 		filename = malloc(strlen(inspect_info.file_name) + 8);
 		sprintf(filename, "%s-rootfs", inspect_info.file_name);
 		printf("Extracting rootfs to \"%s\"...\n", filename);
-		fp = fopen(filename, "w");
-		if (fp)	{
-			if (!fwrite(buf + ntohl(hdr->rootfs_ofs),
-			            ntohl(hdr->rootfs_len), 1, fp)) {
-				ERR("error in fwrite(): %s", strerror(errno));
-			}
-			fclose(fp);
-		} else {
-			ERR("error in fopen(): %s", strerror(errno));
-		}
+		copy_range(f, ntohl(hdr->rootfs_ofs), ntohl(hdr->rootfs_len),
+		           filename, buf);
 		free(filename);
 	}
 
+ out_close:
+	fclose(f);
  out_free_buf:
 	free(buf);
  out:
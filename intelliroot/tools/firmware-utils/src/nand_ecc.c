@@ -26,6 +26,7 @@
 #include <unistd.h>
 #include <stdlib.h>
 #include <stdint.h>
+#include <string.h>
 #include <fcntl.h>
 #include <stdio.h>
 
@@ -36,6 +37,7 @@
 static int page_size = DEF_NAND_PAGE_SIZE;
 static int oob_size = DEF_NAND_OOB_SIZE;
 static int ecc_offset = DEF_NAND_ECC_OFFSET;
+static int check;
 
 /*
  * Pre-calculated 256-way 1 byte column parity
@@ -59,32 +61,62 @@ static const uint8_t nand_ecc_precalc_table[] = {
 	0x00, 0x55, 0x56, 0x03, 0x59, 0x0c, 0x0f, 0x5a, 0x5a, 0x0f, 0x0c, 0x59, 0x03, 0x56, 0x55, 0x00
 };
 
+static inline uint8_t fold64(uint64_t x)
+{
+	x ^= x >> 32;
+	x ^= x >> 16;
+	x ^= x >> 8;
+	return x;
+}
+
+static inline int parity8(uint8_t x)
+{
+	return (nand_ecc_precalc_table[x] >> 6) & 1;
+}
+
 /**
  * nand_calculate_ecc - [NAND Interface] Calculate 3-byte ECC for 256-byte block
  * @dat:	raw data
  * @ecc_code:	buffer for ECC
+ *
+ * Line parity bit n is the parity of all bytes whose offset has bit n set,
+ * and the column parity of the block is the column parity of all bytes
+ * xored together. So the block is folded 64 bits at a time: bits 3-7 of
+ * the offset select the word, bits 0-2 the byte within the word.
  */
 int nand_calculate_ecc(const uint8_t *dat,
 		       uint8_t *ecc_code)
 {
-	uint8_t idx, reg1, reg2, reg3, tmp1, tmp2;
+	uint64_t w, all = 0, lp[5] = { 0 };
+	uint8_t b[8], idx, reg1, reg2, reg3, tmp1, tmp2;
 	int i;
 
-	/* Initialize variables */
-	reg1 = reg2 = reg3 = 0;
+	for (i = 0; i < 32; i++) {
+		memcpy(&w, dat + i * 8, sizeof(w));
+		all ^= w;
+		lp[0] ^= (i & 0x01) ? w : 0;
+		lp[1] ^= (i & 0x02) ? w : 0;
+		lp[2] ^= (i & 0x04) ? w : 0;
+		lp[3] ^= (i & 0x08) ? w : 0;
+		lp[4] ^= (i & 0x10) ? w : 0;
+	}
 
-	/* Build up column parity */
-	for(i = 0; i < 256; i++) {
-		/* Get CP0 - CP5 from table */
-		idx = nand_ecc_precalc_table[*dat++];
-		reg1 ^= (idx & 0x3f);
+	/* Column parity and overall parity of the xor of all bytes */
+	idx = nand_ecc_precalc_table[fold64(all)];
+	reg1 = idx & 0x3f;
 
-		/* All bit XOR = 1 ? */
-		if (idx & 0x40) {
-			reg3 ^= (uint8_t) i;
-			reg2 ^= ~((uint8_t) i);
-		}
-	}
+	/* Line parity from the byte position within the word ... */
+	memcpy(b, &all, sizeof(b));
+	reg3  = parity8(b[1] ^ b[3] ^ b[5] ^ b[7]) << 0;
+	reg3 |= parity8(b[2] ^ b[3] ^ b[6] ^ b[7]) << 1;
+	reg3 |= parity8(b[4] ^ b[5] ^ b[6] ^ b[7]) << 2;
+
+	/* ... and from the word index */
+	for (i = 0; i < 5; i++)
+		reg3 |= parity8(fold64(lp[i])) << (i + 3);
+
+	/* reg2 collects ~offset of every odd byte */
+	reg2 = (idx & 0x40) ? ~reg3 : reg3;
 
 	/* Create non-inverted ECC code from line parity */
 	tmp1  = (reg3 & 0x80) >> 0; /* B7 -> B7 */
@@ -118,6 +150,69 @@ int nand_calculate_ecc(const uint8_t *dat,
 	return 0;
 }
 
+/**
+ * nand_calculate_page_ecc - Calculate the ECC of all 256-byte blocks of a page
+ * @dat:	raw data
+ * @len:	length of the data, a multiple of 256
+ * @ecc_code:	buffer for 3 bytes of ECC per block
+ */
+void nand_calculate_page_ecc(const uint8_t *dat, int len, uint8_t *ecc_code)
+{
+	for (; len >= 256; len -= 256, dat += 256, ecc_code += 3)
+		nand_calculate_ecc(dat, ecc_code);
+}
+
+/**
+ * nand_correct_data - Detect and correct a 1 bit error for a 256-byte block
+ * @dat:	raw data read from the chip
+ * @read_ecc:	ECC from the chip
+ * @calc_ecc:	the ECC calculated from raw data
+ *
+ * Returns 0 if the block is fine, 1 if a single bit error in the data or
+ * in the ECC was corrected and -1 if the error can not be corrected.
+ */
+int nand_correct_data(uint8_t *dat, uint8_t *read_ecc, const uint8_t *calc_ecc)
+{
+	uint8_t s0, s1, s2;
+	int byte, bit;
+
+#ifdef CONFIG_MTD_NAND_ECC_SMC
+	s0 = calc_ecc[1] ^ read_ecc[1];
+	s1 = calc_ecc[0] ^ read_ecc[0];
+#else
+	s0 = calc_ecc[0] ^ read_ecc[0];
+	s1 = calc_ecc[1] ^ read_ecc[1];
+#endif
+	s2 = calc_ecc[2] ^ read_ecc[2];
+
+	if ((s0 | s1 | s2) == 0)
+		return 0;
+
+	/* every parity pair differs: single bit error in the data */
+	if (((s0 ^ (s0 >> 1)) & 0x55) == 0x55 &&
+	    ((s1 ^ (s1 >> 1)) & 0x55) == 0x55 &&
+	    ((s2 ^ (s2 >> 1)) & 0x54) == 0x54) {
+		byte  = (s0 & 0x80) | ((s0 & 0x20) << 1) |
+			((s0 & 0x08) << 2) | ((s0 & 0x02) << 3);
+		byte |= ((s1 & 0x80) >> 4) | ((s1 & 0x20) >> 3) |
+			((s1 & 0x08) >> 2) | ((s1 & 0x02) >> 1);
+		bit = ((s2 & 0x80) >> 5) | ((s2 & 0x20) >> 4) |
+		      ((s2 & 0x08) >> 3);
+
+		dat[byte] ^= 1 << bit;
+		return 1;
+	}
+
+	/* a single flipped bit in the ECC itself */
+	if (__builtin_popcount(s0) + __builtin_popcount(s1) +
+	    __builtin_popcount(s2) == 1) {
+		memcpy(read_ecc, calc_ecc, 3);
+		return 1;
+	}
+
+	return -1;
+}
+
 /*
  *  usage: bb-nandflash-ecc    start_address  size
  */
@@ -128,11 +223,52 @@ void usage(const char *prog)
 		"    -p <pagesize>      NAND page size (default: %d)\n"
 		"    -o <oobsize>       NAND OOB size (default: %d)\n"
 		"    -e <offset>        NAND ECC offset (default: %d)\n"
+		"    -c                 check an image with OOB data, correct single bit\n"
+		"                       errors and write the corrected image to <output>\n"
 		"\n", prog, DEF_NAND_PAGE_SIZE, DEF_NAND_OOB_SIZE,
 		DEF_NAND_ECC_OFFSET);
 	exit(1);
 }
 
+/*
+ * Verify the ECC of an image which already carries OOB data, fixing what
+ * can be fixed on the way.
+ */
+static int check_image(int infd, int outfd, uint8_t *page_data)
+{
+	uint8_t calc_ecc[3 * (page_size / 256)];
+	uint8_t *ecc_data;
+	int page = 0, corrected = 0, failed = 0;
+	int j, res;
+
+	while (read(infd, page_data, page_size + oob_size) == page_size + oob_size) {
+		ecc_data = page_data + page_size + ecc_offset;
+		nand_calculate_page_ecc(page_data, page_size, calc_ecc);
+
+		for (j = 0; j < page_size / 256; j++) {
+			res = nand_correct_data(page_data + j * 256, ecc_data + j * 3,
+						calc_ecc + j * 3);
+			if (res > 0) {
+				fprintf(stderr, "page %d, block %d: corrected single bit error\n",
+					page, j);
+				corrected++;
+			} else if (res < 0) {
+				fprintf(stderr, "page %d, block %d: uncorrectable ECC error\n",
+					page, j);
+				failed++;
+			}
+		}
+
+		write(outfd, page_data, page_size + oob_size);
+		page++;
+	}
+
+	fprintf(stderr, "%d pages checked, %d errors corrected, %d uncorrectable\n",
+		page, corrected, failed);
+
+	return failed ? 1 : 0;
+}
+
 /*start_address/size does not include oob
   */
 int main(int argc, char **argv)
@@ -144,8 +280,11 @@ int main(int argc, char **argv)
 	ssize_t bytes;
 	int ch;
 
-	while ((ch = getopt(argc, argv, "e:o:p:")) != -1) {
+	while ((ch = getopt(argc, argv, "ce:o:p:")) != -1) {
 		switch(ch) {
+		case 'c':
+			check = 1;
+			break;
 		case 'p':
 			page_size = strtoul(optarg, NULL, 0);
 			break;
@@ -178,16 +317,19 @@ int main(int argc, char **argv)
 	}
 
 	page_data = malloc(page_size + oob_size);
+	if (!page_data) {
+		perror("malloc");
+		goto out;
+	}
 
-	while ((bytes = read(infd, page_data, page_size)) == page_size) {
-		int j;
+	if (check) {
+		ret = check_image(infd, outfd, page_data);
+		goto out;
+	}
 
+	while ((bytes = read(infd, page_data, page_size)) == page_size) {
 		ecc_data = page_data + page_size + ecc_offset;
-		for (j = 0; j < page_size / 256; j++)
-		{
-			nand_calculate_ecc(page_data + j * 256, ecc_data);
-			ecc_data += 3;
-		}
+		nand_calculate_page_ecc(page_data, page_size, ecc_data);
 		write(outfd, page_data, page_size + oob_size);
 	}
 
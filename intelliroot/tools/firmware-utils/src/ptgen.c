@@ -28,6 +28,7 @@
 #include <stdio.h>
 #include <ctype.h>
 #include <fcntl.h>
+#include <errno.h>
 
 #if __BYTE_ORDER == __BIG_ENDIAN
 #define cpu_to_le16(x) bswap_16(x)
@@ -50,8 +51,18 @@ struct pte {
 struct partinfo {
 	unsigned long size;
 	int type;
+	char *image;
 };
 
+/* range of output blocks that carry data */
+struct blockrange {
+	unsigned long first;
+	unsigned long last;
+};
+
+#define MAP_BLOCK	4096
+#define COPY_BUF	(1024 * 1024)
+
 int verbose = 0;
 int active = 1;
 int heads = -1;
@@ -59,6 +70,12 @@ int sectors = -1;
 int kb_align = 0;
 struct partinfo parts[4];
 char *filename = NULL;
+char *mapname = NULL;
+int assemble = 0;	/* -i or -m given, the caller places nothing itself */
+
+struct blockrange *ranges = NULL;
+int n_ranges = 0;
+off_t image_size = 0;
 
 
 /* 
@@ -123,12 +140,196 @@ static inline unsigned long round_to_kb(long sect) {
         return ((sect - 1) / kb_align + 1) * kb_align;
 }
 
+/* record [start, start + len) of the output file as populated */
+static int map_add(off_t start, off_t len)
+{
+	unsigned long first = start / MAP_BLOCK;
+	unsigned long last = (start + len - 1) / MAP_BLOCK;
+	struct blockrange *r;
+
+	if (start + len > image_size)
+		image_size = start + len;
+
+	if (n_ranges) {
+		r = &ranges[n_ranges - 1];
+		if (first <= r->last + 1) {
+			if (last > r->last)
+				r->last = last;
+			return 0;
+		}
+	}
+
+	if (!(n_ranges % 64)) {
+		r = realloc(ranges, (n_ranges + 64) * sizeof(*ranges));
+		if (!r) {
+			fprintf(stderr, "out of memory\n");
+			return -1;
+		}
+		ranges = r;
+	}
+
+	ranges[n_ranges].first = first;
+	ranges[n_ranges].last = last;
+	n_ranges++;
+	return 0;
+}
+
+static int is_zero(const char *buf, size_t len)
+{
+	const unsigned long *p = (const unsigned long *) buf;
+	size_t i;
+
+	for (i = 0; i < len / sizeof(*p); i++)
+		if (p[i])
+			return 0;
+
+	for (i = i * sizeof(*p); i < len; i++)
+		if (buf[i])
+			return 0;
+
+	return 1;
+}
+
+/*
+ * copy len bytes from in at in_ofs to out at out_ofs. Holes in the input
+ * are skipped and blocks that read back as zero are not written, so they
+ * stay holes in the (freshly created) output file.
+ */
+static int copy_sparse(int in, off_t in_ofs, int out, off_t out_ofs, off_t len, char *buf)
+{
+	off_t end = in_ofs + len;
+	off_t data, hole;
+	ssize_t r;
+	size_t blk, n, run;
+
+	while (in_ofs < end) {
+		data = hole = -1;
+#ifdef SEEK_DATA
+		data = lseek(in, in_ofs, SEEK_DATA);
+		if (data < 0 && errno == ENXIO)
+			break;
+		if (data >= 0)
+			hole = lseek(in, data, SEEK_HOLE);
+#endif
+		if (data < 0 || hole < 0) {
+			data = in_ofs;
+			hole = end;
+		}
+		if (data >= end)
+			break;
+		if (hole > end)
+			hole = end;
+
+		out_ofs += data - in_ofs;
+		in_ofs = data;
+
+		while (in_ofs < hole) {
+			n = (hole - in_ofs < COPY_BUF) ? hole - in_ofs : COPY_BUF;
+			r = pread(in, buf, n, in_ofs);
+			if (r <= 0) {
+				fprintf(stderr, "read failed.\n");
+				return -1;
+			}
+
+			/* write out runs of non-zero blocks */
+			for (blk = 0; blk < (size_t) r; blk += run) {
+				n = ((size_t) r - blk < MAP_BLOCK) ? (size_t) r - blk : MAP_BLOCK;
+				if (is_zero(buf + blk, n)) {
+					run = n;
+					continue;
+				}
+
+				for (run = n; blk + run < (size_t) r; run += n) {
+					n = ((size_t) r - blk - run < MAP_BLOCK) ? (size_t) r - blk - run : MAP_BLOCK;
+					if (is_zero(buf + blk + run, n))
+						break;
+				}
+
+				if (pwrite(out, buf + blk, run, out_ofs + blk) != (ssize_t) run) {
+					fprintf(stderr, "write failed.\n");
+					return -1;
+				}
+				if (map_add(out_ofs + blk, run))
+					return -1;
+			}
+
+			in_ofs += r;
+			out_ofs += r;
+		}
+	}
+
+	/* keep the file as long as the data that was placed in it */
+	if (out_ofs + (end - in_ofs) > image_size)
+		image_size = out_ofs + (end - in_ofs);
+
+	return 0;
+}
+
+/* place a partition image at its offset in the output file */
+static int place_image(int fd, int nr, long start, long len, char *buf)
+{
+	struct stat st;
+	int in, ret;
+
+	if ((in = open(parts[nr].image, O_RDONLY)) < 0) {
+		fprintf(stderr, "Can't open image file '%s'\n", parts[nr].image);
+		return -1;
+	}
+
+	if (fstat(in, &st) < 0) {
+		close(in);
+		return -1;
+	}
+
+	if (st.st_size > len) {
+		fprintf(stderr, "Image '%s' too big for partition %d\n", parts[nr].image, nr);
+		close(in);
+		return -1;
+	}
+
+	ret = copy_sparse(in, 0, fd, start, st.st_size, buf);
+	close(in);
+	return ret;
+}
+
+/* write the list of populated blocks for sparse-aware flashing tools */
+static int write_map(void)
+{
+	unsigned long mapped = 0;
+	FILE *f;
+	int i;
+
+	if (!(f = fopen(mapname, "w"))) {
+		fprintf(stderr, "Can't open block map file '%s'\n", mapname);
+		return -1;
+	}
+
+	for (i = 0; i < n_ranges; i++)
+		mapped += ranges[i].last - ranges[i].first + 1;
+
+	fprintf(f, "# ptgen block map: ranges of blocks holding data, all others are zero\n");
+	fprintf(f, "ImageSize %lld\n", (long long) image_size);
+	fprintf(f, "BlockSize %d\n", MAP_BLOCK);
+	fprintf(f, "BlocksCount %lld\n", (long long) (image_size + MAP_BLOCK - 1) / MAP_BLOCK);
+	fprintf(f, "MappedBlocksCount %lu\n", mapped);
+	for (i = 0; i < n_ranges; i++)
+		fprintf(f, "%lu-%lu\n", ranges[i].first, ranges[i].last);
+
+	if (fclose(f)) {
+		fprintf(stderr, "write failed.\n");
+		return -1;
+	}
+	return 0;
+}
+
 /* check the partition sizes and write the partition table */
 static int gen_ptable(int nr)
 {
 	struct pte pte[4];
 	unsigned long sect = 0; 
 	int i, fd, ret = -1, start, len;
+	long pstart[4], plen[4];
+	char *buf = NULL;
 
 	memset(pte, 0, sizeof(struct pte) * 4);
 	for (i = 0; i < nr; i++) {
@@ -150,8 +351,12 @@ static int gen_ptable(int nr)
 		to_chs(start + len - 1, pte[i].chs_end);
 		if (verbose)
 			fprintf(stderr, "Partition %d: start=%ld, end=%ld, size=%ld\n", i, (long) start * 512, ((long) start + (long) len) * 512, (long) len * 512);
-		printf("%ld\n", ((long) start * 512));
-		printf("%ld\n", ((long) len * 512));
+		if (!assemble) {
+			printf("%ld\n", ((long) start * 512));
+			printf("%ld\n", ((long) len * 512));
+		}
+		pstart[i] = (long) start * 512;
+		plen[i] = (long) len * 512;
 	}
 
 	if ((fd = open(filename, O_WRONLY|O_CREAT|O_TRUNC, 0644)) < 0) {
@@ -169,26 +374,52 @@ static int gen_ptable(int nr)
 		fprintf(stderr, "write failed.\n");
 		goto fail;
 	}
-	
+	if (map_add(0, 512))
+		goto fail;
+
+	for (i = 0; i < nr; i++) {
+		if (!parts[i].image)
+			continue;
+
+		if (!buf && !(buf = malloc(COPY_BUF))) {
+			fprintf(stderr, "out of memory\n");
+			goto fail;
+		}
+
+		if (place_image(fd, i, pstart[i], plen[i], buf))
+			goto fail;
+	}
+
+	/* trailing zeros of the last image are a hole, not written data */
+	if (ftruncate(fd, image_size) < 0) {
+		fprintf(stderr, "write failed.\n");
+		goto fail;
+	}
+
+	if (mapname && write_map())
+		goto fail;
+
 	ret = 0;
 fail:
+	free(buf);
 	close(fd);
 	return ret;
 }
 
 static void usage(char *prog)
 {
-	fprintf(stderr,	"Usage: %s [-v] -h <heads> -s <sectors> -o <outputfile> [-a 0..4] [-l <align kB>] [[-t <type>] -p <size>...] \n", prog);
+	fprintf(stderr,	"Usage: %s [-v] -h <heads> -s <sectors> -o <outputfile> [-a 0..4] [-l <align kB>] [-m <blockmap>] [[-t <type>] [-i <image>] -p <size>...] \n", prog);
 	exit(1);
 }
 
 int main (int argc, char **argv)
 {
 	char type = 0x83;
-	int ch;
+	char *image = NULL;
+	int ch, i;
 	int part = 0;
 
-	while ((ch = getopt(argc, argv, "h:s:p:a:t:o:vl:")) != -1) {
+	while ((ch = getopt(argc, argv, "h:s:p:a:t:o:vl:i:m:")) != -1) {
 		switch (ch) {
 		case 'o':
 			filename = optarg;
@@ -208,7 +439,15 @@ int main (int argc, char **argv)
 				exit(1);
 			}
 			parts[part].size = to_kbytes(optarg);
+			parts[part].image = image;
 			parts[part++].type = type;
+			image = NULL;
+			break;
+		case 'i':
+			image = optarg;
+			break;
+		case 'm':
+			mapname = optarg;
 			break;
 		case 't':
 			type = (char) strtoul(optarg, NULL, 16);
@@ -229,6 +468,13 @@ int main (int argc, char **argv)
 	argc -= optind;
 	if (argc || (heads <= 0) || (sectors <= 0) || !filename) 
 		usage(argv[0]);
+
+	/* the offsets are only printed for scripts that copy the data in */
+	for (i = 0; i < part; i++)
+		if (parts[i].image)
+			assemble = 1;
+	if (mapname)
+		assemble = 1;
 	
 	return gen_ptable(part);
 }
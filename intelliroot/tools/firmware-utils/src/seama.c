@@ -40,22 +40,29 @@
 
 #include <stdio.h>
 #include <stdint.h>
+#include <stddef.h>
 #include <stdlib.h>
 #include <stdarg.h>
 #include <sys/types.h>
 #include <sys/stat.h>
+#include <sys/mman.h>
+#include <fcntl.h>
 #include <unistd.h>
 #include <string.h>
 #include <arpa/inet.h>
+#ifdef __linux__
+#include <sys/sendfile.h>
+#endif
 
 #include "md5.h"
 #include "seama.h"
 
 #define PROGNAME			"seama"
-#define VERSION				"0.20"
+#define VERSION				"0.21"
 #define MAX_SEAMA_META_SIZE	1024
 #define MAX_META			128
 #define MAX_IMAGE			128
+#define MAX_SECTION			128
 
 extern int optind;
 extern char * optarg;
@@ -139,42 +146,18 @@ static int parse_args(int argc, char * argv[])
 
 /*******************************************************************/
 
-static size_t calculate_digest(FILE * fh, size_t size, uint8_t * digest)
-{
-	MD5_CTX ctx;
-	size_t bytes_left, bytes_read, i;
-	uint8_t buf[MAX_SEAMA_META_SIZE];
-
-	bytes_left = size ? size : sizeof(buf);
-	bytes_read = 0;
-
-	MD5_Init(&ctx);
-	while (!feof(fh) && !ferror(fh) && bytes_left > 0)
-	{
-		i = bytes_left < sizeof(buf) ? bytes_left : sizeof(buf);
-		i = fread(buf, sizeof(char), i, fh);
-		if (i > 0)
-		{
-			MD5_Update(&ctx, buf, i);
-			bytes_read += i;
-		}
-		if (size) bytes_left -= i;
-	}
-	MD5_Final(digest, &ctx);
-	return bytes_read;
-}
-
-#define READ_BUFF_SIZE 8*1024
-static size_t copy_file(FILE * to, FILE * from)
+#define READ_BUFF_SIZE 64*1024
+static size_t copy_file(FILE * to, FILE * from, MD5_CTX * ctx)
 {
 	size_t i, fsize = 0;
-	uint8_t buf[READ_BUFF_SIZE];
+	static uint8_t buf[READ_BUFF_SIZE];
 
 	while (!feof(from) && !ferror(from))
 	{
 		i = fread(buf, sizeof(uint8_t), READ_BUFF_SIZE, from);
 		if (i > 0)
 		{
+			if (ctx) MD5_Update(ctx, buf, i);
 			fsize += i;
 			fwrite(buf, sizeof(uint8_t), i, to);
 		}
@@ -182,91 +165,182 @@ static size_t copy_file(FILE * to, FILE * from)
 	return fsize;
 }
 
-static int verify_seama(const char * fname, int msg)
+/* A SEAMA file is mapped once and its chain of headers is walked into an
+ * index, so dump, verify and extract never re-read or re-parse the file. */
+typedef struct seama_section seamasec_t;
+struct seama_section
 {
-	FILE * fh = NULL;
-	struct stat st;
-	seamahdr_t shdr;
-	uint8_t checksum[16];
-	uint8_t digest[16];
-	uint8_t buf[MAX_SEAMA_META_SIZE];
-	size_t msize, isize, i;
-	int ret = -1;
+	size_t			msize;		/* size of the META data */
+	size_t			isize;		/* size of the image, 0 for a seal header */
+	const uint8_t *	checksum;	/* MD5 digest, NULL when isize is 0 */
+	const char *	meta;		/* META data */
+	size_t			offset;		/* file offset of the image */
+};
+
+typedef struct seama_file seamafile_t;
+struct seama_file
+{
+	int				fd;
+	const uint8_t *	map;
+	size_t			size;
+	int				count;
+	const char *	stop;		/* why the walk ended before EOF */
+	seamasec_t		sec[MAX_SECTION];
+};
+
+static void close_seama(seamafile_t * sf)
+{
+	if (sf->map) munmap((void *)sf->map, sf->size);
+	if (sf->fd >= 0) close(sf->fd);
+	sf->map = NULL;
+	sf->fd = -1;
+}
 
-#define ERRBREAK(fmt, args...) { if (msg) printf(fmt, ##args); break; }
+static int open_seama(const char * fname, seamafile_t * sf)
+{
+	struct stat st;
+	const seamahdr_t * shdr;
+	seamasec_t * sec;
+	size_t pos = 0;
+	void * map;
+
+	memset(sf, 0, sizeof(*sf));
+	sf->fd = open(fname, O_RDONLY);
+	if (sf->fd < 0) return -1;
+	if (fstat(sf->fd, &st) < 0)
+	{
+		close_seama(sf);
+		return -1;
+	}
+	sf->size = st.st_size;
+	if (sf->size > 0)
+	{
+		map = mmap(NULL, sf->size, PROT_READ, MAP_SHARED, sf->fd, 0);
+		if (map == MAP_FAILED)
+		{
+			close_seama(sf);
+			return -1;
+		}
+		madvise(map, sf->size, MADV_SEQUENTIAL);
+		sf->map = map;
+	}
 
-	do
+	while (sf->size - pos >= sizeof(seamahdr_t))
 	{
-		if (stat(fname, &st) < 0)				ERRBREAK("Unable to get the info of '%s'\n",fname);
-		if ((fh = fopen(fname, "r+"))==NULL)	ERRBREAK("Unable to open '%s' for reading!\n",fname);
+		if (sf->count == MAX_SECTION) { sf->stop = "Too many SEAMA sections!\n"; break; }
+
+		/* Check the magic number */
+		shdr = (const seamahdr_t *)(sf->map + pos);
+		if (shdr->magic != htonl(SEAMA_MAGIC)) { sf->stop = "Invalid SEAMA magic. Probably no more SEAMA!\n"; break; }
 
-		/* Dump SEAMA header */
-		if (msg) printf("FILE - %s (%d bytes)\n", fname, (int)st.st_size);
+		sec = &sf->sec[sf->count];
+		sec->isize = ntohl(shdr->size);
+		sec->msize = ntohs(shdr->metasize);
+		pos += sizeof(seamahdr_t);
 
-		/* SEAMA */
-		while (!feof(fh) && !ferror(fh))
+		/* The checksum exist only if size is greater than zero. */
+		if (sec->isize > 0)
 		{
-			/* read header */
-			if (fread(&shdr, sizeof(shdr), 1, fh) != 1) break;
+			if (sf->size - pos < 16) { sf->stop = "Error reading checksum !\n"; break; }
+			sec->checksum = sf->map + pos;
+			pos += 16;
+		}
 
-			/* Check the magic number */
-			if (shdr.magic != htonl(SEAMA_MAGIC)) ERRBREAK("Invalid SEAMA magic. Probably no more SEAMA!\n");
+		if (sec->msize > MAX_SEAMA_META_SIZE) { sf->stop = "META data in SEAMA header is too large!\n"; break; }
+		if (sf->size - pos < sec->msize) { sf->stop = "Unable to read SEAMA META data!\n"; break; }
+		sec->meta = (const char *)(sf->map + pos);
+		pos += sec->msize;
 
-			/* Get the size */
-			isize = ntohl(shdr.size);
-			msize = ntohs(shdr.metasize);
+		sec->offset = pos;
+		if (sf->size - pos < sec->isize) { sf->stop = "SEAMA image is truncated!\n"; break; }
+		pos += sec->isize;
 
-			/* The checksum exist only if size is greater than zero. */
-			if (isize > 0)
-			{
-				if (fread(checksum, sizeof(checksum), 1, fh) != 1)
-					ERRBREAK("Error reading checksum !\n");
-			}
+		sf->count++;
+	}
+	return 0;
+}
+
+/* Copy META data out of the mapping so the strings are terminated. */
+static size_t get_meta(const seamasec_t * sec, char * buf)
+{
+	memcpy(buf, sec->meta, sec->msize);
+	buf[sec->msize] = '\0';
+	return sec->msize;
+}
+
+static int check_seama(const seamafile_t * sf, int msg)
+{
+	const seamasec_t * sec;
+	char buf[MAX_SEAMA_META_SIZE + 1];
+	uint8_t digest[16];
+	MD5_CTX ctx;
+	size_t msize, i;
+	int s, ret = -1;
 
-			/* Check the META size. */
-			if (msize > sizeof(buf)) ERRBREAK("META data in SEAMA header is too large!\n");
+	for (s = 0; s < sf->count; s++)
+	{
+		sec = &sf->sec[s];
+		msize = get_meta(sec, buf);
 
-			/* Read META data. */
-			if (fread(buf, sizeof(char), msize, fh) != msize)
-				ERRBREAK("Unable to read SEAMA META data!\n");
+		/* dump header */
+		if (msg)
+		{
+			printf("SEAMA ==========================================\n");
+			printf("  magic      : %08x\n", SEAMA_MAGIC);
+			printf("  meta size  : %d bytes\n", (int)msize);
+			for (i=0; i<msize; i+=(strlen(&buf[i])+1))
+				printf("  meta data  : %s\n", &buf[i]);
+			printf("  image size : %d bytes\n", (int)sec->isize);
+		}
 
-			/* dump header */
-			if (msg)
-			{
-				printf("SEAMA ==========================================\n");
-				printf("  magic      : %08x\n", ntohl(shdr.magic));
-				printf("  meta size  : %d bytes\n", msize);
-				for (i=0; i<msize; i+=(strlen((const char *)&buf[i])+1))
-					printf("  meta data  : %s\n", &buf[i]);
-				printf("  image size : %d bytes\n", isize);
-			}
+		if (sec->isize == 0) continue;
 
-			/* verify checksum */
-			if (isize > 0)
-			{
-				if (msg)
-				{
-					printf("  checksum   : ");
-					for (i=0; i<16; i++) printf("%02X", checksum[i]);
-					printf("\n");
-				}
-
-				/* Calculate the checksum */
-				calculate_digest(fh, isize, digest);
-				if (msg)
-				{
-					printf("  digest     : ");
-					for (i=0; i<16; i++) printf("%02X", digest[i]);
-					printf("\n");
-				}
-
-				if (memcmp(checksum, digest, 16)!=0) ERRBREAK("!!ERROR!! checksum error !!\n");
-				ret = 0;
-			}
+		/* verify checksum */
+		if (msg)
+		{
+			printf("  checksum   : ");
+			for (i=0; i<16; i++) printf("%02X", sec->checksum[i]);
+			printf("\n");
+		}
+
+		MD5_Init(&ctx);
+		MD5_Update(&ctx, sf->map + sec->offset, sec->isize);
+		MD5_Final(digest, &ctx);
+		if (msg)
+		{
+			printf("  digest     : ");
+			for (i=0; i<16; i++) printf("%02X", digest[i]);
+			printf("\n");
 		}
-		if (msg) printf("================================================\n");
-	} while (0);
-	if (fh) fclose(fh);
+
+		if (memcmp(sec->checksum, digest, 16)!=0)
+		{
+			if (msg) printf("!!ERROR!! checksum error !!\n");
+			return -1;
+		}
+		ret = 0;
+	}
+	if (msg && sf->stop) printf("%s", sf->stop);
+	return ret;
+}
+
+static int verify_seama(const char * fname, int msg)
+{
+	seamafile_t sf;
+	int ret;
+
+	if (open_seama(fname, &sf) < 0)
+	{
+		if (msg) printf("Unable to open '%s' for reading!\n",fname);
+		return -1;
+	}
+
+	/* Dump SEAMA header */
+	if (msg) printf("FILE - %s (%d bytes)\n", fname, (int)sf.size);
+	ret = check_seama(&sf, msg);
+	if (msg) printf("================================================\n");
+
+	close_seama(&sf);
 	return ret;
 }
 
@@ -354,7 +428,7 @@ static void seal_files(const char * file)
 			ifh = fopen(o_images[i], "r+");
 			if (ifh)
 			{
-				copy_file(fh, ifh);
+				copy_file(fh, ifh, NULL);
 				fclose(ifh);
 			}
 		}
@@ -370,32 +444,42 @@ static void pack_files(void)
 	size_t i, fsize;
 	char filename[512];
 	uint8_t digest[16];
+	MD5_CTX ctx;
+	struct stat st;
+	uint32_t size;
 
 	for (i=0; i<o_isize; i++)
 	{
 		/* Open the input file. */
 		ifh = fopen(o_images[i], "r+");
-		if (ifh)
+		if (ifh && fstat(fileno(ifh), &st) == 0)
 		{
-			fsize = calculate_digest(ifh, 0, digest);
-			verbose("file size (%s) : %d\n", o_images[i], fsize);
-			rewind(ifh);
-
 			/* Open the output file. */
 			sprintf(filename, "%s.seama", o_images[i]);
 			fh = fopen(filename, "w+");
 			if (fh)
 			{
-				write_seama_header(fh, o_meta, o_msize, fsize);
+				/* Hash the image while copying it, then patch the
+				 * header and the checksum in place. */
+				memset(digest, 0, sizeof(digest));
+				write_seama_header(fh, o_meta, o_msize, st.st_size);
 				write_checksum(fh, digest);
 				write_meta_data(fh, o_meta, o_msize);
-				copy_file(fh, ifh);
+				MD5_Init(&ctx);
+				fsize = copy_file(fh, ifh, &ctx);
+				MD5_Final(digest, &ctx);
+				verbose("file size (%s) : %d\n", o_images[i], fsize);
+				fseek(fh, offsetof(seamahdr_t, size), SEEK_SET);
+				size = htonl(fsize);
+				fwrite(&size, sizeof(size), 1, fh);
+				write_checksum(fh, digest);
 				fclose(fh);
 			}
 			fclose(ifh);
 		}
 		else
 		{
+			if (ifh) fclose(ifh);
 			printf("Unable to open image file '%s'\n",o_images[i]);
 		}
 	}
@@ -418,14 +502,54 @@ static int match_meta(const char * meta, size_t size)
 }
 
 
+static int write_image(const char * output, const seamafile_t * sf, const seamasec_t * sec)
+{
+	size_t left = sec->isize;
+	ssize_t n;
+	int ofd;
+#ifdef __linux__
+	off_t off = sec->offset;
+#endif
+
+	ofd = open(output, O_WRONLY | O_CREAT | O_TRUNC, 0666);
+	if (ofd < 0)
+	{
+		printf("SEAMA: unable to open '%s' for writting.\n",output);
+		return -1;
+	}
+#ifdef __linux__
+	/* Let the kernel move the image straight out of the page cache. */
+	while (left > 0)
+	{
+		n = sendfile(ofd, sf->fd, &off, left);
+		if (n <= 0) break;
+		left -= n;
+	}
+#endif
+	/* No sendfile, or it refused the descriptors: write from the mapping. */
+	while (left > 0)
+	{
+		n = write(ofd, sf->map + sec->offset + (sec->isize - left), left);
+		if (n <= 0) break;
+		left -= n;
+	}
+	close(ofd);
+
+	if (left > 0)
+	{
+		printf("SEAMA: error writting '%s'.\n",output);
+		return -1;
+	}
+	return 0;
+}
+
 static void extract_file(const char * output)
 {
-	FILE * ifh = NULL;
-	FILE * ofh = NULL;
-	size_t msize, isize, i, m;
-	seamahdr_t shdr;
-	uint8_t buf[MAX_SEAMA_META_SIZE];
-	int done = 0;
+	seamafile_t sf;
+	const seamasec_t * sec;
+	char buf[MAX_SEAMA_META_SIZE + 1];
+	size_t i;
+	int s, done = 0;
 
 	/* We need meta for searching the target image. */
 	if (o_msize == 0)
@@ -435,73 +559,33 @@ static void extract_file(const char * output)
 	}
 
 	/* Walk through each input file */
-	for (i = 0; i < o_isize; i++)
+	for (i = 0; i < o_isize && !done; i++)
 	{
-		/* verify the input file */
-		if (verify_seama(o_images[i], 0) < 0)
+		/* index and verify the input file */
+		if (open_seama(o_images[i], &sf) < 0)
 		{
 			printf("SEAMA: '%s' is not a seama file !\n", o_images[i]);
 			continue;
 		}
-		/* open the input file */
-		ifh  = fopen(o_images[i], "r");
-		if (!ifh) continue;
-		/* read file */
-		while (!feof(ifh) && !ferror(ifh))
+		if (check_seama(&sf, 0) < 0)
 		{
-			/* read header */
-			fread(&shdr, sizeof(shdr), 1, ifh);
-			if (shdr.magic != htonl(SEAMA_MAGIC)) break;
-			/* Get the size */
-			isize = ntohl(shdr.size);
-			msize = ntohs(shdr.metasize);
-			if (isize == 0)
-			{
-				while (msize > 0)
-				{
-					m = fread(buf, sizeof(char), (msize < MAX_SEAMA_META_SIZE) ? msize : MAX_SEAMA_META_SIZE, ifh);
-					if (m <= 0) break;
-					msize -= m;
-				}
-				continue;
-			}
-			/* read checksum */
-			fread(buf, sizeof(char), 16, ifh);
-			if (msize > 0)
-			{
-				/* read META */
-				fread(buf, sizeof(char), msize, ifh);
-				if (match_meta((const char *)buf, msize))
-				{
-					printf("SEAMA: found image @ '%s', image size: %d\n", o_images[i], isize);
-					/* open output file */
-					ofh = fopen(output, "w");
-					if (!ofh) printf("SEAMA: unable to open '%s' for writting.\n",output);
-					else
-					{
-						while (isize > 0)
-						{
-							m = fread(buf, sizeof(char), (isize < MAX_SEAMA_META_SIZE) ? isize : MAX_SEAMA_META_SIZE, ifh);
-							if (m <= 0) break;
-							fwrite(buf, sizeof(char), m, ofh);
-							isize -= m;
-						}
-						fclose(ofh);
-					}
-					done++;
-					break;
-				}
-			}
-			while (isize > 0)
-			{
-				m = fread(buf, sizeof(char), (isize < MAX_SEAMA_META_SIZE) ? isize : MAX_SEAMA_META_SIZE, ifh);
-				if (m <= 0) break;
-				isize -= m;
-			}
+			printf("SEAMA: '%s' is not a seama file !\n", o_images[i]);
+			close_seama(&sf);
+			continue;
+		}
+
+		for (s = 0; s < sf.count; s++)
+		{
+			sec = &sf.sec[s];
+			if (sec->isize == 0 || sec->msize == 0) continue;
+			if (!match_meta(buf, get_meta(sec, buf))) continue;
+
+			printf("SEAMA: found image @ '%s', image size: %d\n", o_images[i], (int)sec->isize);
+			write_image(output, &sf, sec);
+			done++;
+			break;
 		}
-		/* close the file. */
-		fclose(ifh);
-		if (done) break;
+		close_seama(&sf);
 	}
 	return;
 }
@@ -1,15 +1,26 @@
 #include <stdio.h>
-#include <ctype.h>
+#include <stdlib.h>
 #include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <sys/mman.h>
+#include <sys/time.h>
+#include <sys/uio.h>
 
 //Rev 0.1 Original
 // 8 Jan 2001  MJH  Added code to write data to Binary file
 //                  note: outputfile is name.bin, where name is first part
 //                  of input file.  ie tmp.rec -> tmp.bin
 //
-//   srec2bin <input SREC file> <Output Binary File> <If Present, Big Endian>
+//   srec2bin [-v] [-r] <input SREC file> <Output Binary File> <If Present, Big Endian>
 //
-//   TAG   
+//   -v   report progress and throughput
+//   -r   write a raw image instead of tagged records; the first data
+//        record is offset 0 and gaps between records are left as holes
+//
+//   TAG
 //        bit32u TAG_BIG     = 0xDEADBE42;
 //        bit32u TAG_LITTLE  = 0xFEEDFA42;
 //
@@ -28,16 +39,14 @@
 //  Note : If Length == 0, Address will be Program Start
 //
 //
-//  
+//
 //
 //
 
 #define MajRevNum 0
-#define MinRevNum 2
+#define MinRevNum 3
 
 
-#define EndianSwitch(x) ((x >> 24) | (x << 24) | ((x << 8) & (0x00FF0000)) | ((x >> 8) & (0x0000FF00)) )
-
 typedef unsigned char bit8u;
 typedef unsigned int bit32u;
 typedef int bit32;
@@ -46,49 +55,51 @@ typedef int bit32;
 #define TRUE (!FALSE)
 
 
-bit32u CheckSum;
-int RecStart;
 int debug;
 int verbose;
+int RawImage;
 
-FILE *OpenOutputFile( char *Name );
-FILE *fOut;
-bit32u RecLength=0;
-
+int fOut;
 bit32u AddressCurrent;
 
-bit32u gh(char *cp,int nibs);
-
 int BigEndian;
 
-int inputline;
-
-// char buf[16*1024];
-
-char buffer[2048];
-char *cur_ptr;
 int cur_line=0;
-int cur_len=0;
 
 int s1s2s3_total=0;
 
-bit32u PBVal;
-int    PBValid;
-bit32u PBAdr;
+// Hex digit values, -1 for anything that is not a hex digit
+signed char HexVal[256];
 
+// The record being built: contiguous data is collected here and written
+// out in one go when the next record starts
+int    RecStart;
+bit32u RecAddress;
+bit8u *RecData;
+bit32u RecLength=0;
+bit32u RecSize=0;
 
-void dumpfTell(char *s, bit32u Value)
-{
-    int Length;
-    Length = (int) RecLength;
-    if (debug)
-          printf("[%s  ] ftell()[0x%08lX] Length[0x%4X] Length[%4d] Value[0x%08x]\n",
-                s, ftell(fOut), Length, Length, Value);
-}
+// Raw image state
+int    RawBaseValid;
+bit32u RawBase;
 
-void DispHex(bit32u Hex)
+// Statistics for -v
+bit32u RecordsOut;
+unsigned long BytesOut;
+
+
+void HexInit(void)
 {
-//    printf("%X", Hex);
+    int i;
+
+    memset(HexVal, -1, sizeof(HexVal));
+    for (i = 0; i < 10; i++)
+        HexVal['0' + i] = i;
+    for (i = 0; i < 6; i++)
+    {
+        HexVal['A' + i] = 10 + i;
+        HexVal['a' + i] = 10 + i;
+    }
 }
 
 void WaitDisplay(void)
@@ -107,32 +118,69 @@ void WaitDisplay(void)
 }
 
 
-void binOut32 ( bit32u Data )
+void binPut32 ( bit8u *p, bit32u Data )
 {
-// On UNIX machine all 32bit writes need ENDIAN switched
-//    Data = EndianSwitch(Data);
-//    fwrite( &Data, sizeof(bit32u), 1, fOut);
+// Records are always written little endian, only the TAG tells them apart
 
-   char sdat[4];
    int i;
 
    for(i=0;i<4;i++)
-    sdat[i]=(char)(Data>>(i*8));
-   fwrite( sdat, 1, 4, fOut);
-   dumpfTell("Out32" , Data);
+    p[i]=(bit8u)(Data>>(i*8));
 }
 
-// Only update RecLength on Byte Writes
-// All 32 bit writes will be for Length etc
+int binWrite ( struct iovec *iov, int cnt )
+{
+    ssize_t n;
+
+    while (cnt > 0)
+    {
+        n = writev(fOut, iov, cnt);
+        if (n < 0)
+            return(FALSE);
+
+        while (cnt > 0 && (size_t) n >= iov->iov_len)
+        {
+            n -= iov->iov_len;
+            iov++;
+            cnt--;
+        }
+        if (cnt > 0)
+        {
+            iov->iov_base = (char *) iov->iov_base + n;
+            iov->iov_len -= n;
+        }
+    }
+    return(TRUE);
+}
 
-void binOut8 ( bit8u Data )
+int binRawWrite ( bit32u Address, const bit8u *Data, bit32u Length )
 {
-    int n;
-    dumpfTell("B4Data" , (bit32u) (Data & 0xFF) );
-    n = fwrite( &Data, sizeof(bit8u), 1, fOut);
-    if (n != 1)
-        printf("Error in writing %X for Address 0x%8X\n", Data, AddressCurrent);
-    RecLength += 1;
+    off_t  pos;
+    ssize_t n;
+
+    if (!RawBaseValid)
+    {
+        RawBase = Address;
+        RawBaseValid = TRUE;
+    }
+    if (Address < RawBase)
+    {
+        printf("\nERROR: Address 0x%08X below image base 0x%08X.", Address, RawBase);
+        return(FALSE);
+    }
+
+    // Gaps between records are skipped, leaving holes in the output
+    pos = (off_t) (Address - RawBase);
+    while (Length > 0)
+    {
+        n = pwrite(fOut, Data, Length, pos);
+        if (n <= 0)
+            return(FALSE);
+        Data += n;
+        Length -= n;
+        pos += n;
+    }
+    return(TRUE);
 }
 
 //  Currently ONLY used for outputting Program Start
@@ -140,204 +188,161 @@ void binOut8 ( bit8u Data )
 void binRecStart(bit32u Address)
 {
     RecLength      = 0;
-    CheckSum       = Address;
+    RecAddress     = Address;
     RecStart       = TRUE;
 
     if (debug)
-          printf("[RecStart] CheckSum[0x%08X] Length[%4d] Address[0x%08X]\n",
-                CheckSum, RecLength, Address);
-
-
-    dumpfTell("RecLength", RecLength);
-    binOut32( RecLength );
-    dumpfTell("Address", Address);
-    binOut32( Address );
+          printf("[RecStart] Address[0x%08X]\n", Address);
 }
 
-void binRecEnd(void)
+int binRecEnd(void)
 {
-    long RecEnd;
+    bit32u CheckSum, i;
+    bit8u hdr[8], sum[4];
+    struct iovec iov[3];
 
     if (!RecStart)   //  if no record started, do not end it
     {
-        return;
+        return(TRUE);
     }
 
     RecStart = FALSE;
 
+    if (RawImage)
+    {
+        if (verbose && !RecLength)
+            printf("[Program Start 0x%08X]\n", RecAddress);
+        if (RecLength && !binRawWrite(RecAddress, RecData, RecLength))
+            goto WRITE_ERROR;
+        RecordsOut++;
+        BytesOut += RecLength;
+        return(TRUE);
+    }
 
-    RecEnd = ftell(fOut);         // Save Current position
-
-    if (debug)
-          printf("[RecEnd  ] CheckSum[0x%08X] Length[%4d] Length[0x%X] RecEnd[0x%08lX]\n",
-                CheckSum, RecLength, RecLength, RecEnd);
-
-    fseek( fOut, -((long) RecLength), SEEK_CUR);  // move back Start Of Data
-
-    dumpfTell("Data   ", -1);
-
-    fseek( fOut, -4, SEEK_CUR);  // move back Start Of Address
-
-    dumpfTell("Address   ", -1);
-
-    fseek( fOut, -4, SEEK_CUR);  // move back Start Of Length
-
-    dumpfTell("Length   ", -1);
+    CheckSum = RecAddress + RecLength;
+    for (i = 0; i < RecLength; i++)
+        CheckSum += RecData[i];
 
-    binOut32( RecLength );
+    CheckSum =  ~CheckSum + 1;  // Two's complement
 
-    fseek( fOut, RecEnd, SEEK_SET);  // move to end of Record
+    if (debug)
+          printf("[RecEnd  ] CheckSum[0x%08X] Length[%4d] Length[0x%X]\n",
+                CheckSum, RecLength, RecLength);
 
-    CheckSum += RecLength;
+    binPut32(hdr, RecLength);
+    binPut32(hdr + 4, RecAddress);
+    binPut32(sum, CheckSum);
 
-    CheckSum =  ~CheckSum + 1;  // Two's complement
+    iov[0].iov_base = hdr;
+    iov[0].iov_len  = sizeof(hdr);
+    iov[1].iov_base = RecData;
+    iov[1].iov_len  = RecLength;
+    iov[2].iov_base = sum;
+    iov[2].iov_len  = sizeof(sum);
+    if (!binWrite(iov, 3))
+        goto WRITE_ERROR;
 
-    binOut32( CheckSum );
+    RecordsOut++;
+    BytesOut += RecLength;
 
     if (verbose)
         printf("[Created Record of %d Bytes with CheckSum [0x%8X]\n", RecLength, CheckSum);
+    return(TRUE);
+
+WRITE_ERROR:
+    printf("\nERROR: Writing record for Address 0x%08X.", RecAddress);
+    return(FALSE);
 }
 
-void binRecOutProgramStart(bit32u Address)
+int binRecOutProgramStart(bit32u Address)
 {
     if (Address != (AddressCurrent+1))
     {
-        binRecEnd();
+        if (!binRecEnd())
+            return(FALSE);
         binRecStart(Address);
     }
     AddressCurrent = Address;
+    return(TRUE);
 }
-void binRecOutByte(bit32u Address, bit8u Data)
+
+int binRecOutBytes(bit32u Address, const bit8u *Data, bit32u Length)
 {
-    //  If Address is one after Current Address, output Byte
+    //  If Address is one after Current Address, append the data
     //  If not, close out last record, update Length, write checksum
     //  Then Start New Record, updating Current Address
 
+    if (!Length)
+        return(TRUE);
+
     if (Address != (AddressCurrent+1))
     {
-        binRecEnd();
+        if (!binRecEnd())
+            return(FALSE);
         binRecStart(Address);
     }
-    AddressCurrent = Address;
-    CheckSum += Data;
-    binOut8( Data );
-}
 
-//=============================================================================
-//       SUPPORT FUNCTIONS
-//=============================================================================
-int readline(FILE *fil,char *buf,int len)
-{
-    int rlen;
-    
-    rlen=0;
-    if (len==0)  return(0);
-    while(1)
+    if (RecLength + Length > RecSize)
     {
-      if (cur_len==0)
-      {
-        cur_len=fread(buffer, 1, sizeof(buffer), fil);
-        if (cur_len==0)
-        {
-          if (rlen)
-          {
-            *buf=0;
-            return(rlen);
-          }
-          return(-1);
-        }
-        cur_ptr=buffer;
-      }
-      if (cur_len)
-      {
-        if (*cur_ptr=='\n')
+        bit8u *p;
+        bit32u size = RecSize ? RecSize : 64 * 1024;
+
+        while (size < RecLength + Length)
+            size *= 2;
+        p = realloc(RecData, size);
+        if (!p)
         {
-          *buf=0;
-          cur_ptr++;
-          cur_len--;
-          return(rlen);
+            printf("\nERROR: Out of memory for record at Address 0x%08X.", RecAddress);
+            return(FALSE);
         }
-         else
-         {
-           if ((len>1)&&(*cur_ptr!='\r'))
-           {
-             *buf++=*cur_ptr++;
-             len--;
-           }
-           else
-             cur_ptr++;
-
-           rlen++;
-           cur_len--;
-         }
-      }
-      else
-      {
-        *buf=0;
-        cur_ptr++;
-        cur_len--;
-        return(rlen);
-      }
+        RecData = p;
+        RecSize = size;
     }
+    memcpy(RecData + RecLength, Data, Length);
+    RecLength += Length;
+    AddressCurrent = Address + Length - 1;
+    return(TRUE);
 }
 
+//=============================================================================
+//       SUPPORT FUNCTIONS
+//=============================================================================
 
-int SRLerrorout(char *c1,char *c2)
+int SRLerrorout(char *c1,const char *c2,int len)
 {
-  printf("\nERROR: %s - '%s'.",c1,c2);
+  printf("\nERROR: %s - '%.*s'.",c1,len,c2);
   return(FALSE);
 }
 
 
-int checksum(char *cp,int count)
+//  Decode count hex pairs into bytes and check the S-record checksum
+//  over all of them in one go: count + sum(bytes) must be 0xFF
+
+int checksum(const char *cp,int count,bit8u *bytes,const char *line,int len)
 {
-  char *scp;
+  int i, hi, lo;
   int cksum;
-  int dum;
-
-  scp=cp;
-  while(*scp)
-  {
-    if (!isxdigit(*scp++))
-      return(SRLerrorout("Invalid hex digits",cp));
-  }
-  scp=cp;
 
   cksum=count;
-
-  while(count)
+  for (i=0; i<count; i++)
   {
-    cksum += gh(scp,2);
-    if (count == 2)
-        dum = ~cksum;
-    scp += 2;
-    count--;
+    hi = HexVal[(bit8u) cp[2*i]];
+    lo = HexVal[(bit8u) cp[2*i+1]];
+    if ((hi | lo) < 0)
+      return(SRLerrorout("Invalid hex digits",line,len));
+    bytes[i] = (hi << 4) | lo;
+    cksum += bytes[i];
   }
-  cksum&=0x0ff; 
-  //  printf("\nCk:%02x",cksum);
+  cksum&=0x0ff;
   return(cksum==0x0ff);
 }
 
-bit32u gh(char *cp,int nibs)
+bit32u gb(const bit8u *bp,int bytes)
 {
-  int i;
-  bit32u j;
+  bit32u j=0;
 
-  j=0;
-
-  for(i=0;i<nibs;i++)
-  {
-    j<<=4;
-    if ((*cp>='a')&&(*cp<='z')) *cp &= 0x5f;
-    if ((*cp>='0')&&(*cp<='9')) 
-      j += (*cp-0x30);
-     else
-      if ((*cp>='A')&&(*cp<='F'))
-        j += (*cp-0x37);
-       else
-        SRLerrorout("Bad Hex char", cp);
-    cp++;
-  }
+  while (bytes--)
+    j = (j << 8) | *bp++;
   return(j);
 }
 
@@ -346,86 +351,80 @@ bit32u gh(char *cp,int nibs)
 //       PROCESS SREC LINE
 //=============================================================================
 
-int srecLine(char *pSrecLine)
+int srecLine(const char *pSrecLine,int len)
 {
-    char *scp,ch;
-    int  itmp,count,dat;
+    const char *scp;
+    char ch;
+    int  hi,lo,count,itmp;
     bit32u adr;
-    static bit32u RecordCounter=0;
+    bit8u bytes[256];
 
     cur_line++;
     scp=pSrecLine;
-  
+
     if (*pSrecLine!='S')
-      return(SRLerrorout("Not an Srecord file",scp));
-    pSrecLine++;
-    if (strlen(pSrecLine)<4)
-      return(SRLerrorout("Srecord too short",scp));
-  
-    ch=*pSrecLine++;
-  
-    count=gh(pSrecLine,2);
-  
-    pSrecLine += 2;
-  
-  //  if(debug)
-  //        printf("count %d, strlen(pSrecLine) = %d, pSrecLine =[%s]\n", count, strlen(pSrecLine), pSrecLine);
-     RecordCounter++;
-     DispHex(RecordCounter);
-  
-    if ((count*2) != strlen(pSrecLine)) return(SRLerrorout("Count field larger than record",scp));
-  
-    if (!checksum(pSrecLine, count)) return(SRLerrorout("Bad Checksum",scp));
-  
+      return(SRLerrorout("Not an Srecord file",scp,len));
+    if (len<5)
+      return(SRLerrorout("Srecord too short",scp,len));
+
+    ch=pSrecLine[1];
+
+    hi=HexVal[(bit8u) pSrecLine[2]];
+    lo=HexVal[(bit8u) pSrecLine[3]];
+    if ((hi | lo) < 0)
+      return(SRLerrorout("Bad Hex char",scp,len));
+    count=(hi << 4) | lo;
+
+    pSrecLine += 4;
+
+    if ((count*2) != len-4) return(SRLerrorout("Count field larger than record",scp,len));
+
+    if (!checksum(pSrecLine, count, bytes, scp, len)) return(SRLerrorout("Bad Checksum",scp,len));
+
     switch(ch)
     {
-        case '0': if (count<3) return(SRLerrorout("Invalid Srecord count field",scp));
-                  itmp=gh(pSrecLine,4); pSrecLine+=4; count-=2;
-                  if (itmp) return(SRLerrorout("Srecord 1 address not zero",scp));
+        case '0': if (count<3) return(SRLerrorout("Invalid Srecord count field",scp,len));
+                  itmp=gb(bytes,2);
+                  if (itmp) return(SRLerrorout("Srecord 1 address not zero",scp,len));
         break;
-        case '1': if (count<3) return(SRLerrorout("Invalid Srecord count field",scp));
-                  return(SRLerrorout("Srecord Not valid for MIPS",scp));
+        case '1': if (count<3) return(SRLerrorout("Invalid Srecord count field",scp,len));
+                  return(SRLerrorout("Srecord Not valid for MIPS",scp,len));
         break;
-        case '2': if (count<4) return(SRLerrorout("Invalid Srecord count field",scp));
-                  return(SRLerrorout("Srecord Not valid for MIPS",scp));
+        case '2': if (count<4) return(SRLerrorout("Invalid Srecord count field",scp,len));
+                  return(SRLerrorout("Srecord Not valid for MIPS",scp,len));
         break;
-        case '3': if (count<5) return(SRLerrorout("Invalid Srecord count field",scp));
-                  adr=gh(pSrecLine,8); pSrecLine+=8; count-=4;
-                  count--;
-                  while(count)
-                  {
-                    dat=gh(pSrecLine,2); pSrecLine+=2; count--;
-                    binRecOutByte(adr, (char) (dat & 0xFF));
-                    adr++;
-                  }
+        case '3': if (count<5) return(SRLerrorout("Invalid Srecord count field",scp,len));
+                  adr=gb(bytes,4);
+                  if (!binRecOutBytes(adr, bytes + 4, count - 5))
+                    return(FALSE);
                   s1s2s3_total++;
         break;
-        case '4': return(SRLerrorout("Invalid Srecord type",scp));
+        case '4': return(SRLerrorout("Invalid Srecord type",scp,len));
         break;
-        case '5': if (count<3) return(SRLerrorout("Invalid Srecord count field",scp));
-                  itmp=gh(pSrecLine,4); pSrecLine+=4; count-=2;
-                  if (itmp|=s1s2s3_total) return(SRLerrorout("Incorrect number of S3 Record processed",scp));
+        case '5': if (count<3) return(SRLerrorout("Invalid Srecord count field",scp,len));
+                  itmp=gb(bytes,2);
+                  if (itmp|=s1s2s3_total) return(SRLerrorout("Incorrect number of S3 Record processed",scp,len));
         break;
-        case '6': return(SRLerrorout("Invalid Srecord type",scp));
+        case '6': return(SRLerrorout("Invalid Srecord type",scp,len));
         break;
         case '7': // PROGRAM START
-                  if (count<5) return(SRLerrorout("Invalid Srecord count field",scp));
-                  adr=gh(pSrecLine,8); pSrecLine+=8; count-=4;
-                  if (count!=1) return(SRLerrorout("Invalid Srecord count field",scp));
-                  binRecOutProgramStart(adr);
+                  if (count<5) return(SRLerrorout("Invalid Srecord count field",scp,len));
+                  adr=gb(bytes,4);
+                  if (count!=5) return(SRLerrorout("Invalid Srecord count field",scp,len));
+                  return(binRecOutProgramStart(adr));
         break;
-        case '8': if (count<4) return(SRLerrorout("Invalid Srecord count field",scp));
-                  return(SRLerrorout("Srecord Not valid for MIPS",scp));
+        case '8': if (count<4) return(SRLerrorout("Invalid Srecord count field",scp,len));
+                  return(SRLerrorout("Srecord Not valid for MIPS",scp,len));
         break;
-        case '9': if (count<3) return(SRLerrorout("Invalid Srecord count field",scp));
-                  return(SRLerrorout("Srecord Not valid for MIPS",scp));
+        case '9': if (count<3) return(SRLerrorout("Invalid Srecord count field",scp,len));
+                  return(SRLerrorout("Srecord Not valid for MIPS",scp,len));
         break;
         default:
         break;
     }
     return(TRUE);
 }
- 
+
 
 //=============================================================================
 //       MAIN LOGIC, READS IN LINE AND OUTPUTS BINARY
@@ -433,22 +432,25 @@ int srecLine(char *pSrecLine)
 
 int srec2bin(int argc,char *argv[],int verbose)
 {
-    int i,rlen,sts;
-    FILE *fp;
-    char ac;
-    char buff[256];
+    int fd,len,sts;
+    struct stat st;
+    const char *map,*cp,*end,*eol;
+    struct timeval t0,t1;
+    double secs;
+    bit8u tag[4];
+    struct iovec iov;
     bit32u TAG_BIG     = 0xDEADBE42;
     bit32u TAG_LITTLE  = 0xFEEDFA42;
 
     bit32u Tag;
 
-  
+
     if(argc < 3)
     {
-      printf("\nError: <srec2bin <srec input file> <bin output file>\n\n");
+      printf("\nError: <srec2bin [-v] [-r] <srec input file> <bin output file>\n\n");
       return(0);
     }
-  
+
     if (argc > 3) BigEndian=TRUE; else BigEndian=FALSE;
 
     if (BigEndian)
@@ -456,69 +458,125 @@ int srec2bin(int argc,char *argv[],int verbose)
     else
         Tag = TAG_LITTLE;
 
-    if (verbose)
+    if (verbose && !RawImage)
        printf("\nEndian: %s, Tag is 0x%8X\n",(BigEndian)?"BIG":"LITTLE", Tag);
 
-    fp = fopen(argv[1],"rt");
+    gettimeofday(&t0, NULL);
+
+    fd = open(argv[1], O_RDONLY);
 
-    if (fp==NULL)
+    if (fd<0 || fstat(fd, &st)<0)
     {
       printf("\nError: Opening input file, %s.", argv[1]);
+      if (fd>=0) close(fd);
       return(0);
     }
-  
-    fOut = fopen( argv[2], "wb");
-    
-    if (fOut==NULL)
+
+    map = NULL;
+    if (st.st_size > 0)
+    {
+      map = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+      if (map == MAP_FAILED)
+      {
+        printf("\nError: Mapping input file, %s.", argv[1]);
+        close(fd);
+        return(0);
+      }
+      madvise((void *) map, st.st_size, MADV_SEQUENTIAL);
+    }
+
+    fOut = open( argv[2], O_WRONLY | O_CREAT | O_TRUNC, 0666);
+
+    if (fOut<0)
     {
       printf("\nError: Opening Output file, %s.", argv[2]);
-      if(fp) fclose(fp);
+      if (map) munmap((void *) map, st.st_size);
+      close(fd);
       return(0);
     }
- 
+
+    HexInit();
+
     RecStart = FALSE;
 
     AddressCurrent = 0xFFFFFFFFL;
 
-    // Setup Tag 
-  
-    dumpfTell("Tag", Tag);
-
-    binOut32(Tag);
+    // Setup Tag
 
-  
-    inputline=0;
     sts=TRUE;
 
-    rlen = readline(fp,buff,sizeof buff);
+    if (!RawImage)
+    {
+        binPut32(tag, Tag);
+        iov.iov_base = tag;
+        iov.iov_len = sizeof(tag);
+        sts = binWrite(&iov, 1);
+    }
 
-    while( (sts) && (rlen != -1))
+    // Walk the mapped file a line at a time; carriage returns are dropped
+    // and blank lines skipped
+
+    cp = map;
+    end = map + st.st_size;
+    while (sts && cp < end)
     {
-        if (strlen(buff))
+        eol = memchr(cp, '\n', end - cp);
+        if (!eol)
+            eol = end;
+
+        len = eol - cp;
+        while (len && cp[len-1] == '\r')
+            len--;
+
+        if (len)
         {
-            sts &= srecLine(buff);
+            sts &= srecLine(cp, len);
             WaitDisplay();
         }
-       rlen = readline(fp,buff,sizeof buff);
+        cp = eol + 1;
     }
 
-  
-  //  printf("PC: 0x%08X, Length 0x%08X, Tag 0x%08X\n", ProgramStart, RecLength, TAG_LITTLE);
-  
+
     binRecEnd();
 
-    if(fp) fclose(fp);
-    if(fOut) fclose(fOut);
+    gettimeofday(&t1, NULL);
+
+    if (verbose)
+    {
+        secs = (t1.tv_sec - t0.tv_sec) + (t1.tv_usec - t0.tv_usec) / 1e6;
+        printf("\n%d lines, %lu bytes in %u records, %.3f s",
+               cur_line, BytesOut, RecordsOut, secs);
+        if (secs > 0)
+            printf(" (%.1f MB/s)", st.st_size / secs / 1e6);
+        printf("\n");
+    }
+
+    if (map) munmap((void *) map, st.st_size);
+    close(fd);
+    close(fOut);
+    free(RecData);
 
     return(1);
 }
 
-main(int argc, char *argv[])
+int main(int argc, char *argv[])
 {
-    debug = TRUE;
+    int c;
+
     debug = FALSE;
     verbose = FALSE;
-    srec2bin(argc,argv,verbose);
+    RawImage = FALSE;
+
+    while ((c = getopt(argc, argv, "vr")) != -1)
+    {
+        switch (c)
+        {
+            case 'v': verbose = TRUE; break;
+            case 'r': RawImage = TRUE; break;
+            default:  return 1;
+        }
+    }
+
+    srec2bin(argc - optind + 1, argv + optind - 1, verbose);
     return 0;
 }
-
@@ -27,16 +27,61 @@
 
 static char default_pattern[] = "12345678";
 
+#define BUF_SIZE	(1024 * 1024)
 
-int xor_data(uint8_t *data, size_t len, const uint8_t *pattern, int p_len, int p_off)
+/*
+ * Return the pattern repeated often enough that every run of *xp_len bytes
+ * starting at any pattern offset is contiguous, *xp_len being a multiple of
+ * both the pattern length and the word size.
+ */
+static uint8_t *expand_pattern(const uint8_t *pattern, int p_len, size_t *xp_len)
 {
-	int offset = p_off;
-	while (len--) {
-		*data ^= pattern[offset];
-		data++;
-		offset = (offset + 1) % p_len;
+	uint8_t *xp;
+	size_t i;
+
+	*xp_len = p_len * sizeof(uint64_t) * 16;
+	xp = malloc(*xp_len + p_len);
+	if (!xp)
+		return NULL;
+
+	for (i = 0; i < *xp_len + p_len; i++)
+		xp[i] = pattern[i % p_len];
+
+	return xp;
+}
+
+static void xor_words(uint8_t *data, const uint8_t *pat, size_t len)
+{
+	uint64_t d, p;
+
+	for (; len >= sizeof(d); len -= sizeof(d)) {
+		memcpy(&d, data, sizeof(d));
+		memcpy(&p, pat, sizeof(p));
+		d ^= p;
+		memcpy(data, &d, sizeof(d));
+		data += sizeof(d);
+		pat += sizeof(d);
 	}
-	return offset;
+
+	while (len--)
+		*data++ ^= *pat++;
+}
+
+/* xor with the pattern expanded by expand_pattern(), returns the new offset */
+int xor_data(uint8_t *data, size_t len, const uint8_t *xp, size_t xp_len,
+	     int p_len, int p_off)
+{
+	size_t n;
+
+	while (len) {
+		n = (len < xp_len) ? len : xp_len;
+		xor_words(data, &xp[p_off], n);
+		p_off = (p_off + n) % p_len;
+		data += n;
+		len -= n;
+	}
+
+	return p_off;
 }
 
 
@@ -51,12 +96,14 @@ void usage(void)
 
 int main(int argc, char **argv)
 {
-	char buf[1024];	/* keep this at 1k or adjust garbage calc below */
+	char *buf;
 	FILE *in = stdin;
 	FILE *out = stdout;
 	char *ifn = NULL;
 	char *ofn = NULL;
 	const char *pattern = default_pattern;
+	uint8_t *xp;
+	size_t xp_len;
 	int c;
 	int v0, v1, v2;
 	size_t n;
@@ -101,9 +148,15 @@ int main(int argc, char **argv)
 		usage();
 	}
 
+	buf = malloc(BUF_SIZE);
+	xp = expand_pattern((const uint8_t *) pattern, p_len, &xp_len);
+	if (!buf || !xp) {
+		fprintf(stderr, "out of memory\n");
+		return EXIT_FAILURE;
+	}
 
-	while ((n = fread(buf, 1, sizeof(buf), in)) > 0) {
-		if (n < sizeof(buf)) {
+	while ((n = fread(buf, 1, BUF_SIZE, in)) > 0) {
+		if (n < BUF_SIZE) {
 			if (ferror(in)) {
 			FREAD_ERROR:
 				fprintf(stderr, "fread error\n");
@@ -111,7 +164,7 @@ int main(int argc, char **argv)
 			}
 		}
 
-		p_off = xor_data(buf, n, pattern, p_len, p_off);
+		p_off = xor_data((uint8_t *) buf, n, xp, xp_len, p_len, p_off);
 
 		if (!fwrite(buf, n, 1, out)) {
 		FWRITE_ERROR:
@@ -17,6 +17,9 @@
 #include <unistd.h>
 #include <sys/types.h>
 #include <sys/stat.h>
+#include <sys/mman.h>
+#include <sys/uio.h>
+#include <limits.h>
 
 static char *progname;
 static unsigned int xtra_offset;
@@ -25,6 +28,7 @@ static unsigned char jffs2_pad_be[] = "\x19\x85\x20\x04\x04\x00\x00\x00\xc4\x94\
 static unsigned char jffs2_pad_le[] = "\x85\x19\x04\x20\x00\x00\x00\x04\xa8\xfb\xa0\xb4";
 static unsigned char *pad = eof_mark;
 static int pad_len = sizeof(eof_mark);
+static char *out_prefix;
 
 #define ERR(fmt, ...) do { \
 	fflush(0); \
@@ -40,40 +44,25 @@ static int pad_len = sizeof(eof_mark);
 } while (0)
 
 #define BUF_SIZE	(64 * 1024)
+#define MAX_PADS	32
 #define ALIGN(_x,_y)	(((_x) + ((_y) - 1)) & ~((_y) - 1))
 
-static int pad_image(char *name, uint32_t pad_mask)
-{
-	char *buf;
-	int fd;
-	ssize_t in_len;
-	ssize_t out_len;
-	int ret = -1;
-
-	buf = malloc(BUF_SIZE);
-	if (!buf) {
-		ERR("No memory for buffer");
-		goto out;
-	}
-
-	fd = open(name, O_RDWR);
-	if (fd < 0) {
-		ERRS("Unable to open %s", name);
-		goto free_buf;
-	}
+#ifndef IOV_MAX
+#define IOV_MAX		1024
+#endif
 
-	in_len = lseek(fd, 0, SEEK_END);
-	if (in_len < 0)
-		goto close;
-
-	memset(buf, '\xff', BUF_SIZE);
+/*
+ * Work out where the end-of-filesystem marks go. Every mask bit not already
+ * satisfied by the previous boundary gets its own mark; positions are file
+ * offsets without the extra offset.
+ */
+static int pad_layout(ssize_t in_len, uint32_t pad_mask, ssize_t *pos)
+{
+	int n = 0;
 
 	in_len += xtra_offset;
-
-	out_len = in_len;
 	while (pad_mask) {
 		uint32_t mask;
-		ssize_t t;
 		int i;
 
 		for (i = 10; i < 32; i++) {
@@ -90,39 +79,196 @@ static int pad_image(char *name, uint32_t pad_mask)
 				pad_mask &= ~mask;
 		}
 
-		printf("padding image to %08x\n", (unsigned int) in_len - xtra_offset);
+		pos[n++] = in_len - xtra_offset;
+		in_len += pad_len;
+	}
 
-		while (out_len < in_len) {
-			ssize_t len;
+	return n;
+}
 
-			len = in_len - out_len;
-			if (len > BUF_SIZE)
-				len = BUF_SIZE;
+/*
+ * Write the filler and the marks between ofs and the last mark with as few
+ * writev() calls as possible, every filler chunk points at the same 0xff
+ * page.
+ */
+static int write_pads(int fd, const char *name, ssize_t ofs, ssize_t *pos,
+		      int n, const char *ff)
+{
+	struct iovec iov[IOV_MAX];
+	ssize_t len, t, total = 0;
+	int i, cnt = 0;
+
+	for (i = 0; i < n; i++) {
+		printf("padding image to %08x\n", (unsigned int) pos[i]);
+
+		for (;;) {
+			if (cnt == IOV_MAX) {
+				t = writev(fd, iov, cnt);
+				if (t != total)
+					goto err;
+				cnt = 0;
+				total = 0;
+			}
 
-			t = write(fd, buf, len);
-			if (t != len) {
-				ERRS("Unable to write to %s", name);
-				goto close;
+			if (ofs == pos[i]) {
+				iov[cnt].iov_base = pad;
+				iov[cnt++].iov_len = pad_len;
+				total += pad_len;
+				ofs += pad_len;
+				break;
 			}
 
-			out_len += len;
+			len = pos[i] - ofs;
+			if (len > BUF_SIZE)
+				len = BUF_SIZE;
+
+			iov[cnt].iov_base = (void *) ff;
+			iov[cnt++].iov_len = len;
+			total += len;
+			ofs += len;
 		}
+	}
+
+	if (cnt && writev(fd, iov, cnt) != total)
+		goto err;
+
+	return 0;
+
+err:
+	ERRS("Unable to write to %s", name);
+	return -1;
+}
+
+static void reserve(int fd, off_t ofs, off_t len)
+{
+#ifdef __linux__
+	posix_fallocate(fd, ofs, len);
+#endif
+}
+
+static char *alloc_ff(void)
+{
+	char *ff;
+
+	ff = mmap(NULL, BUF_SIZE, PROT_READ | PROT_WRITE,
+		  MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+	if (ff == MAP_FAILED) {
+		ERR("No memory for buffer");
+		return NULL;
+	}
+
+	memset(ff, '\xff', BUF_SIZE);
+	return ff;
+}
+
+static int pad_image(char *name, uint32_t pad_mask)
+{
+	ssize_t pos[MAX_PADS];
+	char *ff;
+	int fd, n;
+	ssize_t in_len;
+	int ret = -1;
 
-		/* write out the JFFS end-of-filesystem marker */
-		t = write(fd, pad, pad_len);
-		if (t != pad_len) {
-			ERRS("Unable to write to %s", name);
+	ff = alloc_ff();
+	if (!ff)
+		goto out;
+
+	fd = open(name, O_RDWR);
+	if (fd < 0) {
+		ERRS("Unable to open %s", name);
+		goto free_buf;
+	}
+
+	in_len = lseek(fd, 0, SEEK_END);
+	if (in_len < 0)
+		goto close;
+
+	n = pad_layout(in_len, pad_mask, pos);
+
+	/* reserve the final size up front so the file is extended only once */
+	reserve(fd, in_len, pos[n - 1] + pad_len - in_len);
+
+	ret = write_pads(fd, name, in_len, pos, n, ff);
+
+close:
+	close(fd);
+free_buf:
+	munmap(ff, BUF_SIZE);
+out:
+	return ret;
+}
+
+/*
+ * Write one output file per pad size, each holding the image padded to that
+ * size alone. The input is mapped once and shared by all of them.
+ */
+static int pad_variants(char *name, uint32_t *sizes, int n_sizes)
+{
+	char out_name[PATH_MAX];
+	ssize_t pos[MAX_PADS];
+	ssize_t in_len;
+	char *ff, *data = NULL;
+	int fd, out, i, n;
+	int ret = -1;
+
+	ff = alloc_ff();
+	if (!ff)
+		goto out;
+
+	fd = open(name, O_RDONLY);
+	if (fd < 0) {
+		ERRS("Unable to open %s", name);
+		goto free_buf;
+	}
+
+	in_len = lseek(fd, 0, SEEK_END);
+	if (in_len < 0)
+		goto close;
+
+	if (in_len) {
+		data = mmap(NULL, in_len, PROT_READ, MAP_PRIVATE, fd, 0);
+		if (data == MAP_FAILED) {
+			ERRS("Unable to map %s", name);
 			goto close;
 		}
-		out_len += pad_len;
+	}
+
+	for (i = 0; i < n_sizes; i++) {
+		snprintf(out_name, sizeof(out_name), "%s-%uk", out_prefix,
+			 sizes[i] / 1024);
+
+		out = open(out_name, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+		if (out < 0) {
+			ERRS("Unable to open %s", out_name);
+			goto unmap;
+		}
+
+		n = pad_layout(in_len, sizes[i], pos);
+		reserve(out, 0, pos[n - 1] + pad_len);
+
+		if (write(out, data, in_len) != in_len) {
+			ERRS("Unable to write to %s", out_name);
+			close(out);
+			goto unmap;
+		}
+
+		if (write_pads(out, out_name, in_len, pos, n, ff)) {
+			close(out);
+			goto unmap;
+		}
+
+		close(out);
 	}
 
 	ret = 0;
 
+unmap:
+	if (data)
+		munmap(data, in_len);
 close:
 	close(fd);
 free_buf:
-	free(buf);
+	munmap(ff, BUF_SIZE);
 out:
 	return ret;
 }
@@ -133,6 +279,8 @@ static int usage(void)
 		"Usage: %s file [<options>] [pad0] [pad1] [padN]\n"
 		"Options:\n"
 		"  -x <offset>:          Add an extra offset for padding data\n"
+		"  -o <prefix>:          Leave the input alone and write one padded copy\n"
+		"                        per pad size to <prefix>-<size>k\n"
 		"  -J:                   Use a fake big-endian jffs2 padding element instead of EOF\n"
 		"                        This is used to work around broken boot loaders that\n"
 		"                        try to parse the entire firmware area as one big jffs2\n"
@@ -146,6 +294,8 @@ int main(int argc, char* argv[])
 {
 	char *image;
 	uint32_t pad_mask;
+	uint32_t sizes[MAX_PADS];
+	int n_sizes = 0;
 	int ret = EXIT_FAILURE;
 	int err;
 	int ch, i;
@@ -160,13 +310,16 @@ int main(int argc, char* argv[])
 	argc--;
 
 	pad_mask = 0;
-	while ((ch = getopt(argc, argv, "x:Jj")) != -1) {
+	while ((ch = getopt(argc, argv, "x:o:Jj")) != -1) {
 		switch (ch) {
 		case 'x':
 			xtra_offset = strtoul(optarg, NULL, 0);
 			fprintf(stderr, "assuming %u bytes offset\n",
 				xtra_offset);
 			break;
+		case 'o':
+			out_prefix = optarg;
+			break;
 		case 'J':
 			pad = jffs2_pad_be;
 			pad_len = sizeof(jffs2_pad_be) - 1;
@@ -180,14 +333,26 @@ int main(int argc, char* argv[])
 		}
 	}
 
-	for (i = optind; i < argc; i++)
-		pad_mask |= strtoul(argv[i], NULL, 0) * 1024;
+	for (i = optind; i < argc; i++) {
+		uint32_t size = strtoul(argv[i], NULL, 0) * 1024;
 
-	if (pad_mask == 0)
+		if (size && n_sizes < MAX_PADS)
+			sizes[n_sizes++] = size;
+		pad_mask |= size;
+	}
+
+	if (pad_mask == 0) {
 		pad_mask = (4 * 1024) | (8 * 1024) | (64 * 1024) |
 			   (128 * 1024);
+		for (i = 12; i <= 17; i++)
+			if (pad_mask & (1UL << i))
+				sizes[n_sizes++] = 1UL << i;
+	}
 
-	err = pad_image(image, pad_mask);
+	if (out_prefix)
+		err = pad_variants(image, sizes, n_sizes);
+	else
+		err = pad_image(image, pad_mask);
 	if (err)
 		goto out;
 